@@ -1,6 +1,9 @@
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
 #include <stdlib.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "fakio.h"
 #include "base/ini.h"
@@ -9,28 +12,124 @@
 
 #define REPLY_SIZE 12
 #define MAX_PASSWORD 64
+#define ACCEPT_BATCH 32
+#define DEFAULT_PADDING_MAX 32
+#define DEFAULT_EARLY_DATA_WAIT 10
+#define EARLY_DATA_BACKOFF 60000 /* early data 被拒绝之后多久不再使用(毫秒) */
+#define DEFAULT_CONNECT_TIMEOUT 5000
+#define MUX_MAX_SESSIONS 16
+#define MAX_THREADS 64
+#define HTTP_HEADER_MAX 4096
+#define POOL_MAX 32
+#define DEFAULT_POOL_IDLE 8000
+#define POOL_IDLE_MAX 9000      /* server 在 accept 之后 10 秒内收不到握手就关闭连接 */
+#define POOL_CHECK_INTERVAL 500
+#define POOL_RETRY_DELAY 1000
+#define DEFAULT_UDP_TIMEOUT 60
+#define SERVER_MAX 16
+#define DEFAULT_PROBE_INTERVAL 2000
+#define UPSTREAM_EWMA 0.3       /* 新样本的权重 */
+#define UPSTREAM_HEALTHY 0.5    /* 成功率低于它的 server 不再使用 */
 
 typedef struct {
     uint8_t username[MAX_USERNAME];
     uint8_t name_len;
     uint8_t key[32];
-    fcrypt_rand_t *r;
     
     char chost[MAX_HOST_LEN];
     char cport[MAX_PORT_LEN];
+    int threads; /* event loop 的线程数 */
+    char redir_port[MAX_PORT_LEN]; /* 透明代理的监听端口，空表示不使用 */
+    int tproxy;  /* 透明代理的连接来自 TPROXY，否则是 REDIRECT */
+    char http_port[MAX_PORT_LEN];  /* HTTP CONNECT 代理的监听端口，空表示不使用 */
+    int udp_timeout; /* UDP ASSOCIATE 的关联空闲多少秒后关闭 */
 
     char shost[MAX_HOST_LEN];
     char sport[MAX_PORT_LEN];
+    struct {
+        char host[MAX_HOST_LEN];
+        char port[MAX_PORT_LEN];
+        struct fnet_addrlist addrs; /* 启动时解析一次，之后连接不再查询 DNS */
+    } servers[SERVER_MAX]; /* host/port 在前，后面是 servers 中的 */
+    int nservers;
+    int probe_interval; /* 探测各个 server 的间隔(毫秒)，只有一个 server 时不探测 */
+    int fastopen; /* 使用 TCP Fast Open 连接服务端 */
+    int version;  /* 握手协议版本，老的服务端只支持 1 */
+    int padding_min, padding_max; /* v2 握手随机填充的字节数范围 */
+    int early_data_wait; /* 等待 early data 的毫秒数，0 表示不使用 */
+    int mux; /* 多路复用的隧道数，0 表示每个请求单独连接 server */
+    int stripes; /* 一个请求最多使用的连接数，大于 1 时下载分散到多条连接上 */
+    int connect_timeout; /* 连接 server 的超时(毫秒) */
+    int pool;      /* 预先连接好的 server 连接数，0 表示不使用 */
+    int pool_idle; /* 预先连接的连接最多空闲的毫秒数 */
+    int ticket;    /* 使用 server 签发的 session ticket */
 } fclient_t;
 
-static context_pool_t *pool;
 static fclient_t client;
 
+/*
+ * 每个线程一个 event loop，各自监听同一个端口(SO_REUSEPORT)。下面的状态
+ * 每个线程一份，只在自己的 event loop 中使用，不需要加锁
+ */
+static __thread context_pool_t *pool;
+static __thread fcrypt_rand_t *rnd;
+
+/* server 签发的 session ticket，有效时新连接不用等待 server 的回复 */
+struct session_ticket {
+    uint8_t data[FTICKET_MAX_LEN];
+    int len;
+    uint8_t secret[FTICKET_SECRET_LEN];
+    long long renew; /* 在此之后重新做完整握手来换新的 ticket */
+};
+
+/*
+ * 每个 server 的状况: 后台定时探测它的连接耗时(TCP 握手的 RTT)，探测和
+ * 真实的连接一起更新成功率，都用 EWMA 平滑。新的请求使用健康的 server 中
+ * 得分最低的；连接失败时马上标记为 down，之后的请求不再使用它，直到再有
+ * 一次连接成功
+ */
+struct upstream {
+    double rtt;       /* 毫秒，< 0 表示还没有样本 */
+    double success;   /* 0 ~ 1 */
+    int down;
+    int probe_fd;     /* 正在进行的探测，0 表示没有 */
+    long long probe_start;
+    struct session_ticket ticket; /* 各个 server 的 ticket key 不一定相同 */
+    long long early_off; /* 在此之前不使用 early data，见 early_data_resend */
+};
+
+static __thread struct upstream upstreams[SERVER_MAX];
+
+/* 建立中或者已经建立的隧道，关闭时由 mux_closed_cb 清空 */
+static __thread fmux_t *mux_sessions[MUX_MAX_SESSIONS];
+static __thread int mux_next;
+
+/* 预先连接好、还没有发送握手的 server 连接 */
+struct pool_conn {
+    int fd;
+    int upstream;
+    long long expire;
+};
+
+static __thread struct {
+    struct pool_conn conns[POOL_MAX]; /* 按连接上的先后排列，最早过期的在前 */
+    int n;
+    int connecting;   /* 正在连接的个数 */
+    long long retry;  /* 连接失败之后，在此之前不再补充 */
+} conn_pool;
+
 void socks5_handshake1_cb(struct event_loop *loop, int fd, int mask, void *evdata);
 void socks5_handshake2_cb(struct event_loop *loop, int fd, int mask, void *evdata);
+static void http_request_cb(struct event_loop *loop, int fd, int mask, void *evdata);
 void server_handshake1_cb(struct event_loop *loop, int fd, int mask, void *evdata);
 void server_handshake2_cb(struct event_loop *loop, int fd, int mask, void *evdata);
+static void server_handshake_send(context_t *c);
+static void server_handshake_sent(context_t *c);
+static void server_connect_wait(context_t *c, int connected);
+static void client_early_data_cb(struct event_loop *loop, int fd, int mask, void *evdata);
+static long early_data_timeout_cb(struct event_loop *loop, void *evdata);
 static void client_readable_cb(struct event_loop *loop, int fd, int mask, void *evdata);
+static void udp_control_cb(struct event_loop *loop, int fd, int mask, void *evdata);
 static void client_writable_cb(struct event_loop *loop, int fd, int mask, void *evdata);
 static void remote_writable_cb(struct event_loop *loop, int fd, int mask, void *evdata);
 static void remote_readable_cb(struct event_loop *loop, int fd, int mask, void *evdata);
@@ -45,23 +144,1025 @@ static inline int client_fcrypt_ctx_init(fcrypt_ctx_t *ctx, uint8_t bytes[48])
     return fcrypt_set_key(ctx, ctx->key, 128);
 }
 
+/* 加密部分的开始位置，跳过 IV 和用户名或者 ticket */
+static inline int handshake_body_offset(const uint8_t *buf)
+{
+    if (buf[16] == 0) {
+        return 16 + 1 + 2 + ntohs(*(uint16_t *)(buf + 17));
+    }
+    return 16 + 1 + buf[16];
+}
+
+/*
+ * 使用 ticket 的连接在收到 server 的数据之前就断开，多半是 ticket 已经
+ * 失效(server 重启或者换了 ticket_secret)，丢掉它，下次做完整握手
+ */
+static inline void ticket_check_rejected(context_t *c)
+{
+    if (c->hs_state & HS_RESUMED) {
+        fakio_log(LOG_WARNING, "session ticket rejected by server %s:%s",
+                  client.servers[c->upstream].host, client.servers[c->upstream].port);
+        upstreams[c->upstream].ticket.len = 0;
+    }
+}
+
+/*
+ * 握手的开头: IV | name_len | name，ticket 有效时是 IV | 0 | TLEN | TICKET，
+ * 并由 ticket 直接算出本次连接的密钥
+ *
+ * Return value: 已经写入 req 的长度
+ */
+static int handshake_begin(context_t *c)
+{
+    struct session_ticket *t = &upstreams[c->upstream].ticket;
+
+    random_bytes(rnd, FBUF_WRITE_AT(c->req), 16);
+    if (client.version != 1) {
+        /* IV 的前 4 字节是当前时间，server 用来拒绝 0-RTT 握手的重放 */
+        *(uint32_t *)FBUF_WRITE_AT(c->req) = htonl((uint32_t)time(NULL));
+    }
+
+    /* 重试时 ticket 的握手同样是 0-RTT，会因为同样的原因被拒绝 */
+    if (client.version != 1 && t->len > 0 && !(c->hs_state & HS_RETRY)
+        && fakio_now_ms() < t->renew) {
+        /* 用 ticket 代替用户名，IV 作为 nonce 算出本次连接的密钥 */
+        uint8_t bytes[48];
+        *FBUF_WRITE_SEEK(c->req, 16) = 0;
+        *(uint16_t *)FBUF_WRITE_SEEK(c->req, 17) = htons(t->len);
+        memcpy(FBUF_WRITE_SEEK(c->req, 19), t->data, t->len);
+
+        fticket_derive(t->secret, FBUF_DATA_AT(c->req), bytes);
+        client_fcrypt_ctx_init(c->crypto, bytes);
+        memset(bytes, 0, sizeof(bytes));
+        c->hs_state |= HS_RESUMED;
+        return 16 + 1 + 2 + t->len;
+    }
+
+    *FBUF_WRITE_SEEK(c->req, 16) = client.name_len;
+    memcpy(FBUF_WRITE_SEEK(c->req, 17), client.username, client.name_len);
+
+    fcrypt_set_key(c->crypto, client.key, 256);
+    if (client.ticket && client.version != 1) {
+        c->hs_state |= HS_TICKET;
+    }
+    return 16 + 1 + client.name_len;
+}
+
+static inline int handshake_ticket_req(context_t *c)
+{
+    return (c->hs_state & HS_TICKET) ? FAKIO_HS_TICKET_REQ : 0;
+}
+
+/* ok 为 0 表示连接失败，rtt < 0 表示这次没有 RTT 的样本 */
+static void upstream_update(int i, int ok, double rtt)
+{
+    struct upstream *u = &upstreams[i];
+
+    u->success += UPSTREAM_EWMA * ((ok ? 1.0 : 0.0) - u->success);
+    if (!ok) {
+        if (!u->down) {
+            u->down = 1;
+            fakio_log(LOG_WARNING, "server %s:%s is down", client.servers[i].host,
+                      client.servers[i].port);
+        }
+        return;
+    }
+    if (rtt >= 0) {
+        u->rtt = u->rtt < 0 ? rtt : u->rtt + UPSTREAM_EWMA * (rtt - u->rtt);
+    }
+    if (u->down) {
+        u->down = 0;
+        fakio_log(LOG_INFO, "server %s:%s is up", client.servers[i].host,
+                  client.servers[i].port);
+    }
+}
+
+/* 越小越好，成功率低的按比例放大延迟；还没有样本的会先被试用 */
+static inline double upstream_score(const struct upstream *u)
+{
+    double rtt = u->rtt < 0 ? 0 : u->rtt;
+    return (rtt + 1) / (u->success > 0.01 ? u->success : 0.01);
+}
+
+static inline int upstream_healthy(const struct upstream *u)
+{
+    return !u->down && u->success >= UPSTREAM_HEALTHY;
+}
+
+/*
+ * 选择健康的 server 中得分最低的。都不健康时选择成功率最高的，总要有一个
+ * 可以尝试；healthy 为 1 时不这样做(刚刚连接失败，换一个重试)
+ *
+ * Return value: server 的序号, -1 没有健康的 server
+ */
+static int upstream_select(int healthy)
+{
+    int i, best = -1, fallback = 0;
+
+    for (i = 0; i < client.nservers; i++) {
+        struct upstream *u = &upstreams[i];
+        if (u->success > upstreams[fallback].success) {
+            fallback = i;
+        }
+        if (upstream_healthy(u)
+            && (best < 0 || upstream_score(u) < upstream_score(&upstreams[best]))) {
+            best = i;
+        }
+    }
+    if (best < 0 && !healthy) {
+        best = fallback;
+    }
+    return best;
+}
+
+/* 以非阻塞方式连接 server i 启动时解析好的地址，不会在 event loop 中等待 DNS */
+static inline int server_open(int i, int flags)
+{
+    return fnet_connect_addrinfo(client.servers[i].addrs.ai, client.servers[i].host,
+                                 client.servers[i].port, flags);
+}
+
+static void probe_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    struct upstream *u = evdata;
+    int i = u - upstreams;
+
+    delete_event(loop, fd, EV_WRABLE);
+    int err = fnet_connect_result(fd);
+    close(fd);
+    u->probe_fd = 0;
+
+    upstream_update(i, err == 0, (double)(fakio_now_ms() - u->probe_start));
+    LOG_FOR_DEBUG("probe %s:%s %s, rtt=%.1f success=%.2f", client.servers[i].host,
+                  client.servers[i].port, err == 0 ? "ok" : strerror(err),
+                  u->rtt, u->success);
+}
+
+/*
+ * 在后台连接每个 server 启动时解析好的地址来测量 RTT，连上就关闭，不发送
+ * 握手。超过 connect_timeout 还没有连上的算作失败。每个线程各自探测
+ */
+static long probe_timer_cb(struct event_loop *loop, void *evdata)
+{
+    long long now = fakio_now_ms();
+    int i;
+
+    for (i = 0; i < client.nservers; i++) {
+        struct upstream *u = &upstreams[i];
+
+        if (u->probe_fd > 0) {
+            if (now - u->probe_start < client.connect_timeout) {
+                continue;
+            }
+            delete_event(loop, u->probe_fd, EV_WRABLE);
+            close(u->probe_fd);
+            u->probe_fd = 0;
+            upstream_update(i, 0, -1);
+        }
+
+        int fd = server_open(i, FNET_CONNECT_NONBLOCK);
+        if (fd < 0) {
+            upstream_update(i, 0, -1);
+            continue;
+        }
+        if (create_event(loop, fd, EV_WRABLE, &probe_cb, u) < 0) {
+            close(fd);
+            continue;
+        }
+        u->probe_fd = fd;
+        u->probe_start = now;
+    }
+    return client.probe_interval;
+}
+
+static void pool_remove(int i)
+{
+    conn_pool.n--;
+    memmove(&conn_pool.conns[i], &conn_pool.conns[i+1],
+            (conn_pool.n - i) * sizeof(struct pool_conn));
+}
+
+/* 空闲的连接可读说明 server 关闭了它，直接丢掉 */
+static void pool_idle_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    int i;
+
+    for (i = 0; i < conn_pool.n; i++) {
+        if (conn_pool.conns[i].fd == fd) {
+            pool_remove(i);
+            break;
+        }
+    }
+    LOG_FOR_DEBUG("pooled connection %d closed by server", fd);
+    delete_event(loop, fd, EV_RDABLE);
+    close(fd);
+}
+
+static void pool_connected_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    int i = (struct upstream *)evdata - upstreams;
+
+    delete_event(loop, fd, EV_WRABLE);
+    conn_pool.connecting--;
+
+    int err = fnet_connect_result(fd);
+    if (err != 0) {
+        fakio_log(LOG_WARNING, "pool connect %s:%s - %s", client.servers[i].host,
+                  client.servers[i].port, strerror(err));
+        close(fd);
+        upstream_update(i, 0, -1);
+        conn_pool.retry = fakio_now_ms() + POOL_RETRY_DELAY;
+        return;
+    }
+    set_socket_option(fd);
+    upstream_update(i, 1, -1);
+
+    struct pool_conn *pc = &conn_pool.conns[conn_pool.n++];
+    pc->fd = fd;
+    pc->upstream = i;
+    pc->expire = fakio_now_ms() + client.pool_idle;
+    create_event(loop, fd, EV_RDABLE, &pool_idle_cb, NULL);
+}
+
+/* 以非阻塞方式补充连接，不会阻塞 event loop，连接的是当前选中的 server */
+static void pool_fill(struct event_loop *loop)
+{
+    if (fakio_now_ms() < conn_pool.retry) {
+        return;
+    }
+
+    int i = upstream_select(0);
+    while (conn_pool.n + conn_pool.connecting < client.pool) {
+        int fd = server_open(i, FNET_CONNECT_NONBLOCK);
+        if (fd < 0) {
+            conn_pool.retry = fakio_now_ms() + POOL_RETRY_DELAY;
+            return;
+        }
+        if (create_event(loop, fd, EV_WRABLE, &pool_connected_cb, &upstreams[i]) < 0) {
+            close(fd);
+            return;
+        }
+        conn_pool.connecting++;
+    }
+}
+
+/* 在 server 的握手超时之前关闭空闲太久的连接，并补充新的连接 */
+static long pool_timer_cb(struct event_loop *loop, void *evdata)
+{
+    long long now = fakio_now_ms();
+
+    while (conn_pool.n > 0 && conn_pool.conns[0].expire <= now) {
+        int fd = conn_pool.conns[0].fd;
+        pool_remove(0);
+        delete_event(loop, fd, EV_RDABLE);
+        close(fd);
+    }
+    pool_fill(loop);
+    return POOL_CHECK_INTERVAL;
+}
+
+/*
+ * 选中的 server 变了之后，池中连接其它 server 的连接也一起丢掉，让池
+ * 尽快换成新的 server 的连接
+ *
+ * Return value: 连接 server i 的 fd, -1 池中没有可用的连接
+ */
+static int pool_take(struct event_loop *loop, int i)
+{
+    long long now = fakio_now_ms();
+    int fd = -1;
+
+    while (conn_pool.n > 0) {
+        struct pool_conn pc = conn_pool.conns[0];
+        pool_remove(0);
+        delete_event(loop, pc.fd, EV_RDABLE);
+        if (pc.expire > now && pc.upstream == i) {
+            fd = pc.fd;
+            break;
+        }
+        close(pc.fd);
+    }
+    pool_fill(loop);
+    return fd;
+}
+
+/* Return value: 0 成功, -1 发送失败 */
+static int socks5_reply(int client_fd, int rep)
+{
+    uint8_t reply[32];
+
+    int len = socks5_get_server_reply(client.chost, client.cport, reply);
+    if (len < 0) {
+        return -1;
+    }
+    reply[1] = rep;
+    return send(client_fd, reply, len, 0) == len ? 0 : -1;
+}
+
+/*
+ * 以非阻塞方式连接第 i 个 server，优先使用池中已经连接好的连接，省去一次
+ * RTT。使用 TFO 时 connect 马上返回，SYN 和握手数据在第一次 send 时一起
+ * 发出
+ *
+ * Return value: fd, -1 连接失败; connected 表示是否已经连上
+ */
+static int server_connect_to(struct event_loop *loop, int i, int *connected)
+{
+    int flags = FNET_CONNECT_NONBLOCK;
+
+    if (client.fastopen) {
+        flags |= FNET_CONNECT_FASTOPEN;
+    }
+    int fd = pool_take(loop, i);
+    if (fd > 0) {
+        *connected = 1;
+        return fd;
+    }
+    *connected = 0;
+    return server_open(i, flags);
+}
+
+/*
+ * 连接选出的 server。retry 为 1 表示刚刚有一个 server 连接失败，只选择
+ * 健康的 server
+ *
+ * Return value: fd, -1 连接失败; up 是 server 的序号，connected 表示是否已经连上
+ */
+static int server_connect(struct event_loop *loop, int retry, int *up, int *connected)
+{
+    int i;
+
+    while ((i = upstream_select(retry)) >= 0) {
+        int fd = server_connect_to(loop, i, connected);
+        if (fd >= 0) {
+            *up = i;
+            return fd;
+        }
+        fakio_log(LOG_WARNING, "Server %s:%s don't onnection", client.servers[i].host,
+                  client.servers[i].port);
+        /* 被标记为 down 之后不会再被选中 */
+        upstream_update(i, 0, -1);
+        retry = 1;
+    }
+    return -1;
+}
+
+/* UDP ASSOCIATE 的回复中是本地 UDP socket 的地址，Return value: 0 成功, -1 失败 */
+static int udp_reply(context_t *c)
+{
+    uint8_t reply[3+1+16+2];
+    union fnet_addr addr;
+    socklen_t len = sizeof(addr);
+
+    if (getsockname(c->udp->udp_fd, &addr.sa, &len) < 0) {
+        return -1;
+    }
+    reply[0] = SOCKS_VER;
+    reply[1] = SOCKS_REP_SUCCEED;
+    reply[2] = SOCKS_RSV;
+    len = 3 + fnet_addr_to_socks(&addr, reply + 3);
+    return send(c->client_fd, reply, len, 0) == len ? 0 : -1;
+}
+
+/*
+ * 连接失败之后换一个健康的 server 重新连接。握手还没有发出，v2 的请求
+ * 还是明文，按新 server 的 ticket 重新写开头；v1 不使用 ticket，原样发送
+ *
+ * Return value: 0 已经开始重新连接, -1 没有健康的 server
+ */
+static int server_reconnect(context_t *c)
+{
+    uint8_t body[HANDSHAKE_SIZE];
+    int up, connected;
+
+    delete_event(c->loop, c->remote_fd, EV_WRABLE);
+    int fd = server_connect(c->loop, 1, &up, &connected);
+    if (fd < 0) {
+        return -1;
+    }
+    close(c->remote_fd);
+    c->remote_fd = fd;
+    c->upstream = up;
+    if (c->mux != NULL) {
+        c->mux->fd = fd;
+    }
+    if (c->udp != NULL) {
+        c->udp->fd = fd;
+    }
+
+    if (client.version != 1) {
+        int off = handshake_body_offset(FBUF_DATA_AT(c->req));
+        int len = FBUF_DATA_LEN(c->req) - off;
+        memcpy(body, FBUF_DATA_SEEK(c->req, off), len);
+        FBUF_REST(c->req);
+        c->hs_state &= ~(HS_RESUMED|HS_TICKET);
+
+        off = handshake_begin(c);
+        body[0] = (body[0] & ~FAKIO_HS_TICKET_REQ) | handshake_ticket_req(c);
+        memcpy(FBUF_WRITE_SEEK(c->req, off), body, len);
+        FBUF_COMMIT_WRITE(c->req, off + len);
+    }
+
+    fakio_log(LOG_INFO, "retry with server %s:%s", client.servers[up].host,
+              client.servers[up].port);
+    server_connect_wait(c, connected);
+    return 0;
+}
+
+/* 加入 stripe 的连接，和隧道一样没有本地程序 */
+static inline int stripe_secondary(context_t *c)
+{
+    return c->stripe != NULL && c->stripe->c != c;
+}
+
+/*
+ * 连接失败和 ticket 是否有效无关，不要丢掉 ticket。加入 stripe 的连接
+ * 必须连接主连接的 server，不换 server，失败了只是少用一条连接
+ */
+static void server_connect_failed(context_t *c)
+{
+    upstream_update(c->upstream, 0, -1);
+    if (!stripe_secondary(c) && server_reconnect(c) == 0) {
+        return;
+    }
+    c->hs_state &= ~HS_RESUMED;
+    if (c->hs_state & HS_SOCKS) {
+        socks5_reply(c->client_fd, SOCKS_REP_FAIL);
+    }
+    context_pool_release(pool, c, MASK_CLIENT|MASK_REMOTE);
+}
+
+/*
+ * 连上 server 之后才回复 SOCKS5，client 随后发送的第一段数据作为
+ * early data 随握手一起发出；隧道直接发送握手
+ */
+static void server_connected(context_t *c)
+{
+    c->hs_state |= HS_CONNECTED;
+    if (c->mux != NULL || stripe_secondary(c)) {
+        server_handshake_send(c);
+        return;
+    }
+    if (c->udp != NULL) {
+        if (udp_reply(c) < 0) {
+            LOG_FOR_DEBUG("send() to client %d failed: %s", c->client_fd, strerror(errno));
+            context_pool_release(pool, c, MASK_CLIENT|MASK_REMOTE);
+            return;
+        }
+        create_event(c->loop, c->client_fd, EV_RDABLE, &udp_control_cb, c);
+        server_handshake_send(c);
+        return;
+    }
+
+    if ((c->hs_state & HS_SOCKS)
+        && socks5_reply(c->client_fd, SOCKS_REP_SUCCEED) < 0) {
+        LOG_FOR_DEBUG("send() to client %d failed: %s", c->client_fd, strerror(errno));
+        context_pool_release(pool, c, MASK_CLIENT|MASK_REMOTE);
+        return;
+    }
+    /* 已经回复过，重试时不再回复 */
+    c->hs_state &= ~HS_SOCKS;
+
+    /*
+     * 最多等待 early_data_wait 毫秒，client 先说话的协议不会等满。stripe 的
+     * 握手没有 early data，重试的握手和拒绝过 early data 的 server 也不使用
+     */
+    if (client.version != 1 && client.early_data_wait > 0 && c->stripe == NULL
+        && !(c->hs_state & HS_RETRY)
+        && fakio_now_ms() >= upstreams[c->upstream].early_off) {
+        create_event(c->loop, c->client_fd, EV_RDABLE, &client_early_data_cb, c);
+        c->timer = create_time_event(c->loop, client.early_data_wait,
+                                     &early_data_timeout_cb, c);
+        return;
+    }
+    server_handshake_send(c);
+}
+
+static void server_connect_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    context_t *c = evdata;
+
+    delete_event(loop, fd, EV_WRABLE);
+    if (c->timer != NULL) {
+        delete_time_event(loop, c->timer);
+        c->timer = NULL;
+    }
+
+    int err = fnet_connect_result(fd);
+    if (err != 0) {
+        fakio_log(LOG_WARNING, "connect %s:%s - %s", client.servers[c->upstream].host,
+                  client.servers[c->upstream].port, strerror(err));
+        server_connect_failed(c);
+        return;
+    }
+    set_socket_option(fd);
+    upstream_update(c->upstream, 1, -1);
+    server_connected(c);
+}
+
+static long server_connect_timeout_cb(struct event_loop *loop, void *evdata)
+{
+    context_t *c = evdata;
+
+    /* 返回 EV_TIMER_END 后由 event loop 释放定时器 */
+    c->timer = NULL;
+    fakio_log(LOG_WARNING, "connect %s:%s timeout", client.servers[c->upstream].host,
+              client.servers[c->upstream].port);
+    server_connect_failed(c);
+
+    return EV_TIMER_END;
+}
+
+/* 还没有连上时等待可写并检查 SO_ERROR，超过 connect_timeout 算作失败 */
+static void server_connect_wait(context_t *c, int connected)
+{
+    if (connected) {
+        server_connected(c);
+        return;
+    }
+    create_event(c->loop, c->remote_fd, EV_WRABLE, &server_connect_cb, c);
+    c->timer = create_time_event(c->loop, client.connect_timeout,
+                                 &server_connect_timeout_cb, c);
+}
+
+/* 隧道关闭，之后的请求会重新建立 */
+static void mux_closed_cb(fmux_t *m)
+{
+    *(fmux_t **)m->data = NULL;
+
+    /* 和单独的连接一样，没有收到过数据就断开说明 ticket 多半已经失效 */
+    if (m->received == 0) {
+        ticket_check_rejected(m->c);
+    }
+}
+
+/* UDP 的关联和隧道一样，没有收到过数据就断开说明 ticket 多半已经失效 */
+static void udp_closed_cb(fudp_t *u)
+{
+    if (u->received == 0) {
+        ticket_check_rejected(u->c);
+    }
+}
+
+/* 和单独的连接一样，没有收到过数据就断开说明 ticket 多半已经失效 */
+static void stripe_closed_cb(fstripe_t *s)
+{
+    if (s->received == 0) {
+        ticket_check_rejected(s->c);
+    }
+}
+
+/*
+ * 主连接上已经收到了不少数据，是个大的下载，再建立 stripes - 1 条连接到
+ * 同一个 server，发送 VER 是 FAKIO_HS_STRIPE_JOIN 的 v2 握手加入主连接的
+ * GROUP，握手完成之后交给 fstripe 接收分给它的帧
+ */
+static void stripe_open_cb(fstripe_t *s)
+{
+    int i, fd, h_len, connected, up = s->c->upstream;
+    int flags = FNET_CONNECT_NONBLOCK;
+
+    if (client.fastopen) {
+        flags |= FNET_CONNECT_FASTOPEN;
+    }
+    for (i = 1; i < client.stripes; i++) {
+        connected = 1;
+        fd = pool_take(s->loop, up);
+        if (fd < 0) {
+            connected = 0;
+            fd = server_open(up, flags);
+            if (fd < 0) {
+                upstream_update(up, 0, -1);
+                return;
+            }
+        }
+
+        context_t *c = context_pool_get(pool, MASK_REMOTE);
+        if (c == NULL) {
+            fakio_log(LOG_WARNING, "Can't get context!");
+            close(fd);
+            return;
+        }
+        c->remote_fd = fd;
+        c->upstream = up;
+        c->loop = s->loop;
+        if (fstripe_join(s, c) < 0) {
+            context_pool_release(pool, c, MASK_REMOTE);
+            return;
+        }
+        c->stripe = s;
+
+        h_len = handshake_begin(c);
+        *FBUF_WRITE_SEEK(c->req, h_len) = FAKIO_HS_STRIPE_JOIN | handshake_ticket_req(c);
+        FBUF_COMMIT_WRITE(c->req, h_len + 1);
+
+        /* 握手失败时 context 释放，stripe 只是少用一条连接 */
+        server_connect_wait(c, connected);
+    }
+}
+
+/*
+ * UDP ASSOCIATE: 在 SOCKS5 连接的本地地址上打开一个 UDP socket，为这个
+ * 关联单独连接 server，发送 VER 是 FAKIO_HS_UDP 的 v2 握手，连上之后把
+ * UDP socket 的地址回复给本地程序。只接受 SOCKS5 连接的那个 IP 发来的
+ * 数据报，SOCKS5 连接关闭时关联结束
+ */
+static void udp_associate(struct event_loop *loop, int client_fd)
+{
+    union fnet_addr local, peer;
+    socklen_t len = sizeof(local), plen = sizeof(peer);
+    int connected, up, udp_fd, remote_fd;
+
+    if (client.version == 1) {
+        fakio_log(LOG_WARNING, "udp associate needs version 2");
+        socks5_reply(client_fd, SOCKS_REP_CMD_UNSUPPORTED);
+        close(client_fd);
+        return;
+    }
+    if (getsockname(client_fd, &local.sa, &len) < 0
+        || getpeername(client_fd, &peer.sa, &plen) < 0) {
+        goto fail;
+    }
+    udp_fd = fnet_create_udp(&local);
+    if (udp_fd < 0) {
+        goto fail;
+    }
+    remote_fd = server_connect(loop, 0, &up, &connected);
+    if (remote_fd < 0) {
+        close(udp_fd);
+        goto fail;
+    }
+
+    context_t *c = context_pool_get(pool, MASK_CLIENT|MASK_REMOTE);
+    if (c == NULL) {
+        fakio_log(LOG_WARNING, "Can't get context!");
+        close(remote_fd);
+        close(udp_fd);
+        goto fail;
+    }
+    c->client_fd = client_fd;
+    c->remote_fd = remote_fd;
+    c->upstream = up;
+    c->loop = loop;
+    c->hs_state |= HS_SOCKS;
+    c->udp = fudp_create(c, remote_fd, udp_fd, FUDP_CLIENT, client.udp_timeout * 1000,
+                         NULL, &udp_closed_cb, NULL);
+    if (c->udp == NULL) {
+        /* 不是 server 的问题，不能当作连接失败去重连 */
+        close(udp_fd);
+        socks5_reply(client_fd, SOCKS_REP_FAIL);
+        context_pool_release(pool, c, MASK_CLIENT|MASK_REMOTE);
+        return;
+    }
+    peer.v4.sin_port = 0; /* sin_port 和 sin6_port 的位置相同 */
+    memcpy(&c->udp->peer, &peer, plen);
+
+    int h_len = handshake_begin(c);
+    *FBUF_WRITE_SEEK(c->req, h_len) = FAKIO_HS_UDP | handshake_ticket_req(c);
+    FBUF_COMMIT_WRITE(c->req, h_len + 1);
+
+    server_connect_wait(c, connected);
+    return;
+
+fail:
+    socks5_reply(client_fd, SOCKS_REP_FAIL);
+    close(client_fd);
+}
+
+/* SOCKS5 连接上不会再有数据，只等它关闭 */
+static void udp_control_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    context_t *c = evdata;
+    char buf[64];
+
+    int rc = recv(fd, buf, sizeof(buf), 0);
+    if (rc > 0 || (rc < 0 && errno == EAGAIN)) {
+        return;
+    }
+    LOG_FOR_DEBUG("udp associate client %d closed", fd);
+    context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+}
+
+/*
+ * 建立一个隧道: VER 是 FAKIO_HS_MUX 的 v2 握手，回复之后(使用 ticket 时
+ * 发完握手就)交给 fmux，在此之前打开的 stream 的 SYN 排队等待
+ *
+ * Return value: 隧道, NULL 连接 server 失败
+ */
+static fmux_t *mux_connect(struct event_loop *loop, fmux_t **slot)
+{
+    int connected, up;
+    int remote_fd = server_connect(loop, 0, &up, &connected);
+    if (remote_fd < 0) {
+        return NULL;
+    }
+
+    context_t *c = context_pool_get(pool, MASK_REMOTE);
+    if (c == NULL) {
+        fakio_log(LOG_WARNING, "Can't get context!");
+        close(remote_fd);
+        return NULL;
+    }
+    c->remote_fd = remote_fd;
+    c->upstream = up;
+    c->loop = loop;
+    c->mux = fmux_create(c, remote_fd, NULL, &mux_closed_cb, slot);
+    if (c->mux == NULL) {
+        context_pool_release(pool, c, MASK_REMOTE);
+        return NULL;
+    }
+    *slot = c->mux;
+
+    int h_len = handshake_begin(c);
+    *FBUF_WRITE_SEEK(c->req, h_len) = FAKIO_HS_MUX | handshake_ticket_req(c);
+    FBUF_COMMIT_WRITE(c->req, h_len + 1);
+
+    /* 连接或者握手失败时 mux_closed_cb 会清空 slot */
+    server_connect_wait(c, connected);
+    return *slot;
+}
+
+/* 轮流使用各个隧道，本地的请求作为其中一个隧道上的 stream，fd 交给 stream */
+static void mux_open(struct event_loop *loop, int client_fd, const uint8_t *addr, int len)
+{
+    fmux_t **slot = &mux_sessions[mux_next];
+
+    mux_next = (mux_next + 1) % client.mux;
+
+    if (*slot == NULL && mux_connect(loop, slot) == NULL) {
+        close(client_fd);
+        return;
+    }
+    if (fmux_stream_open(*slot, client_fd, addr, len) == NULL) {
+        fakio_log(LOG_WARNING, "Can't open mux stream!");
+        close(client_fd);
+    }
+}
+
+/*
+ * 本地程序要连接的目标，addr 是 VER | ATYP | addr | port，后面至少还有
+ * HANDSHAKE_SIZE 的空间(v1 握手直接从这里加密)。socks 表示连上 server
+ * 之后要回复 SOCKS5，透明代理的连接没有本地的协商
+ */
+static void client_request(struct event_loop *loop, int client_fd,
+                           uint8_t *addr, int len, int socks)
+{
+    /* 隧道上的 stream 由 server 连接目标，直接回复 */
+    if (client.mux > 0) {
+        if (socks) {
+            socks5_reply(client_fd, SOCKS_REP_SUCCEED);
+        }
+        mux_open(loop, client_fd, addr+1, len-1);
+        return;
+    }
+
+    int connected, up;
+    int remote_fd = server_connect(loop, 0, &up, &connected);
+    if (remote_fd < 0) {
+        goto fail;
+    }
+
+    context_t *c = context_pool_get(pool, MASK_CLIENT|MASK_REMOTE);
+    if (c == NULL) {
+        fakio_log(LOG_WARNING, "Can't get context!");
+        close(remote_fd);
+        goto fail;
+    }
+    LOG_FOR_DEBUG("client %d remote %d at %p", client_fd, remote_fd, c);
+    c->client_fd = client_fd;
+    c->remote_fd = remote_fd;
+    c->upstream = up;
+    c->loop = loop;
+    if (socks) {
+        c->hs_state |= HS_SOCKS;
+    }
+
+    int h_len = handshake_begin(c);
+    if (client.version == 1) {
+        /* v1: 加密部分固定填充到 HANDSHAKE_SIZE */
+        uint8_t iv[16];
+        memcpy(iv, FBUF_DATA_SEEK(c->req, 0), 16);
+        int c_len = HANDSHAKE_SIZE - h_len;
+        fcrypt_encrypt_all(c->crypto, iv, c_len, addr,
+                           FBUF_WRITE_SEEK(c->req, h_len));
+        FBUF_COMMIT_WRITE(c->req, HANDSHAKE_SIZE);
+    } else {
+        /*
+         * v2: 头部先以明文放在 req 中，发送前再补上填充并加密。使用多条
+         * 连接时带上随机的 GROUP，之后的连接用它加入
+         */
+        uint8_t *p = FBUF_WRITE_SEEK(c->req, h_len), id[FSTRIPE_ID_LEN];
+        p[0] = FAKIO_HS_V2 | handshake_ticket_req(c);
+        if (client.stripes > 1) {
+            random_bytes(rnd, id, FSTRIPE_ID_LEN);
+            c->stripe = fstripe_create(c, FSTRIPE_CLIENT, id, &stripe_open_cb,
+                                       &stripe_closed_cb, NULL);
+            if (c->stripe != NULL) {
+                p[0] = FAKIO_HS_STRIPE | handshake_ticket_req(c);
+            }
+        }
+        memcpy(p+1, addr+1, len-1);
+        FBUF_COMMIT_WRITE(c->req, h_len + len);
+    }
+
+    server_connect_wait(c, connected);
+    return;
+
+fail:
+    if (socks) {
+        socks5_reply(client_fd, SOCKS_REP_FAIL);
+    }
+    close(client_fd);
+}
+
 static void server_accept_cb(struct event_loop *loop, int fd, int mask, void *evdata)
 {
-    while (1) {
-        int client_fd = accept(fd, NULL, NULL);
+    int n;
+
+    for (n = 0; n < ACCEPT_BATCH; n++) {
+        int client_fd = fnet_accept(fd);
         if (client_fd < 0) {
-            if (errno != EWOULDBLOCK) {
-                fakio_log(LOG_WARNING, "accept() failed\n");
-                break;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fakio_log(LOG_WARNING, "accept() failed: %s", strerror(errno));
             }
-            continue;
+            break;
         }
-        set_nonblocking(client_fd);
-        set_socket_option(client_fd);
 
         LOG_FOR_DEBUG("new client %d comming connection", client_fd);
         create_event(loop, client_fd, EV_RDABLE, &socks5_handshake1_cb, NULL);
-        break;
+    }
+}
+
+/*
+ * 解析 CONNECT host:port HTTP/1.x，直接在收到的数据上查找，不复制。
+ * 目标按 VER | ATYP | addr | port 写入 addr，addr_len 是它的长度
+ *
+ * Return value: 请求头的长度, 0 还不完整, -1 不是 CONNECT 或者格式错误
+ */
+static int http_connect_parse(const char *buf, int len, uint8_t *addr, int *addr_len)
+{
+    char host[MAX_HOST_LEN];
+    const char *p, *sp, *colon = NULL;
+    int i, port = 0;
+
+    if (memcmp(buf, "CONNECT ", len < 8 ? len : 8) != 0) {
+        return -1;
+    }
+    const char *end = memmem(buf, len, "\r\n\r\n", 4);
+    if (end == NULL) {
+        return 0;
+    }
+
+    p = buf + 8;
+    sp = memchr(p, ' ', end - p);
+    if (sp == NULL) {
+        return -1;
+    }
+    for (i = 0; p + i < sp; i++) {
+        if (p[i] == ':') colon = p + i;
+    }
+    if (colon == NULL || colon + 1 == sp || sp - colon > 6) {
+        return -1;
+    }
+    for (i = 1; colon + i < sp; i++) {
+        if (colon[i] < '0' || colon[i] > '9') return -1;
+        port = port * 10 + colon[i] - '0';
+    }
+
+    /* IPv6 的地址写在 [] 中 */
+    int hlen = colon - p;
+    if (hlen >= 2 && p[0] == '[' && p[hlen-1] == ']') {
+        p++;
+        hlen -= 2;
+    }
+    if (port == 0 || port > 65535 || hlen <= 0 || hlen >= MAX_HOST_LEN || hlen > 255) {
+        return -1;
+    }
+    memcpy(host, p, hlen);
+    host[hlen] = '\0';
+
+    addr[0] = SOCKS_VER;
+    if (inet_pton(AF_INET, host, addr + 2) == 1) {
+        addr[1] = SOCKS_ATYPE_IPV4;
+        i = 2 + 4;
+    } else if (inet_pton(AF_INET6, host, addr + 2) == 1) {
+        addr[1] = SOCKS_ATYPE_IPV6;
+        i = 2 + 16;
+    } else {
+        addr[1] = SOCKS_ATYPE_DNAME;
+        addr[2] = hlen;
+        memcpy(addr + 3, host, hlen);
+        i = 3 + hlen;
+    }
+    *(uint16_t *)(addr + i) = htons(port);
+    *addr_len = i + 2;
+
+    fakio_log(LOG_INFO, "Connecting %s:%d", host, port);
+    return end - buf + 4;
+}
+
+static void http_accept_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    int n;
+
+    for (n = 0; n < ACCEPT_BATCH; n++) {
+        int client_fd = fnet_accept(fd);
+        if (client_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fakio_log(LOG_WARNING, "accept() failed: %s", strerror(errno));
+            }
+            break;
+        }
+
+        LOG_FOR_DEBUG("new http client %d comming connection", client_fd);
+        create_event(loop, client_fd, EV_RDABLE, &http_request_cb, NULL);
+    }
+}
+
+/*
+ * HTTP 代理: 请求头只 peek 不读出，解析完之后只读掉请求头，后面紧跟着的
+ * 数据留在 socket 中，和 SOCKS5 一样作为 early data 或者随后的数据发出。
+ * 不等 server 连上就回复 200，client 可以马上开始发送
+ */
+static void http_request_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    static const char ok[] = "HTTP/1.1 200 Connection established\r\n\r\n";
+    static const char bad[] = "HTTP/1.1 405 Method Not Allowed\r\n"
+                              "Connection: close\r\n\r\n";
+    char buf[HTTP_HEADER_MAX];
+    uint8_t addr[1+1+1+255+2+HANDSHAKE_SIZE];
+    int len, lowat = 1;
+
+    int rc = recv(fd, buf, sizeof(buf), MSG_PEEK);
+    if (rc < 0 && errno == EAGAIN) {
+        return;
+    }
+    if (rc <= 0) {
+        LOG_FOR_DEBUG("http client %d connection closed", fd);
+        goto close;
+    }
+
+    int hlen = http_connect_parse(buf, rc, addr, &len);
+    if (hlen == 0 && rc < (int)sizeof(buf)) {
+        /* 请求头还不完整，有新的数据之前不再通知，避免反复 peek 同样的数据 */
+        lowat = rc + 1;
+        setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+        return;
+    }
+    if (hlen <= 0) {
+        fakio_log(LOG_WARNING, "Client request not http connect!");
+        send(fd, bad, sizeof(bad)-1, 0);
+        goto close;
+    }
+
+    if (recv(fd, buf, hlen, 0) != hlen
+        || setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat)) < 0
+        || send(fd, ok, sizeof(ok)-1, 0) != sizeof(ok)-1) {
+        goto close;
+    }
+    delete_event(loop, fd, EV_RDABLE);
+    client_request(loop, fd, addr, len, 0);
+    return;
+
+close:
+    delete_event(loop, fd, EV_RDABLE);
+    close(fd);
+}
+
+/* 透明代理: 取回原来的目标之后直接连接 server，没有 SOCKS5 的两次往返 */
+static void redir_accept_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    int n;
+    union fnet_addr dst;
+    uint8_t buf[1+1+16+2+HANDSHAKE_SIZE];
+    char name[64];
+
+    for (n = 0; n < ACCEPT_BATCH; n++) {
+        int client_fd = fnet_accept(fd);
+        if (client_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fakio_log(LOG_WARNING, "accept() failed: %s", strerror(errno));
+            }
+            break;
+        }
+
+        if (fnet_original_dst(client_fd, client.tproxy, &dst) < 0) {
+            fakio_log(LOG_WARNING, "client %d has no original destination: %s",
+                      client_fd, strerror(errno));
+            close(client_fd);
+            continue;
+        }
+        /* TPROXY 不改写目标，直接连到监听端口的连接会被转回自己 */
+        if (client.tproxy && ntohs(dst.v4.sin_port) == atoi(client.redir_port)) {
+            fakio_log(LOG_WARNING, "client %d is not a transparent connection", client_fd);
+            close(client_fd);
+            continue;
+        }
+        fakio_log(LOG_INFO, "Connecting %s", fnet_addr_str(&dst, name, sizeof(name)));
+
+        buf[0] = SOCKS_VER;
+        int len = 1 + fnet_addr_to_socks(&dst, buf+1);
+        client_request(loop, client_fd, buf, len, 0);
     }
 }
 
@@ -132,206 +1233,481 @@ void socks5_handshake2_cb(struct event_loop *loop, int fd, int mask, void *evdat
         }
 
         // Socks5 认证协议，采用 050100，这里不管发起方使用何种协议
+        if (buffer[0] == SOCKS_VER && rc >= 10 && buffer[1] == SOCKS_UDP_ASSOCIATE) {
+            delete_event(loop, client_fd, EV_RDABLE);
+            udp_associate(loop, client_fd);
+            return;
+        }
         if (buffer[0] == SOCKS_VER) {
-            int remote_fd = fnet_create_and_connect(client.shost,
-                            client.sport, FNET_CONNECT_BLOCK);
-            if (remote_fd < 0) {
-                fakio_log(LOG_WARNING, "Server don't onnection");
+            /* 解析并打印请求，v2 握手只发送其中的地址部分 */
+            if (socks5_request_resolve(buffer, rc, &req) < 0) {
                 break;
             }
-            set_nonblocking(remote_fd);
-            set_socket_option(remote_fd);
+            delete_event(loop, client_fd, EV_RDABLE);
+            buffer[2] = SOCKS_VER;
+            client_request(loop, client_fd, buffer+2, req.rlen-2, 1);
+            return;
+        } else {
+            fakio_log(LOG_WARNING, "Client request not socks5!");
+            break;
+        }
+    }
+
+    delete_event(loop, client_fd, EV_WRABLE);
+    delete_event(loop, client_fd, EV_RDABLE);
+    close(client_fd);
+}
+
+/*
+ * v2 握手: VER | ATYP | addr | port | PLEN | 填充，读到 early data 时
+ * 使用 v3: VER | ATYP | addr | port | PLEN | ELEN | 填充 | early data，
+ * stripe 的请求和加入的连接在 PLEN 后面是 GROUP。整个加密部分使用握手的
+ * key 和 IV 加密，使用 ticket 时则使用本次连接的密钥加密
+ *
+ * 完整握手的 early data 在收到 server 的回复之前留在 res 中，前面是
+ * VER | ATYP | addr | port，被拒绝时用来重试，见 early_data_retry
+ */
+static void server_handshake_send(context_t *c)
+{
+    int rc, h_len = handshake_body_offset(FBUF_DATA_AT(c->req));
+
+    if (client.version != 1) {
+        uint8_t *p = FBUF_DATA_SEEK(c->req, h_len);
+        uint8_t *w = FBUF_WRITE_AT(c->req), r;
+        int a_len = w - p;
+        int early = (c->hs_state & HS_RETRY) ? 0 : FBUF_DATA_LEN(c->res);
+
+        int pad = client.padding_min;
+        if (client.padding_max > client.padding_min) {
+            random_bytes(rnd, &r, 1);
+            pad += r % (client.padding_max - client.padding_min + 1);
+        }
+        *w++ = pad;
+        if (c->stripe != NULL) {
+            memcpy(w, c->stripe->id, FSTRIPE_ID_LEN);
+            w += FSTRIPE_ID_LEN;
+        }
+        if (early > 0) {
+            p[0] = FAKIO_HS_V3 | (p[0] & FAKIO_HS_TICKET_REQ);
+            *(uint16_t *)w = htons(early);
+            w += 2;
+        }
+        random_bytes(rnd, w, pad);
+        w += pad;
+        memcpy(w, FBUF_DATA_AT(c->res), early);
+        w += early;
+        FBUF_COMMIT_WRITE(c->req, w - FBUF_WRITE_AT(c->req));
+        if (!(c->hs_state & HS_RETRY)) {
+            c->early_len = early;
+            if (early > 0 && !(c->hs_state & HS_RESUMED)) {
+                memmove(FBUF_DATA_AT(c->res) + a_len, FBUF_DATA_AT(c->res), early);
+                memcpy(FBUF_DATA_AT(c->res), p, a_len);
+                FBUF_COMMIT_WRITE(c->res, a_len);
+            } else {
+                FBUF_REST(c->res);
+            }
+        }
+
+        int len = FBUF_DATA_LEN(c->req) - h_len;
+        if (c->hs_state & HS_RESUMED) {
+            struct iovec iov = { p, len };
+            fcrypt_encrypt_iov(c->crypto, &iov, 1, len);
+        } else {
+            uint8_t iv[16];
+            memcpy(iv, FBUF_DATA_SEEK(c->req, 0), 16);
+            fcrypt_encrypt_all(c->crypto, iv, len, p, p);
+        }
+    }
+
+    /* 刚连上的 socket 一定可写，直接发送握手数据 */
+    rc = fnet_send_chain(c->remote_fd, &c->req, 0);
+    if (rc < 0) {
+        LOG_FOR_DEBUG("send() to remote %d failed: %s", c->remote_fd, strerror(errno));
+        context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+    } else if (rc == 0) {
+        create_event(c->loop, c->remote_fd, EV_WRABLE, &server_handshake1_cb, c);
+    } else {
+        server_handshake_sent(c);
+    }
+}
+
+/* 隧道、UDP 的关联和加入 stripe 的连接，握手之后不走普通的转发 */
+static inline int tunnel_context(context_t *c)
+{
+    return c->mux != NULL || c->udp != NULL || stripe_secondary(c);
+}
+
+/* 握手完成，交给 fmux、fudp 或者 fstripe */
+static inline void tunnel_start(context_t *c)
+{
+    if (c->mux != NULL) {
+        fmux_start(c->mux, NULL, 0);
+    } else if (c->udp != NULL) {
+        fudp_start(c->udp, NULL, 0);
+    } else {
+        fstripe_start(c->stripe, c);
+    }
+}
+
+/* 两个方向相互独立，remote 的数据不必等 client 先发送；stripe 的下载由 fstripe 接收 */
+static inline void transfer_start(context_t *c)
+{
+    create_event(c->loop, c->client_fd, EV_RDABLE, &client_readable_cb, c);
+    if (c->stripe != NULL) {
+        fstripe_start(c->stripe, c);
+    } else {
+        create_event(c->loop, c->remote_fd, EV_RDABLE, &remote_readable_cb, c);
+    }
+}
+
+/* 使用 ticket 时 server 没有回复，握手发完就开始转发 */
+static void server_handshake_sent(context_t *c)
+{
+    if (tunnel_context(c)) {
+        if (c->hs_state & HS_RESUMED) {
+            tunnel_start(c);
+        } else {
+            create_event(c->loop, c->remote_fd, EV_RDABLE, &server_handshake2_cb, c);
+        }
+        return;
+    }
+    if (c->hs_state & HS_RESUMED) {
+        transfer_start(c);
+    } else {
+        create_event(c->loop, c->remote_fd, EV_RDABLE, &server_handshake2_cb, c);
+    }
+}
 
-            /* 打印请求 */
-            socks5_request_resolve(buffer, rc, &req);
+/* client 的第一段数据，读到就发送握手，不等待更多的数据 */
+static void client_early_data_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    context_t *c = evdata;
 
-            //Reply SOCKS5
-            uint8_t reply[16];
-            int reply_len = socks5_get_server_reply(client.chost,
-                                client.cport, reply);
-            //TODO:
-            send(client_fd, reply, reply_len, 0);
+    int rc = recv(fd, FBUF_WRITE_AT(c->res), FAKIO_EARLY_DATA_MAX, 0);
+    if (rc < 0) {
+        if (errno == EAGAIN) {
+            return;
+        }
+        LOG_FOR_DEBUG("recv() failed form client %d: %s", fd, strerror(errno));
+        context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+        return;
+    }
+    if (rc == 0) {
+        LOG_FOR_DEBUG("client %d Connection closed", fd);
+        context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+        return;
+    }
+    FBUF_COMMIT_WRITE(c->res, rc);
 
-            
-            context_t *c = context_pool_get(pool, MASK_CLIENT|MASK_REMOTE);
-            if (c == NULL) {
-                fakio_log(LOG_WARNING, "Can't get context!");
-                close(remote_fd);
-                break;
-            }
-            LOG_FOR_DEBUG("client %d remote %d at %p", client_fd, remote_fd, c);
-            c->client_fd = client_fd;
-            c->remote_fd = remote_fd;
-            c->loop = loop;
+    delete_event(loop, fd, EV_RDABLE);
+    if (c->timer != NULL) {
+        delete_time_event(loop, c->timer);
+        c->timer = NULL;
+    }
+    server_handshake_send(c);
+}
 
-            //Request info
+static long early_data_timeout_cb(struct event_loop *loop, void *evdata)
+{
+    context_t *c = evdata;
 
-            random_bytes(client.r, FBUF_WRITE_AT(c->req), 16);
+    /* 返回 EV_TIMER_END 后由 event loop 释放定时器 */
+    c->timer = NULL;
+    delete_event(loop, c->client_fd, EV_RDABLE);
+    server_handshake_send(c);
 
+    return EV_TIMER_END;
+}
 
-            *FBUF_WRITE_SEEK(c->req, 16) = client.name_len;
-            memcpy(FBUF_WRITE_SEEK(c->req, 17), client.username, client.name_len);
-            
-            fcrypt_set_key(c->crypto, client.key, 256);
+void server_handshake1_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    context_t *c = evdata;
 
-            buffer[2] = SOCKS_VER;
-            int c_len = 1024 - 16 - 1 - client.name_len;
+    int r = fnet_send_chain(fd, &c->req, 0);
+    if (r < 0) {
+        LOG_FOR_DEBUG("send() to remote %d failed: %s", fd, strerror(errno));
+        context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+        return;
+    }
+    if (r == 1) {
+        delete_event(loop, fd, EV_WRABLE);
+        server_handshake_sent(c);
+    }
+}
 
-            uint8_t iv[16];
-            memcpy(iv, FBUF_DATA_SEEK(c->req, 0), 16);
-            
-            fcrypt_encrypt_all(c->crypto, iv, c_len, buffer+2,
-                               FBUF_WRITE_SEEK(c->req, 16+1+client.name_len));
 
-            FBUF_COMMIT_WRITE(c->req, HANDSHAKE_SIZE);
+/*
+ * 回复: IV | 加密的 EIV,DIV,KEY，请求了 ticket 时后面还有
+ * LIFETIME(4) | SECRET(32) | TLEN(2) | TICKET，要解密出 TLEN 才知道长度。
+ * 握手已经发完，回复读到 req 中，res 中可能还留着 early data
+ *
+ * Return value: 回复的总长度, -1 TLEN 超出 FTICKET_MAX_LEN
+ */
+static int server_reply_size(context_t *c)
+{
+    int len = 64, tlen;
+    uint8_t iv[16], bytes[48], ext[4+FTICKET_SECRET_LEN+2];
 
-            delete_event(loop, client_fd, EV_RDABLE);
-            create_event(loop, c->remote_fd, EV_WRABLE, &server_handshake1_cb, c);
-            return;
-        } else {
-            fakio_log(LOG_WARNING, "Client request not socks5!");
-            break;
-        }
+    if (!(c->hs_state & HS_TICKET)) {
+        return len;
     }
-
-    delete_event(loop, client_fd, EV_WRABLE);
-    delete_event(loop, client_fd, EV_RDABLE);
-    close(client_fd);
+    len += sizeof(ext);
+    if (FBUF_DATA_LEN(c->req) < len) {
+        return len;
+    }
+    memcpy(iv, FBUF_DATA_AT(c->req), 16);
+    fcrypt_decrypt_all(c->crypto, iv, 48, FBUF_DATA_SEEK(c->req, 16), bytes);
+    fcrypt_decrypt_all(c->crypto, iv, sizeof(ext), FBUF_DATA_SEEK(c->req, 64), ext);
+    memset(bytes, 0, sizeof(bytes));
+    tlen = ntohs(*(uint16_t *)(ext+4+FTICKET_SECRET_LEN));
+    memset(ext, 0, 4+FTICKET_SECRET_LEN);
+
+    if (tlen > FTICKET_MAX_LEN) {
+        return -1;
+    }
+    return len + tlen;
 }
 
-void server_handshake1_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+/* 保存 server 签发的 ticket，iv 是解密完 EIV,DIV,KEY 之后的 IV */
+static void server_reply_ticket(context_t *c, uint8_t iv[16])
 {
+    uint8_t ext[4+FTICKET_SECRET_LEN+2+FTICKET_MAX_LEN];
+    int len = FBUF_DATA_LEN(c->req) - 64;
 
-    context_t *c = evdata;
+    if (len < 4+FTICKET_SECRET_LEN+2 || len > (int)sizeof(ext)) {
+        return;
+    }
+    fcrypt_decrypt_all(c->crypto, iv, len, FBUF_DATA_SEEK(c->req, 64), ext);
+
+    int lifetime = ntohl(*(uint32_t *)ext);
+    int tlen = len - (4+FTICKET_SECRET_LEN+2);
+    if (tlen > 0 && tlen <= FTICKET_MAX_LEN && lifetime > 0) {
+        struct session_ticket *t = &upstreams[c->upstream].ticket;
+        memcpy(t->secret, ext+4, FTICKET_SECRET_LEN);
+        memcpy(t->data, ext+4+FTICKET_SECRET_LEN+2, tlen);
+        t->len = tlen;
+        /* 留出余量，过期之前就换新的 */
+        t->renew = fakio_now_ms() + lifetime * 750LL;
+    }
+    memset(ext, 0, 4+FTICKET_SECRET_LEN);
+}
 
-    while (1) {
-        int rc = send(fd, FBUF_DATA_AT(c->req), FBUF_DATA_LEN(c->req), 0);
-        if (rc < 0) {
-            if (errno == EAGAIN) {
-                return;
-            }
-            LOG_FOR_DEBUG("send() to remote %d failed: %s", fd, strerror(errno));
-            context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
-            return;
-        }
-        
-        if (rc >= 0) {
-            /* 当发送 rc 字节的数据后，如果系统发送缓冲区满，则会产生 EAGAIN 错误，
-             * 此时若 rc < c->recvlen，则再次发送时，会丢失 recv buffer 中的
-             * c->recvlen - rc 中的数据，因此应该将其移到 recv buffer 前面
-             */
-            FBUF_COMMIT_READ(c->req, rc);
-            if (FBUF_DATA_LEN(c->req) <= 0) {
-                delete_event(loop, fd, EV_WRABLE);
-                create_event(loop, c->remote_fd, EV_RDABLE, &server_handshake2_cb, c);
-                return;
-            }
-        }
+/*
+ * 带 early data 的完整握手没有收到回复就被断开，可能是 server 认为时间
+ * 不对或者防重放的表满了，也可能只是目标连不上。用留在 res 中的目标地址
+ * 向同一个 server 重新做一次不带 early data 的完整握手，本地程序不会看到
+ * 连接被重置；重试成功才说明是 early data 被拒绝，见 early_data_resend
+ *
+ * Return value: 0 已经开始重试, -1 不能重试
+ */
+static int early_data_retry(context_t *c)
+{
+    int connected;
+
+    if (c->early_len == 0 || (c->hs_state & (HS_RESUMED|HS_RETRY))) {
+        return -1;
+    }
+    delete_event(c->loop, c->remote_fd, EV_RDABLE);
+    int fd = server_connect_to(c->loop, c->upstream, &connected);
+    if (fd < 0) {
+        return -1;
     }
+    LOG_FOR_DEBUG("remote %d closed, retry without early data", c->remote_fd);
+    close(c->remote_fd);
+    c->remote_fd = fd;
+
+    int a_len = FBUF_DATA_LEN(c->res) - c->early_len;
+    FBUF_REST(c->req);
+    c->hs_state &= ~HS_TICKET;
+    c->hs_state |= HS_RETRY;
+
+    int off = handshake_begin(c);
+    uint8_t *p = FBUF_WRITE_SEEK(c->req, off);
+    memcpy(p, FBUF_DATA_AT(c->res), a_len);
+    p[0] = FAKIO_HS_V2 | handshake_ticket_req(c);
+    FBUF_COMMIT_WRITE(c->req, off + a_len);
+
+    server_connect_wait(c, connected);
+    return 0;
 }
 
+/*
+ * 重试的握手完成，之前被拒绝的是 early data，这个 server 在
+ * EARLY_DATA_BACKOFF 之内不再使用 early data。留在 res 中的 early data
+ * 加密之后放进 req 发给 server
+ */
+static void early_data_resend(context_t *c)
+{
+    struct iovec iov[FBUF_CHAIN_MAX];
+    int a_len = FBUF_DATA_LEN(c->res) - c->early_len;
+
+    fakio_log(LOG_WARNING, "early data rejected by server %s:%s",
+              client.servers[c->upstream].host, client.servers[c->upstream].port);
+    upstreams[c->upstream].early_off = fakio_now_ms() + EARLY_DATA_BACKOFF;
+
+    int cnt = fbuf_chain_write_iov(c->req, iov, c->early_len);
+    fbuf_iov_copy(iov, cnt, 0, FBUF_DATA_AT(c->res) + a_len, c->early_len);
+    fbuf_chain_commit_write(c->req, c->early_len);
+    fcrypt_encrypt_iov(c->crypto, iov, cnt, c->early_len);
+    FBUF_REST(c->res);
+    create_event(c->loop, c->remote_fd, EV_WRABLE, &remote_writable_cb, c);
+}
 
 void server_handshake2_cb(struct event_loop *loop, int fd, int mask, void *evdata)
 {
     context_t *c = evdata;
+    int size, need;
     
-    while (1) {
-        int need = 64 - FBUF_DATA_LEN(c->res);
-        int rc = recv(fd, FBUF_WRITE_AT(c->res), need, 0);
+    while ((size = server_reply_size(c)) > FBUF_DATA_LEN(c->req)) {
+        need = size - FBUF_DATA_LEN(c->req);
+        if (need > FBUF_WRITE_LEN(c->req)) {
+            need = FBUF_WRITE_LEN(c->req);
+        }
+        int rc = recv(fd, FBUF_WRITE_AT(c->req), need, 0);
         
         if (rc < 0) {
             if (errno == EAGAIN) {
                 return;
             }
             LOG_FOR_DEBUG("recv() from remote %d failed: %s", fd, strerror(errno));
-            context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+            if (early_data_retry(c) < 0) {
+                context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+            }
             return;
         }
         if (rc == 0) {
             LOG_FOR_DEBUG("remote %d connection closed", fd);
-            context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+            if (early_data_retry(c) < 0) {
+                context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+            }
             return;
         }
 
-        FBUF_COMMIT_WRITE(c->res, rc);
-        if (FBUF_DATA_LEN(c->res) < 64) {
-            continue;
-        }
-        break;
+        FBUF_COMMIT_WRITE(c->req, rc);
+    }
+    if (size < 0) {
+        fakio_log(LOG_WARNING, "server %s:%s sent a ticket longer than %d",
+                  client.servers[c->upstream].host, client.servers[c->upstream].port,
+                  FTICKET_MAX_LEN);
+        context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+        return;
     }
     
+    /* 解密之后 req 的前 16 字节就是接下来的 IV */
     uint8_t bytes[48];
-    fcrypt_decrypt_all(c->crypto, FBUF_DATA_AT(c->res), 48, 
-                       FBUF_DATA_SEEK(c->res, 16), bytes);
+    fcrypt_decrypt_all(c->crypto, FBUF_DATA_AT(c->req), 48, 
+                       FBUF_DATA_SEEK(c->req, 16), bytes);
+    if (c->hs_state & HS_TICKET) {
+        server_reply_ticket(c, FBUF_DATA_AT(c->req));
+    }
     client_fcrypt_ctx_init(c->crypto, bytes);
-    FBUF_REST(c->res);
+    memset(bytes, 0, sizeof(bytes));
+    FBUF_REST(c->req);
+
+    /* server 收下了 early data；重试时还要把它作为普通数据发出 */
+    if (c->hs_state & HS_RETRY) {
+        early_data_resend(c);
+    } else {
+        FBUF_REST(c->res);
+    }
 
-    delete_event(loop, fd, EV_RDABLE);
-    create_event(loop, c->client_fd, EV_RDABLE, &client_readable_cb, c);
+    if (tunnel_context(c)) {
+        tunnel_start(c);
+        return;
+    }
+    transfer_start(c);
 }
 
+/*
+ * 和服务端一样，两个方向相互独立，读到的数据直接发送，发不完的部分留在
+ * chain 中，chain 还有空间就继续读，满了才暂停
+ */
 static void remote_readable_cb(struct event_loop *loop, int fd, int mask, void *evdata)
 {
     context_t *c = evdata;
+    struct iovec iov[FBUF_CHAIN_MAX];
+    int iovcnt;
 
-    while (1) {
-        int rc = recv(fd, FBUF_WRITE_AT(c->res), BUFSIZE, 0);
+    /* client 已经关闭，只等 req 中剩下的数据发完 */
+    if (c->client_fd == 0) {
+        delete_event(loop, fd, EV_RDABLE);
+        return;
+    }
 
-        if (rc < 0) {
-            if (errno == EAGAIN) {
-                return;
-            }
-            LOG_FOR_DEBUG("recv() from remote %d failed: %s", fd, strerror(errno));
-            context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+    int pending = fbuf_chain_len(c->res) > 0;
+    int rc = fnet_recv_chain(fd, c->res, FBUF_CHAIN_SIZE, iov, &iovcnt);
+    if (rc < 0) {
+        if (errno == EAGAIN) {
             return;
         }
-        if (rc == 0) {
-            LOG_FOR_DEBUG("remote %d connection closed", fd);
-            context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+        if (errno == ENOBUFS) {
+            delete_event(loop, fd, EV_RDABLE);
             return;
         }
-        FBUF_COMMIT_WRITE(c->res, rc);
-        
-        break;
+        LOG_FOR_DEBUG("recv() from remote %d failed: %s", fd, strerror(errno));
+        ticket_check_rejected(c);
+        context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+        return;
+    }
+    if (rc == 0) {
+        LOG_FOR_DEBUG("remote %d connection closed", fd);
+        ticket_check_rejected(c);
+        /* 还有数据没发给 client 时先只关闭 remote，见 client_writable_cb */
+        if (pending) {
+            context_pool_release(c->pool, c, MASK_REMOTE);
+        } else {
+            context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+        }
+        return;
     }
 
-    fcrypt_decrypt(c->crypto, c->res);
-    delete_event(loop, fd, EV_RDABLE);
-    create_event(loop, c->client_fd, EV_WRABLE, &client_writable_cb, c);
+    /* 收到了 server 的数据，ticket 有效 */
+    c->hs_state &= ~HS_RESUMED;
+    fcrypt_decrypt_iov(c->crypto, iov, iovcnt, rc);
+
+    if (!pending) {
+        /* 本地 client 几乎总是可写的，先直接发送，发不完再等待 EPOLLOUT */
+        int r = fnet_send_chain(c->client_fd, &c->res, 0);
+        if (r < 0) {
+            LOG_FOR_DEBUG("send() to client %d failed: %s", c->client_fd, strerror(errno));
+            context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+            return;
+        }
+        if (r == 0) {
+            create_event(loop, c->client_fd, EV_WRABLE, &client_writable_cb, c);
+        }
+    }
+    if (fbuf_chain_space(c->res) == 0) {
+        delete_event(loop, fd, EV_RDABLE);
+    }
 }
 
 
-/* client 可写 */
+/* remote 可写 */
 static void remote_writable_cb(struct event_loop *loop, int fd, int mask, void *evdata)
 {
-
     context_t *c = evdata;
-    
-    while (1) {
-        int rc = send(fd, FBUF_DATA_AT(c->req), FBUF_DATA_LEN(c->req), 0);
-        if (rc < 0) {
-            if (errno == EAGAIN) {
-                return;
-            }
-            LOG_FOR_DEBUG("send() to remote %d failed: %s", fd, strerror(errno));
-            context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+
+    /* 当发送 rc 字节的数据后，如果系统发送缓冲区满，则会产生 EAGAIN 错误，
+     * 此时剩下的数据仍然留在 req chain 中，等待下次可写时发送
+     */
+    int r = fnet_send_chain(fd, &c->req, 0);
+    if (r < 0) {
+        LOG_FOR_DEBUG("send() to remote %d failed: %s", fd, strerror(errno));
+        context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+        return;
+    }
+    if (r == 1) {
+        delete_event(loop, fd, EV_WRABLE);
+
+        /* 如果 client 端已经关闭，则此次请求结束 */
+        if (c->client_fd == 0) {
+            context_pool_release(c->pool, c, MASK_REMOTE);
             return;
         }
-        
-        if (rc >= 0) {
-            /* 当发送 rc 字节的数据后，如果系统发送缓冲区满，则会产生 EAGAIN 错误，
-             * 此时若 rc < c->recvlen，则再次发送时，会丢失 recv buffer 中的
-             * c->recvlen - rc 中的数据，因此应该将其移到 recv buffer 前面
-             */
-            FBUF_COMMIT_READ(c->req, rc);
-            
-            if (FBUF_DATA_LEN(c->req) <= 0) {
-                delete_event(loop, fd, EV_WRABLE);
-                create_event(loop, c->remote_fd, EV_RDABLE, &remote_readable_cb, c);
-                create_event(loop, c->client_fd, EV_RDABLE, &client_readable_cb, c);
-                return;
-            }
-        }
+    }
+    if (c->client_fd != 0 && fbuf_chain_space(c->req) > 0) {
+        arm_event(loop, c->client_fd, EV_RDABLE, &client_readable_cb, c);
     }
 }
 
@@ -340,58 +1716,108 @@ static void client_writable_cb(struct event_loop *loop, int fd, int mask, void *
 {
     context_t *c = evdata;
 
-    while (1) {
-        int rc = send(fd, FBUF_DATA_AT(c->res), FBUF_DATA_LEN(c->res), 0);
-        if (rc < 0) {
-            if (errno == EAGAIN) {
-                return;
-            }
-            LOG_FOR_DEBUG("send() failed to client %d: %s", fd, strerror(errno));
-            context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+    int r = fnet_send_chain(fd, &c->res, 0);
+    if (r < 0) {
+        LOG_FOR_DEBUG("send() failed to client %d: %s", fd, strerror(errno));
+        context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+        return;
+    }
+    if (r == 1) {
+        delete_event(loop, fd, EV_WRABLE);
+        
+        /* 如果 remote 端已经关闭，则此次请求结束 */
+        if (c->remote_fd == 0) {
+            context_pool_release(c->pool, c, MASK_CLIENT);
             return;
         }
-        if (rc >= 0) {
-            FBUF_COMMIT_READ(c->res, rc)
-            if (FBUF_DATA_LEN(c->res) <= 0) {
-
-                delete_event(loop, fd, EV_WRABLE);
-                
-                /* 如果 client 端已经关闭，则此次请求结束 */
-                if (c->remote_fd == 0) {
-                    context_pool_release(c->pool, c, MASK_CLIENT);
-                } else {
-                    create_event(loop, fd, EV_RDABLE, &client_readable_cb, c);
-                    create_event(loop, c->remote_fd, EV_RDABLE, &remote_readable_cb, c);
-                }
-                break;
-            }
-        }
+    }
+    if (c->remote_fd != 0 && fbuf_chain_space(c->res) > 0) {
+        arm_event(loop, c->remote_fd, EV_RDABLE, &remote_readable_cb, c);
     }
 }
 
 static void client_readable_cb(struct event_loop *loop, int fd, int mask, void *evdata)
 {
     context_t *c = evdata;
-    int rc = recv(fd, FBUF_WRITE_AT(c->req), BUFSIZE, 0);
+    struct iovec iov[FBUF_CHAIN_MAX];
+    int iovcnt;
+
+    /* remote 已经关闭，只等 res 中剩下的数据发完 */
+    if (c->remote_fd == 0) {
+        delete_event(loop, fd, EV_RDABLE);
+        return;
+    }
 
+    int pending = fbuf_chain_len(c->req) > 0;
+    int rc = fnet_recv_chain(fd, c->req, FBUF_CHAIN_SIZE, iov, &iovcnt);
     if (rc < 0) {
         if (errno == EAGAIN) {
                 return;
         }
+        if (errno == ENOBUFS) {
+            delete_event(loop, fd, EV_RDABLE);
+            return;
+        }
         LOG_FOR_DEBUG("recv() failed form client %d: %s", fd, strerror(errno));
         context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
         return;
     }
     if (rc == 0) {
         LOG_FOR_DEBUG("client %d Connection closed", fd);
-        context_pool_release(c->pool, c, MASK_REMOTE|MASK_CLIENT);
+        /* 还有数据没发给 remote 时先只关闭 client，见 remote_writable_cb */
+        if (pending) {
+            context_pool_release(c->pool, c, MASK_CLIENT);
+        } else {
+            context_pool_release(c->pool, c, MASK_REMOTE|MASK_CLIENT);
+        }
         return;
     }
 
-    FBUF_COMMIT_WRITE(c->req, rc);
-    fcrypt_encrypt(c->crypto, c->req);
-    delete_event(loop, fd, EV_RDABLE);
-    create_event(loop, c->remote_fd, EV_WRABLE, &remote_writable_cb, c);
+    fcrypt_encrypt_iov(c->crypto, iov, iovcnt, rc);
+
+    if (!pending) {
+        int r = fnet_send_chain(c->remote_fd, &c->req, 0);
+        if (r < 0) {
+            LOG_FOR_DEBUG("send() to remote %d failed: %s", c->remote_fd, strerror(errno));
+            context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+            return;
+        }
+        if (r == 0) {
+            create_event(loop, c->remote_fd, EV_WRABLE, &remote_writable_cb, c);
+        }
+    }
+    if (fbuf_chain_space(c->req) == 0) {
+        delete_event(loop, fd, EV_RDABLE);
+    }
+}
+
+/* host:port, host:port ...，IPv6 的地址写在 [] 中 */
+static void parse_servers(fclient_t *client, const char *value)
+{
+    char buf[1024], *item, *save;
+
+    snprintf(buf, sizeof(buf), "%s", value);
+    for (item = strtok_r(buf, ", ", &save); item != NULL;
+         item = strtok_r(NULL, ", ", &save)) {
+        char *colon = strrchr(item, ':');
+        if (colon == NULL || colon == item || colon[1] == '\0') {
+            fakio_log(LOG_WARNING, "bad server address: %s", item);
+            continue;
+        }
+        *colon = '\0';
+        if (item[0] == '[' && colon[-1] == ']') {
+            item++;
+            colon[-1] = '\0';
+        }
+        if (client->nservers >= SERVER_MAX || strlen(item) >= MAX_HOST_LEN
+            || strlen(colon + 1) >= MAX_PORT_LEN) {
+            fakio_log(LOG_WARNING, "server %s:%s ignored", item, colon + 1);
+            continue;
+        }
+        strcpy(client->servers[client->nservers].host, item);
+        strcpy(client->servers[client->nservers].port, colon + 1);
+        client->nservers++;
+    }
 }
 
 static int config_handler(void* user, const char* section, const char* name,
@@ -406,6 +1832,32 @@ static int config_handler(void* user, const char* section, const char* name,
             strcpy(client->shost, value);
         } else if (strcmp("port", name) == 0) {
             strcpy(client->sport, value);
+        } else if (strcmp("fastopen", name) == 0) {
+            client->fastopen = atoi(value);
+        } else if (strcmp("version", name) == 0) {
+            client->version = atoi(value);
+        } else if (strcmp("padding_min", name) == 0) {
+            client->padding_min = atoi(value);
+        } else if (strcmp("padding_max", name) == 0) {
+            client->padding_max = atoi(value);
+        } else if (strcmp("early_data_wait", name) == 0) {
+            client->early_data_wait = atoi(value);
+        } else if (strcmp("ticket", name) == 0) {
+            client->ticket = atoi(value);
+        } else if (strcmp("mux", name) == 0) {
+            client->mux = atoi(value);
+        } else if (strcmp("stripes", name) == 0) {
+            client->stripes = atoi(value);
+        } else if (strcmp("connect_timeout", name) == 0) {
+            client->connect_timeout = atoi(value);
+        } else if (strcmp("pool", name) == 0) {
+            client->pool = atoi(value);
+        } else if (strcmp("pool_idle", name) == 0) {
+            client->pool_idle = atoi(value);
+        } else if (strcmp("servers", name) == 0) {
+            parse_servers(client, value);
+        } else if (strcmp("probe_interval", name) == 0) {
+            client->probe_interval = atoi(value);
         } else {
             return 0;
         }
@@ -417,6 +1869,16 @@ static int config_handler(void* user, const char* section, const char* name,
             strcpy(client->chost, value);
         } else if (strcmp("port", name) == 0) {
             strcpy(client->cport, value);
+        } else if (strcmp("threads", name) == 0) {
+            client->threads = atoi(value);
+        } else if (strcmp("redir_port", name) == 0) {
+            strcpy(client->redir_port, value);
+        } else if (strcmp("tproxy", name) == 0) {
+            client->tproxy = atoi(value);
+        } else if (strcmp("http_port", name) == 0) {
+            strcpy(client->http_port, value);
+        } else if (strcmp("udp_timeout", name) == 0) {
+            client->udp_timeout = atoi(value);
         } else {
             return 0;
         }
@@ -463,18 +1925,35 @@ static void client_load_config_file(const char *filename, fclient_t *client)
     fclose(f);
 }
 
-
-int main (int argc, char *argv[])
+static int client_listen(const char *port, int flags)
 {
-    if (argc != 2) {
-        fakio_log(LOG_ERROR, "Usage: %s --config_path\n", argv[0]);
+    int fd = fnet_create_and_bind(client.chost, port, flags);
+    if (fd < 0)  {
+        fakio_log(LOG_ERROR, "socket() failed");
+        exit(1);
+    }
+    if (listen(fd, SOMAXCONN) == -1) {
+        fakio_log(LOG_ERROR, "socket() failed");
         exit(1);
     }
+    return fd;
+}
 
-    client_load_config_file(argv[1], &client);
+/*
+ * 每个线程的 event loop，accept 自己的监听 socket 上的连接，之后这个连接
+ * 的所有事件都在本线程中处理
+ */
+static void *client_thread(void *arg)
+{
+    int i, *listen_fds = arg;
 
-    client.r = fcrypt_rand_new();
-    if (client.r == NULL) {
+    for (i = 0; i < client.nservers; i++) {
+        upstreams[i].rtt = -1;
+        upstreams[i].success = 1;
+    }
+
+    rnd = fcrypt_rand_new();
+    if (rnd == NULL) {
         fakio_log(LOG_ERROR, "Start Error!");
         exit(1);
     }
@@ -485,32 +1964,196 @@ int main (int argc, char *argv[])
         fakio_log(LOG_ERROR, "Start Error!");
         exit(1);
     }
-    
+
+    /* fd 是整个进程共用的，每个 event loop 都要能放下所有线程的 fd */
     event_loop *loop;
-    loop = create_event_loop(100);
+    loop = create_event_loop(100 * client.threads);
     if (loop == NULL) {
         fakio_log(LOG_ERROR, "Create Event Loop Error!");
         exit(1);
     }
-    
-    /* NULL is 0.0.0.0 */
-    int listen_sd = fnet_create_and_bind(client.chost, client.cport);
-    if (listen_sd < 0)  {
-        fakio_log(LOG_ERROR, "socket() failed");
+
+    create_event(loop, listen_fds[0], EV_RDABLE, &server_accept_cb, NULL);
+    if (listen_fds[1] > 0) {
+        create_event(loop, listen_fds[1], EV_RDABLE, &redir_accept_cb, NULL);
+    }
+    if (listen_fds[2] > 0) {
+        create_event(loop, listen_fds[2], EV_RDABLE, &http_accept_cb, NULL);
+    }
+    if (client.pool > 0) {
+        pool_fill(loop);
+        create_time_event(loop, POOL_CHECK_INTERVAL, &pool_timer_cb, NULL);
+    }
+    if (client.nservers > 1) {
+        probe_timer_cb(loop, NULL);
+        create_time_event(loop, client.probe_interval, &probe_timer_cb, NULL);
+    }
+    start_event_loop(loop);
+
+    delete_event_loop(loop);
+    return NULL;
+}
+
+/*
+ * server 的地址只在启动时解析，event loop 中的 getaddrinfo 会卡住这个线程
+ * 上所有的连接。地址变了需要重启 client
+ *
+ * Return value: 0 成功, -1 有 server 解析失败
+ */
+static int servers_resolve(void)
+{
+    struct addrinfo hints, *result;
+    int i;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    for (i = 0; i < client.nservers; i++) {
+        int err = getaddrinfo(client.servers[i].host, client.servers[i].port, &hints, &result);
+        if (err != 0) {
+            fakio_log(LOG_ERROR, "server %s:%s getaddrinfo: %s", client.servers[i].host,
+                      client.servers[i].port, gai_strerror(err));
+            return -1;
+        }
+        int n = fnet_addrlist_copy(&client.servers[i].addrs, result);
+        freeaddrinfo(result);
+        if (n == 0) {
+            fakio_log(LOG_ERROR, "server %s:%s has no address", client.servers[i].host,
+                      client.servers[i].port);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main (int argc, char *argv[])
+{
+    if (argc != 2) {
+        fakio_log(LOG_ERROR, "Usage: %s --config_path\n", argv[0]);
         exit(1);
     }
-    set_nonblocking (listen_sd);
-    if (listen(listen_sd, SOMAXCONN) == -1) {
-        fakio_log(LOG_ERROR, "socket() failed");
+
+    client.version = 2;
+    client.padding_max = DEFAULT_PADDING_MAX;
+    client.early_data_wait = DEFAULT_EARLY_DATA_WAIT;
+    client.ticket = 1;
+    client.connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+    client.pool_idle = DEFAULT_POOL_IDLE;
+    client.udp_timeout = DEFAULT_UDP_TIMEOUT;
+    client.probe_interval = DEFAULT_PROBE_INTERVAL;
+    client_load_config_file(argv[1], &client);
+
+    /* host/port 是第一个 server */
+    if (client.shost[0] != '\0' && client.sport[0] != '\0') {
+        if (client.nservers == SERVER_MAX) {
+            client.nservers--;
+        }
+        memmove(&client.servers[1], &client.servers[0],
+                client.nservers * sizeof(client.servers[0]));
+        strcpy(client.servers[0].host, client.shost);
+        strcpy(client.servers[0].port, client.sport);
+        client.nservers++;
+    }
+    if (client.nservers == 0) {
+        fakio_log(LOG_ERROR, "No server in config file: %s", argv[1]);
+        exit(1);
+    }
+    if (servers_resolve() < 0) {
         exit(1);
     }
+    if (client.probe_interval <= 0) {
+        client.probe_interval = DEFAULT_PROBE_INTERVAL;
+    }
+    if (client.padding_max < 0) {
+        client.padding_max = 0;
+    } else if (client.padding_max > FAKIO_HS_PAD_MAX) {
+        client.padding_max = FAKIO_HS_PAD_MAX;
+    }
+    if (client.padding_min < 0 || client.padding_min > client.padding_max) {
+        client.padding_min = client.padding_max;
+    }
+    if (client.mux > MUX_MAX_SESSIONS) {
+        client.mux = MUX_MAX_SESSIONS;
+    }
+    if (client.mux > 0 && client.version == 1) {
+        fakio_log(LOG_WARNING, "mux needs version 2, disabled");
+        client.mux = 0;
+    } else if (client.mux < 0) {
+        client.mux = 0;
+    }
+    if (client.stripes > FSTRIPE_MAX) {
+        client.stripes = FSTRIPE_MAX;
+    }
+    if (client.stripes > 1 && client.version == 1) {
+        fakio_log(LOG_WARNING, "stripes needs version 2, disabled");
+        client.stripes = 0;
+    } else if (client.stripes < 0) {
+        client.stripes = 0;
+    }
+    if (client.connect_timeout <= 0) {
+        client.connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+    }
+    if (client.pool < 0) {
+        client.pool = 0;
+    } else if (client.pool > POOL_MAX) {
+        client.pool = POOL_MAX;
+    }
+    if (client.pool_idle <= 0 || client.pool_idle > POOL_IDLE_MAX) {
+        client.pool_idle = POOL_IDLE_MAX;
+    }
+    if (client.udp_timeout < 0) {
+        client.udp_timeout = 0;
+    }
+
+    if (client.threads <= 0) {
+        client.threads = 1;
+    } else if (client.threads > MAX_THREADS) {
+        client.threads = MAX_THREADS;
+    }
+
+    /* 先在主线程中创建所有的监听 socket，端口被占用时直接退出 */
+    int i, listen_fds[MAX_THREADS][3];
+    int flags = client.threads > 1 ? FNET_BIND_REUSEPORT : 0;
+    for (i = 0; i < client.threads; i++) {
+        /* NULL is 0.0.0.0 */
+        listen_fds[i][0] = client_listen(client.cport, flags);
+        listen_fds[i][1] = -1;
+        if (client.redir_port[0] != '\0') {
+            listen_fds[i][1] = client_listen(client.redir_port,
+                    flags | (client.tproxy ? FNET_BIND_TRANSPARENT : 0));
+        }
+        listen_fds[i][2] = -1;
+        if (client.http_port[0] != '\0') {
+            listen_fds[i][2] = client_listen(client.http_port, flags);
+        }
+    }
 
-    create_event(loop, listen_sd, EV_RDABLE, &server_accept_cb, NULL);
     fakio_log(LOG_INFO, "Fakio client start... binding in %s:%s", client.chost, client.cport);
-    fakio_log(LOG_INFO, "Fakio client event loop start, use %s", get_event_api_name());
-    start_event_loop(loop);
+    if (client.nservers > 1) {
+        fakio_log(LOG_INFO, "%d servers, probe every %d ms", client.nservers,
+                  client.probe_interval);
+    }
+    if (client.redir_port[0] != '\0') {
+        fakio_log(LOG_INFO, "Transparent proxy (%s) binding in %s:%s",
+                  client.tproxy ? "TPROXY" : "REDIRECT", client.chost, client.redir_port);
+    }
+    if (client.http_port[0] != '\0') {
+        fakio_log(LOG_INFO, "HTTP proxy binding in %s:%s", client.chost, client.http_port);
+    }
+    fakio_log(LOG_INFO, "Fakio client event loop start, use %s, %d threads",
+              get_event_api_name(), client.threads);
+
+    pthread_t tid;
+    for (i = 1; i < client.threads; i++) {
+        if (pthread_create(&tid, NULL, &client_thread, listen_fds[i]) != 0) {
+            fakio_log(LOG_ERROR, "Can't create thread!");
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+    client_thread(listen_fds[0]);
 
-    delete_event_loop(loop);
-    
     return 0;
 }
\ No newline at end of file
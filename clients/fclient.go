@@ -19,6 +19,8 @@ import (
 	"net"
 	"os"
 	"strconv"
+	"sync"
+	"time"
 )
 
 type Fclient struct {
@@ -27,9 +29,226 @@ type Fclient struct {
 
 	Server string
 	Local  string
+
+	// more servers, new requests go to the healthy one with the lowest latency
+	Servers []string `json:"servers"`
+
+	// milliseconds between probes when there are several servers
+	ProbeInterval int `json:"probe_interval"`
+
+	// handshake version, old servers only support 1
+	Version    int
+	PaddingMin int `json:"padding_min"`
+	PaddingMax int `json:"padding_max"`
+
+	// milliseconds to wait for early data, 0 to disable
+	EarlyDataWait int `json:"early_data_wait"`
+
+	// use session ticket, 0 to disable
+	Ticket int
 }
 
 var fclient Fclient
+
+// The session ticket issued by server
+type SessionTicket struct {
+	sync.Mutex
+	data   []byte
+	secret []byte
+	renew  time.Time
+}
+
+func (t *SessionTicket) Get() (data, secret []byte) {
+	t.Lock()
+	defer t.Unlock()
+	if t.data == nil || time.Now().After(t.renew) {
+		return nil, nil
+	}
+	return t.data, t.secret
+}
+
+func (t *SessionTicket) Set(data, secret []byte, lifetime int) {
+	t.Lock()
+	defer t.Unlock()
+	t.data = data
+	t.secret = secret
+	// renew before it expires
+	t.renew = time.Now().Add(time.Duration(lifetime) * 750 * time.Millisecond)
+}
+
+func (t *SessionTicket) Drop() {
+	t.Lock()
+	defer t.Unlock()
+	t.data = nil
+	t.secret = nil
+}
+
+const (
+	ewmaWeight   = 0.3 // weight of a new sample
+	healthyRatio = 0.5 // servers with a lower success rate are not used
+	probeTimeout = 5 * time.Second
+	// early data is not used for this long after a server rejected it
+	earlyDataBackoff = 60 * time.Second
+)
+
+// A fakio server and its health: the connect RTT measured by background
+// probes and the success rate of probes and real connections, both smoothed
+// by EWMA. A failed connect marks it down at once, until a connect succeeds
+type Upstream struct {
+	addr string
+
+	// the ticket keys of different servers may differ
+	ticket SessionTicket
+
+	sync.Mutex
+	rtt     float64 // milliseconds, < 0 means no sample yet
+	success float64
+	down    bool
+	probing bool
+
+	earlyOff time.Time // no early data before this
+}
+
+var upstreams []*Upstream
+
+func NewUpstream(addr string) *Upstream {
+	return &Upstream{addr: addr, rtt: -1, success: 1}
+}
+
+// rtt < 0 means no RTT sample this time
+func (u *Upstream) Update(ok bool, rtt float64) {
+	u.Lock()
+	defer u.Unlock()
+
+	v := 0.0
+	if ok {
+		v = 1
+	}
+	u.success += ewmaWeight * (v - u.success)
+	if !ok {
+		if !u.down {
+			u.down = true
+			log.Printf("server %s is down", u.addr)
+		}
+		return
+	}
+	if rtt >= 0 {
+		if u.rtt < 0 {
+			u.rtt = rtt
+		} else {
+			u.rtt += ewmaWeight * (rtt - u.rtt)
+		}
+	}
+	if u.down {
+		u.down = false
+		log.Printf("server %s is up", u.addr)
+	}
+}
+
+// smaller is better, the RTT is scaled up by the failure rate
+func (u *Upstream) score() (score float64, healthy bool, success float64) {
+	u.Lock()
+	defer u.Unlock()
+
+	rtt := u.rtt
+	if rtt < 0 {
+		rtt = 0
+	}
+	s := u.success
+	if s < 0.01 {
+		s = 0.01
+	}
+	return (rtt + 1) / s, !u.down && u.success >= healthyRatio, u.success
+}
+
+func (u *Upstream) EarlyData() bool {
+	u.Lock()
+	defer u.Unlock()
+	return time.Now().After(u.earlyOff)
+}
+
+func (u *Upstream) EarlyDataRejected() {
+	u.Lock()
+	defer u.Unlock()
+	u.earlyOff = time.Now().Add(earlyDataBackoff)
+	log.Printf("early data rejected by server %s", u.addr)
+}
+
+func (u *Upstream) Dial() (net.Conn, error) {
+	conn, err := net.DialTimeout("tcp", u.addr, probeTimeout)
+	u.Update(err == nil, -1)
+	return conn, err
+}
+
+// connect and close at once, no handshake
+func (u *Upstream) probe() {
+	u.Lock()
+	if u.probing {
+		u.Unlock()
+		return
+	}
+	u.probing = true
+	u.Unlock()
+
+	start := time.Now()
+	conn, err := net.DialTimeout("tcp", u.addr, probeTimeout)
+	if err == nil {
+		conn.Close()
+	}
+	u.Update(err == nil, float64(time.Since(start))/float64(time.Millisecond))
+
+	u.Lock()
+	u.probing = false
+	u.Unlock()
+}
+
+func probeUpstreams(interval time.Duration) {
+	for {
+		for _, u := range upstreams {
+			go u.probe()
+		}
+		time.Sleep(interval)
+	}
+}
+
+// The healthy server with the lowest score, not in tried. When none is
+// healthy and nothing was tried yet, the one with the best success rate,
+// there is always one to try
+func pickUpstream(tried map[*Upstream]bool) *Upstream {
+	var best, fallback *Upstream
+	var bestScore, fallbackSuccess float64
+
+	for _, u := range upstreams {
+		if tried[u] {
+			continue
+		}
+		score, healthy, success := u.score()
+		if fallback == nil || success > fallbackSuccess {
+			fallback, fallbackSuccess = u, success
+		}
+		if healthy && (best == nil || score < bestScore) {
+			best, bestScore = u, score
+		}
+	}
+	if best == nil && len(tried) == 0 {
+		best = fallback
+	}
+	return best
+}
+
+// per connection EIV, DIV, KEY from ticket secret and nonce
+func deriveKey(secret, nonce []byte) []byte {
+	bytes := make([]byte, 0, 64)
+	for i := byte(1); i <= 2; i++ {
+		hash := sha256.New()
+		hash.Write(secret)
+		hash.Write(nonce)
+		hash.Write([]byte{i})
+		bytes = hash.Sum(bytes)
+	}
+	return bytes[0:48]
+}
+
 var localReply []byte
 
 // The Cipher
@@ -69,12 +288,35 @@ func (c *Cipher) Decrypt(dst, src []byte) {
 type FakioConn struct {
 	net.Conn
 	*Cipher
+
+	// used a session ticket and nothing received yet
+	resumed bool
+	up      *Upstream
 }
 
-func FakioDial(server string, req []byte) (c *FakioConn, err error) {
-	conn, err := net.Dial("tcp", server)
-	if err != nil {
-		return nil, err
+// handshake on conn, a connection already made to up
+func FakioHandshake(conn net.Conn, up *Upstream, req []byte, secret []byte) (c *FakioConn, err error) {
+	// username or ticket
+	var index int
+	if req[16] == 0 {
+		index = 16 + 1 + 2 + int(binary.BigEndian.Uint16(req[17:19]))
+	} else {
+		index = 16 + int(req[16]) + 1
+	}
+
+	// with a session ticket server will not reply
+	if secret != nil {
+		cipher, err := NewCipher(deriveKey(secret, req[0:16]))
+		if err != nil {
+			conn.Close()
+			return nil, err
+		}
+		cipher.Encrypt(req[index:], req[index:])
+		if _, err := conn.Write(req); err != nil {
+			conn.Close()
+			return nil, errors.New("handshake to server error")
+		}
+		return &FakioConn{conn, cipher, true, up}, nil
 	}
 
 	//handshake
@@ -82,28 +324,50 @@ func FakioDial(server string, req []byte) (c *FakioConn, err error) {
 
 	block, err := aes.NewCipher(key)
 	if err != nil {
+		conn.Close()
 		return nil, err
 	}
 	enc := cipher.NewCFBEncrypter(block, req[0:16])
 
-	// 22 = iv + username
-	index := 16 + int(req[16]) + 1
+	ticketReq := fclient.Version != 1 && req[index]&0x80 != 0
 	enc.XORKeyStream(req[index:], req[index:])
 	if _, err := conn.Write(req); err != nil {
+		conn.Close()
 		return nil, errors.New("handshake to server error")
 	}
 
 	hand := make([]byte, 64)
-	if _, err := conn.Read(hand); err != nil {
+	if _, err := io.ReadFull(conn, hand); err != nil {
+		conn.Close()
 		return nil, errors.New("handshake to server error")
 	}
 
 	dec := cipher.NewCFBDecrypter(block, hand[0:16])
 	dec.XORKeyStream(hand[16:], hand[16:])
 
+	// LIFETIME(4) | SECRET(32) | TLEN(2) | TICKET
+	if ticketReq {
+		ext := make([]byte, 4+32+2)
+		if _, err := io.ReadFull(conn, ext); err != nil {
+			conn.Close()
+			return nil, errors.New("handshake to server error")
+		}
+		dec.XORKeyStream(ext, ext)
+		tk := make([]byte, binary.BigEndian.Uint16(ext[36:38]))
+		if _, err := io.ReadFull(conn, tk); err != nil {
+			conn.Close()
+			return nil, errors.New("handshake to server error")
+		}
+		dec.XORKeyStream(tk, tk)
+		lifetime := int(binary.BigEndian.Uint32(ext[0:4]))
+		if len(tk) > 0 && lifetime > 0 {
+			up.ticket.Set(tk, ext[4:36], lifetime)
+		}
+	}
+
 	cipher, err := NewCipher(hand[16:])
 
-	return &FakioConn{conn, cipher}, nil
+	return &FakioConn{conn, cipher, false, up}, nil
 }
 
 func (c *FakioConn) Read(b []byte) (n int, err error) {
@@ -111,6 +375,15 @@ func (c *FakioConn) Read(b []byte) (n int, err error) {
 	n, err = c.Conn.Read(b)
 	c.Decrypt(b[0:n], b[0:n])
 
+	// closed before anything received, the ticket is likely invalid
+	if n > 0 {
+		c.resumed = false
+	} else if err != nil && c.resumed {
+		log.Printf("session ticket rejected by server %s", c.up.addr)
+		c.up.ticket.Drop()
+		c.resumed = false
+	}
+
 	return n, err
 }
 
@@ -122,8 +395,56 @@ func (c *FakioConn) Write(b []byte) (n int, err error) {
 	return n, err
 }
 
-func buildFakioReq(buf []byte) (req []byte, err error) {
-	req = make([]byte, 1024)
+// v2: VER | ATYP | addr | port | PLEN | padding
+// v3: VER | ATYP | addr | port | PLEN | ELEN | padding | early data
+// noTicket makes a full handshake even with a valid ticket
+func buildFakioReq(buf []byte, early []byte, up *Upstream, noTicket bool) (req []byte, secret []byte, err error) {
+	var tk []byte
+	if fclient.Version != 1 && fclient.Ticket != 0 && !noTicket {
+		tk, secret = up.ticket.Get()
+	}
+
+	nameLen := len(fclient.UserName)
+	index := 16 + 1 + nameLen
+	if tk != nil {
+		index = 16 + 1 + 2 + len(tk)
+	}
+	aLen := len(buf) - 3
+
+	if fclient.Version == 1 {
+		// v1: padding to 1024 bytes
+		req = make([]byte, 1024)
+		req[index] = 0x5
+	} else {
+		pad := fclient.PaddingMin
+		if fclient.PaddingMax > fclient.PaddingMin {
+			r := make([]byte, 1)
+			if _, err = rand.Read(r); err != nil {
+				log.Println("rand padding error:", err)
+				return
+			}
+			pad += int(r[0]) % (fclient.PaddingMax - fclient.PaddingMin + 1)
+		}
+		p := index + 1 + aLen
+		if len(early) > 0 {
+			req = make([]byte, p+1+2+pad+len(early))
+			req[index] = 0x3
+			binary.BigEndian.PutUint16(req[p+1:], uint16(len(early)))
+			copy(req[p+3+pad:], early)
+			p += 2
+		} else {
+			req = make([]byte, p+1+pad)
+			req[index] = 0x2
+		}
+		req[index+1+aLen] = byte(pad)
+		if _, err = rand.Read(req[p+1 : p+1+pad]); err != nil {
+			log.Println("rand padding error:", err)
+			return
+		}
+		if tk == nil && fclient.Ticket != 0 {
+			req[index] |= 0x80
+		}
+	}
 
 	iv := make([]byte, 16)
 	_, err = rand.Read(iv)
@@ -132,15 +453,56 @@ func buildFakioReq(buf []byte) (req []byte, err error) {
 		return
 	}
 	copy(req, iv)
+	if fclient.Version != 1 {
+		// the IV starts with the current time, the server rejects replayed
+		// 0-RTT handshakes
+		binary.BigEndian.PutUint32(req[0:4], uint32(time.Now().Unix()))
+	}
 
-	nameLen := len(fclient.UserName)
-	index := 16 + 1 + nameLen
-	req[16] = byte(nameLen)
-	copy(req[17:index], fclient.UserName)
-	req[index] = 0x5
+	if tk != nil {
+		req[16] = 0
+		binary.BigEndian.PutUint16(req[17:19], uint16(len(tk)))
+		copy(req[19:index], tk)
+	} else {
+		req[16] = byte(nameLen)
+		copy(req[17:index], fclient.UserName)
+	}
 	copy(req[index+1:], buf[3:])
 
-	return req, nil
+	return req, secret, nil
+}
+
+// a full handshake with no early data on a new connection to up
+func retryHandshake(buf []byte, up *Upstream) (*FakioConn, error) {
+	conn, err := up.Dial()
+	if err != nil {
+		return nil, err
+	}
+	req, secret, err := buildFakioReq(buf, nil, up, true)
+	if err != nil {
+		conn.Close()
+		return nil, err
+	}
+	return FakioHandshake(conn, up, req, secret)
+}
+
+// the first bytes the client sends after SOCKS5 reply go with the handshake
+func readEarlyData(conn net.Conn) (early []byte, err error) {
+	if fclient.Version == 1 || fclient.EarlyDataWait <= 0 {
+		return nil, nil
+	}
+	early = make([]byte, 1024)
+	wait := time.Duration(fclient.EarlyDataWait) * time.Millisecond
+	conn.SetReadDeadline(time.Now().Add(wait))
+	n, err := conn.Read(early)
+	conn.SetReadDeadline(time.Time{})
+	if err != nil {
+		if e, ok := err.(net.Error); ok && e.Timeout() {
+			return nil, nil
+		}
+		return nil, err
+	}
+	return early[:n], nil
 }
 
 // SOCKS5 Handshake
@@ -198,10 +560,7 @@ func socks5Handshake(conn net.Conn) (req []byte, err error) {
 		}
 	}
 
-	req, err = buildFakioReq(buf)
-	if err != nil {
-		return
-	}
+	req = buf[:reqLen]
 
 	//log request
 	var host string
@@ -232,15 +591,61 @@ func handleConnection(client net.Conn) {
 		client.Close()
 	}()
 
-	req, err := socks5Handshake(client)
+	buf, err := socks5Handshake(client)
 	if err != nil {
 		return
 	}
 
-	remote, err := FakioDial(fclient.Server, req)
+	early, err := readEarlyData(client)
 	if err != nil {
 		return
 	}
+
+	// a server that can't be connected is skipped at once, nothing was
+	// sent to it so the request can go to the next one
+	var remote *FakioConn
+	tried := make(map[*Upstream]bool)
+	for up := pickUpstream(tried); up != nil; up = pickUpstream(tried) {
+		tried[up] = true
+		conn, err := up.Dial()
+		if err != nil {
+			log.Printf("connect %s error: %v", up.addr, err)
+			continue
+		}
+		e := early
+		if !up.EarlyData() {
+			e = nil
+		}
+		req, secret, err := buildFakioReq(buf, e, up, false)
+		if err != nil {
+			conn.Close()
+			return
+		}
+		remote, err = FakioHandshake(conn, up, req, secret)
+		if err != nil && secret == nil && len(e) > 0 {
+			// closed before the reply: the server may have refused the
+			// early data (clock skew or a full replay cache), or the
+			// target is down. Try once more without early data and without
+			// the ticket, which would be refused the same way
+			e = nil
+			if remote, err = retryHandshake(buf, up); err == nil {
+				up.EarlyDataRejected()
+			}
+		}
+		if err != nil {
+			return
+		}
+		if len(e) == 0 && len(early) > 0 {
+			if _, err = remote.Write(early); err != nil {
+				remote.Close()
+				return
+			}
+		}
+		break
+	}
+	if remote == nil {
+		return
+	}
 	defer func() {
 		remote.Close()
 	}()
@@ -266,7 +671,7 @@ func handleConnection(client net.Conn) {
 		}
 	}(remote, client)
 
-	buf := make([]byte, 1024)
+	buf = make([]byte, 1024)
 
 	for {
 		n, err := remote.Read(buf)
@@ -358,9 +763,34 @@ func main() {
 	flag.StringVar(&conf, "c", "config.json", "config file path")
 	flag.Parse()
 
+	fclient.Version = 2
+	fclient.PaddingMax = 32
+	fclient.EarlyDataWait = 10
+	fclient.Ticket = 1
+	fclient.ProbeInterval = 2000
 	if err := getConfig(conf, &fclient); err != nil {
 		log.Fatalf("get config error: %s", err)
 	}
+	if fclient.Server != "" {
+		upstreams = append(upstreams, NewUpstream(fclient.Server))
+	}
+	for _, addr := range fclient.Servers {
+		upstreams = append(upstreams, NewUpstream(addr))
+	}
+	if len(upstreams) == 0 {
+		log.Fatalf("no server in config")
+	}
+	if fclient.ProbeInterval <= 0 {
+		fclient.ProbeInterval = 2000
+	}
+	if fclient.PaddingMax < 0 {
+		fclient.PaddingMax = 0
+	} else if fclient.PaddingMax > 255 {
+		fclient.PaddingMax = 255
+	}
+	if fclient.PaddingMin < 0 || fclient.PaddingMin > fclient.PaddingMax {
+		fclient.PaddingMin = fclient.PaddingMax
+	}
 	log.Printf("use config: %s", fclient)
 
 	var err error
@@ -369,5 +799,8 @@ func main() {
 		log.Fatalf("fakio start error: %s", err)
 	}
 
+	if len(upstreams) > 1 {
+		go probeUpstreams(time.Duration(fclient.ProbeInterval) * time.Millisecond)
+	}
 	run(fclient.Local)
 }
@@ -107,8 +107,10 @@ static int ev_api_poll(event_loop *loop, struct timeval *tvp)
 
             if (e->events & EPOLLIN) mask |= EV_RDABLE;
             if (e->events & EPOLLOUT) mask |= EV_WRABLE;
-            if (e->events & EPOLLERR) mask |= EV_WRABLE;
-            if (e->events & EPOLLHUP) mask |= EV_WRABLE;
+            /* 出错时读写回调都可能在等待，都通知一下，否则只注册了读事件
+             * 的 fd 会一直触发 EPOLLERR 却没有人处理 */
+            if (e->events & EPOLLERR) mask |= EV_WRABLE|EV_RDABLE;
+            if (e->events & EPOLLHUP) mask |= EV_WRABLE|EV_RDABLE;
             loop->fireds[j].fd = e->data.fd;
             loop->fireds[j].mask = mask;
         }
@@ -313,6 +315,15 @@ int get_event_mask(event_loop *loop, int fd)
     return ev->mask;
 }
 
+/* fd 还没有注册 mask 时才注册，已经注册时不重复调用 create_event */
+void arm_event(event_loop *loop, int fd, int mask,
+               ev_callback *cb, void *evdata)
+{
+    if (!(get_event_mask(loop, fd) & mask)) {
+        create_event(loop, fd, mask, cb, evdata);
+    }
+}
+
 
 /* 时间事件 */
 static inline void get_time(long *seconds, long *microseconds)
@@ -403,7 +414,10 @@ static int process_time_events(event_loop *loop)
         processed++;
         
         if (retval != EV_TIMER_END) {
+            /* 重新入堆，直接修改堆顶的时间会破坏堆的性质 */
+            min_heap_delete(loop->timeheap, te);
             add_millisec_to_now(retval, &te->when_sec, &te->when_usec);
+            min_heap_push(loop->timeheap, te);
         } else {
             delete_time_event(loop, te);
         }  
@@ -76,6 +76,8 @@ int create_event(event_loop *loop, int fd, int mask,
                  ev_callback *cb, void *evdata);
 void delete_event(event_loop *loop, int fd, int mask);
 int get_event_mask(event_loop *loop, int fd);
+void arm_event(event_loop *loop, int fd, int mask,
+               ev_callback *cb, void *evdata);
 
 int delete_time_event(event_loop *loop, time_event *te);
 time_event *create_time_event(event_loop *loop, long long milliseconds,
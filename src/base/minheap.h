@@ -20,8 +20,8 @@ static inline void _shift_down(min_heap_t *s, long hole_index, time_event *e);
 
 static inline int min_heap_elem_greater(time_event *a, time_event *b)
 {
-    if (a->when_sec != b->when_sec) return (a->when_sec - b->when_sec);
-    return (a->when_usec - b->when_usec);
+    if (a->when_sec != b->when_sec) return a->when_sec > b->when_sec;
+    return a->when_usec > b->when_usec;
 }
 
 static inline void min_heap_ctor(min_heap_t *s)
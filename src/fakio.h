@@ -17,6 +17,14 @@ typedef struct frequest frequest_t;
 typedef struct context_pool context_pool_t;
 typedef struct context context_t;
 typedef struct fuser fuser_t;
+typedef struct fresolver fresolver_t;
+typedef struct fbreaker fbreaker_t;
+typedef struct fticket fticket_t;
+typedef struct freplay freplay_t;
+typedef struct fmux fmux_t;
+typedef struct fmux_stream fmux_stream_t;
+typedef struct fudp fudp_t;
+typedef struct fstripe fstripe_t;
 
 #define BUFSIZE 4088
 #define HANDSHAKE_SIZE 1024
@@ -33,17 +41,105 @@ typedef struct fuser fuser_t;
 #include "fcontexts.h"
 #include "fcrypt.h"
 #include "fnet.h"
+#include "fresolver.h"
+#include "fbreaker.h"
+#include "fticket.h"
+#include "freplay.h"
+#include "fmux.h"
+#include "fudp.h"
+#include "fstripe.h"
+
+/* 数据报的计数，见 fudp.h */
+struct fudp_stats {
+    unsigned long sent;       /* 发给 UDP socket 的数据报 */
+    unsigned long send_calls; /* sendmmsg 的次数 */
+    unsigned long received;   /* 从 UDP socket 收到的数据报 */
+    unsigned long recv_calls; /* recvmmsg 的次数 */
+    unsigned long dropped;    /* 太长、地址不对或者发不出去而丢掉的数据报 */
+};
+
+/* 运行时统计，由 stats_interval 定时输出到日志 */
+struct fstats {
+    unsigned long accept_wakeups;   /* listen fd 可读的次数 */
+    unsigned long accepted;         /* 成功 accept 的连接数 */
+    unsigned long accept_max_batch; /* 单次唤醒 accept 的最大连接数 */
+    unsigned long accept_budget_out;/* 用完 accept_batch 预算的次数 */
+    unsigned long backlog_full;     /* 预算用完时 accept 队列已满(内核开始丢弃) */
+    unsigned long accept_drops;     /* 没有可用 context 而被关闭的连接 */
+    unsigned long accept_errors;
+
+    unsigned long zerocopy_sends;   /* 使用 MSG_ZEROCOPY 的 send 次数 */
+    unsigned long zerocopy_copied;  /* 内核退回到复制方式的连接数 */
+
+    unsigned long dns_lookups;      /* 交给 resolver 线程解析的域名数(缓存未命中) */
+    unsigned long dns_failed;
+    unsigned long dns_cache_hits;
+    unsigned long dns_negative_hits;/* 命中缓存的失败结果 */
+
+    unsigned long connect_fallbacks;/* 开始连接第二个及之后的地址的次数 */
+    unsigned long connect_timeouts;
+    unsigned long connect_failed;   /* 所有地址都连接失败 */
+    unsigned long connect_v6;       /* 最终使用 IPv6 连上的次数 */
+    unsigned long connect_v4;
+
+    unsigned long breaker_trips;    /* 目标连续失败被断开的次数 */
+    unsigned long breaker_rejects;  /* 目标断开期间直接拒绝的请求 */
+
+    unsigned long handshakes;       /* 完成的握手数 */
+    unsigned long early_data;       /* 带有 early data 的握手数 */
+    unsigned long early_bytes;
+
+    unsigned long tickets_issued;
+    unsigned long tickets_resumed;  /* 使用 ticket 跳过完整握手的连接 */
+    unsigned long tickets_rejected; /* 无效或者过期的 ticket */
+    unsigned long replays_rejected; /* 时间不对或者重放的 0-RTT 握手 */
+
+    unsigned long mux_sessions;     /* 多路复用的隧道数 */
+    unsigned long mux_streams;      /* 隧道上打开的 stream 数 */
+
+    unsigned long udp_sessions;     /* UDP ASSOCIATE 的关联数 */
+    struct fudp_stats udp;          /* 所有关联收发的数据报 */
+
+    unsigned long stripe_sessions;  /* 使用多条连接的请求数 */
+    unsigned long stripe_joins;     /* 加入这些请求的连接数(不包括主连接) */
+};
 
 struct fserver {
     char host[MAX_HOST_LEN];
     char port[MAX_PORT_LEN];
     int connections; /* 最大连接数 */
+    int accept_batch; /* 每次唤醒最多 accept 的连接数 */
+    int stats_interval; /* 统计输出间隔(秒)，0 不输出 */
+    int coalesce_batch; /* remote 数据攒够多少字节再发给 client */
+    int coalesce_delay; /* 不足一个 batch 时最多等待的毫秒数，0 不等待 */
+    int zerocopy_threshold; /* 不小于此大小的数据块使用 MSG_ZEROCOPY，0 关闭 */
+    int resolver_threads; /* 解析域名的线程数 */
+    int dns_cache_size; /* DNS 缓存的域名个数，0 不缓存 */
+    int dns_ttl; /* 解析结果缓存的秒数 */
+    int dns_negative_ttl; /* 解析失败缓存的秒数 */
+    int connect_timeout; /* 最后一个地址开始连接后的超时(毫秒) */
+    int happy_eyeballs_delay; /* 前一个地址多久没连上就同时连接下一个(毫秒) */
+    int fastopen; /* TCP Fast Open 队列长度，0 关闭 */
+    int breaker_threshold; /* 目标连续失败多少次后断开，-1 关闭 */
+    int breaker_backoff; /* 断开后拒绝请求的时间(毫秒)，试探失败时加倍 */
+    int breaker_max_backoff;
+    int ticket_lifetime; /* session ticket 的有效时间(秒)，-1 关闭 */
+    char ticket_secret[64]; /* 生成 ticket key 的密钥，空则每次启动随机生成 */
+    int replay_window; /* 0-RTT 握手中 client 的时间和 server 最多相差的秒数，-1 不检查重放 */
+    int replay_cache; /* window 内最多记住的 0-RTT 握手数 */
+    int udp_timeout; /* UDP 关联空闲多少秒后关闭，-1 不转发 UDP */
+
+    struct fstats stats;
 
     context_pool_t *pool;
     hashmap *users;
     event_loop *loop;
 
     fcrypt_rand_t *r;
+    fresolver_t *resolver;
+    fbreaker_t *breaker;
+    fticket_t *tickets;
+    freplay_t *replay;
 };
 
 #endif
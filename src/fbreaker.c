@@ -0,0 +1,119 @@
+#include "fbreaker.h"
+#include <stdlib.h>
+#include <ctype.h>
+
+/*
+ * 直接映射的表，key 冲突时覆盖旧的条目，最多丢掉一个目标的失败记录，
+ * 不会误判其它目标
+ */
+struct breaker_entry {
+    unsigned long key;   /* 0 表示空 */
+    int failures;        /* 连续失败次数 */
+    int backoff;         /* 当前的 backoff(毫秒) */
+    long long open_until;/* 在此之前拒绝请求 */
+};
+
+struct fbreaker {
+    struct breaker_entry *entries;
+    unsigned long mask;
+
+    int threshold;
+    int backoff, max_backoff;
+};
+
+fbreaker_t *fbreaker_create(int size, int threshold, int backoff, int max_backoff)
+{
+    unsigned long n = 1;
+
+    fbreaker_t *b = malloc(sizeof(*b));
+    if (b == NULL) return NULL;
+
+    while (n < (unsigned long)size) {
+        n <<= 1;
+    }
+    b->entries = calloc(n, sizeof(struct breaker_entry));
+    if (b->entries == NULL) {
+        free(b);
+        return NULL;
+    }
+    b->mask = n - 1;
+    b->threshold = threshold;
+    b->backoff = backoff;
+    b->max_backoff = max_backoff < backoff ? backoff : max_backoff;
+    return b;
+}
+
+/* host 不区分大小写 */
+unsigned long fbreaker_key(const char *host, const char *port)
+{
+    unsigned long h = 5381;
+
+    while (*host) {
+        h = h * 33 + tolower((unsigned char)*host++);
+    }
+    h = h * 33 + ':';
+    while (*port) {
+        h = h * 33 + (unsigned char)*port++;
+    }
+    return h ? h : 1;
+}
+
+static inline struct breaker_entry *find(fbreaker_t *b, unsigned long key)
+{
+    struct breaker_entry *e = &b->entries[key & b->mask];
+    return e->key == key ? e : NULL;
+}
+
+int fbreaker_allow(fbreaker_t *b, unsigned long key)
+{
+    if (b == NULL) return 1;
+
+    struct breaker_entry *e = find(b, key);
+    if (e == NULL || e->failures < b->threshold) {
+        return 1;
+    }
+
+    long long now = fakio_now_ms();
+    if (now < e->open_until) {
+        return 0;
+    }
+    /* 放一个请求去试探，结果出来之前其它请求仍然拒绝 */
+    e->open_until = now + e->backoff;
+    return 1;
+}
+
+void fbreaker_success(fbreaker_t *b, unsigned long key)
+{
+    if (b == NULL) return;
+
+    struct breaker_entry *e = find(b, key);
+    if (e != NULL) {
+        e->key = 0;
+    }
+}
+
+int fbreaker_failure(fbreaker_t *b, unsigned long key)
+{
+    if (b == NULL) return 0;
+
+    struct breaker_entry *e = &b->entries[key & b->mask];
+    if (e->key != key) {
+        e->key = key;
+        e->failures = 0;
+        e->backoff = b->backoff;
+    }
+
+    e->failures++;
+    if (e->failures < b->threshold) {
+        return 0;
+    }
+    /* 试探失败，backoff 加倍 */
+    if (e->failures > b->threshold && e->backoff < b->max_backoff) {
+        e->backoff *= 2;
+        if (e->backoff > b->max_backoff) {
+            e->backoff = b->max_backoff;
+        }
+    }
+    e->open_until = fakio_now_ms() + e->backoff;
+    return e->failures == b->threshold;
+}
@@ -0,0 +1,24 @@
+#ifndef _FAKIO_BREAKER_H_
+#define _FAKIO_BREAKER_H_
+
+#include "fakio.h"
+
+/*
+ * 目标(host:port)的健康表。连续 threshold 次连接失败后断开(trip)，在
+ * backoff 时间内直接拒绝新的请求；时间到了只放一个请求过去试探，试探
+ * 成功则恢复，失败则 backoff 加倍(最多 max_backoff)
+ */
+
+fbreaker_t *fbreaker_create(int size, int threshold, int backoff, int max_backoff);
+
+unsigned long fbreaker_key(const char *host, const char *port);
+
+/* Return value: 1 允许连接, 0 拒绝 */
+int fbreaker_allow(fbreaker_t *b, unsigned long key);
+
+void fbreaker_success(fbreaker_t *b, unsigned long key);
+
+/* Return value: 1 这次失败使目标断开 */
+int fbreaker_failure(fbreaker_t *b, unsigned long key);
+
+#endif
@@ -2,6 +2,8 @@
 #define _FAKIO_BUFFER_H_
 
 #include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
 
 #include "fakio.h"
 
@@ -9,6 +11,8 @@ struct fbuffer {
     uint8_t buffer[BUFSIZE];
     int length;
     int start;
+    int pinned; /* MSG_ZEROCOPY 发出后内核还未释放的次数 */
+    struct fbuffer *next; /* chain 中的下一块 buffer */
 };
 
 
@@ -16,12 +20,16 @@ struct fbuffer {
     (B) = (struct fbuffer *)malloc(sizeof(struct fbuffer)); \
     if ((B) != NULL) {                        \
         (B)->length = (B)->start = 0;         \
+        (B)->pinned = 0;                      \
+        (B)->next = NULL;                     \
     }                                          \
 } while (0)
 
 #define FBUF_FREE(B) (free(B))
 
-#define FBUF_WRITE_AT(B) ((B)->buffer)
+/* 追加写入的位置，以及剩余可写入的空间 */
+#define FBUF_WRITE_AT(B) ((B)->buffer + (B)->start + (B)->length)
+#define FBUF_WRITE_LEN(B) (BUFSIZE - (B)->start - (B)->length)
 
 #define FBUF_COMMIT_WRITE(B, A) ((B)->length += (A))
 
@@ -39,7 +47,225 @@ struct fbuffer {
 } while (0);
 
 #define FBUF_REST(B) ((B)->length = (B)->start = 0)
+
+/* 被内核引用的 buffer 在收到完成通知前不能写入新数据 */
+#define FBUF_PINNED(B) ((B)->pinned > 0)
 #define FBUF_WRITE_SEEK(B, A) ((B)->buffer+(A))
 #define FBUF_DATA_SEEK(B, A) ((B)->buffer+(A))
 
-#endif
\ No newline at end of file
+/*
+ * Buffer Chain
+ *
+ * 以一块 fbuffer 为链头，数据按顺序连续地分布在各块 buffer 中，只有最后一块
+ * 有数据的 buffer 后面有空闲空间。配合 readv/writev 使用，一次系统调用就可以
+ * 填充或发送多块 buffer，发送了一部分的数据也可以和新读到的数据一起发送。
+ * 链头的 pinned 计数代表整条 chain，新 buffer 在需要时才分配。
+ */
+#define FBUF_CHAIN_MAX 4
+#define FBUF_CHAIN_SIZE (FBUF_CHAIN_MAX * BUFSIZE)
+
+static inline int fbuf_chain_len(const fbuffer_t *b)
+{
+    int len = 0;
+    for (; b != NULL; b = b->next) {
+        len += b->length;
+    }
+    return len;
+}
+
+/* 最后一块有数据的 buffer，没有数据时是链头 */
+static inline fbuffer_t *fbuf_chain_tail(fbuffer_t *b)
+{
+    while (b->next != NULL && b->next->length > 0) {
+        b = b->next;
+    }
+    return b;
+}
+
+/* 还能写入多少字节(包括尚未分配的 buffer) */
+static inline int fbuf_chain_space(fbuffer_t *head)
+{
+    int n = 1, space;
+    fbuffer_t *b = head;
+
+    while (b->next != NULL && b->next->length > 0) {
+        b = b->next;
+        n++;
+    }
+    space = FBUF_WRITE_LEN(b);
+    for (b = b->next; b != NULL; b = b->next) {
+        space += BUFSIZE;
+        n++;
+    }
+    return space + (FBUF_CHAIN_MAX - n) * BUFSIZE;
+}
+
+/*
+ * 取得最多 limit 字节的可写空间，不够时在链尾分配新的 buffer，
+ * iov 至少要有 FBUF_CHAIN_MAX 个元素
+ *
+ * Return value: 使用的 iovec 个数
+ */
+static inline int fbuf_chain_write_iov(fbuffer_t *head, struct iovec *iov, int limit)
+{
+    int cnt = 0, n = 1, space;
+    fbuffer_t *b = head;
+
+    while (b->next != NULL && b->next->length > 0) {
+        b = b->next;
+        n++;
+    }
+    while (limit > 0) {
+        space = FBUF_WRITE_LEN(b);
+        if (space > 0) {
+            if (space > limit) space = limit;
+            iov[cnt].iov_base = FBUF_WRITE_AT(b);
+            iov[cnt].iov_len = space;
+            cnt++;
+            limit -= space;
+        }
+        if (b->next == NULL) {
+            if (n >= FBUF_CHAIN_MAX) break;
+            FBUF_CREATE(b->next);
+            if (b->next == NULL) break;
+        }
+        b = b->next;
+        n++;
+    }
+    return cnt;
+}
+
+static inline void fbuf_chain_commit_write(fbuffer_t *head, int len)
+{
+    int space;
+    fbuffer_t *b = fbuf_chain_tail(head);
+
+    while (len > 0 && b != NULL) {
+        space = FBUF_WRITE_LEN(b);
+        if (space > len) space = len;
+        FBUF_COMMIT_WRITE(b, space);
+        len -= space;
+        b = b->next;
+    }
+}
+
+/* Return value: 使用的 iovec 个数 */
+static inline int fbuf_chain_data_iov(fbuffer_t *head, struct iovec *iov, int max)
+{
+    int cnt = 0;
+    fbuffer_t *b;
+
+    for (b = head; b != NULL && cnt < max && b->length > 0; b = b->next) {
+        iov[cnt].iov_base = FBUF_DATA_AT(b);
+        iov[cnt].iov_len = b->length;
+        cnt++;
+    }
+    return cnt;
+}
+
+/* 消费 len 字节，读空的链头移到链尾复用 */
+static inline void fbuf_chain_commit_read(fbuffer_t **head, int len)
+{
+    int n;
+    fbuffer_t *b, *last;
+
+    while (len > 0) {
+        b = *head;
+        n = (b->length < len) ? b->length : len;
+        FBUF_COMMIT_READ(b, n);
+        len -= n;
+
+        if (b->length > 0 || b->next == NULL || b->next->length == 0) {
+            break;
+        }
+        *head = b->next;
+        (*head)->pinned = b->pinned;
+        b->pinned = 0;
+        b->next = NULL;
+        for (last = *head; last->next != NULL; last = last->next);
+        last->next = b;
+    }
+}
+
+/* 从 chain 的第 off 字节开始复制 len 字节，不消费数据 */
+static inline void fbuf_chain_peek(const fbuffer_t *b, int off, uint8_t *out, int len)
+{
+    int n;
+
+    for (; b != NULL && len > 0; b = b->next) {
+        n = b->length;
+        if (off >= n) {
+            off -= n;
+            continue;
+        }
+        n -= off;
+        if (n > len) n = len;
+        memcpy(out, FBUF_DATA_AT(b) + off, n);
+        out += n;
+        len -= n;
+        off = 0;
+    }
+}
+
+/*
+ * 帧头在 fbuf_chain_write_iov 取得的空间中预留，数据读进来之后再填写，
+ * 下面两个函数用来处理跨越 buffer 的帧头
+ */
+
+/* 从 iov 的第 off 字节开始写入 data */
+static inline void fbuf_iov_copy(const struct iovec *iov, int cnt, int off,
+                                 const uint8_t *data, int len)
+{
+    int i, n;
+
+    for (i = 0; i < cnt && len > 0; i++) {
+        n = iov[i].iov_len;
+        if (off >= n) {
+            off -= n;
+            continue;
+        }
+        n -= off;
+        if (n > len) n = len;
+        memcpy((uint8_t *)iov[i].iov_base + off, data, n);
+        data += n;
+        len -= n;
+        off = 0;
+    }
+}
+
+/* out 为 iov 跳过前 off 字节之后的部分, Return value: out 的个数 */
+static inline int fbuf_iov_skip(const struct iovec *iov, int cnt, int off,
+                                struct iovec *out)
+{
+    int i, n = 0;
+
+    for (i = 0; i < cnt; i++) {
+        if (off >= (int)iov[i].iov_len) {
+            off -= iov[i].iov_len;
+            continue;
+        }
+        out[n].iov_base = (uint8_t *)iov[i].iov_base + off;
+        out[n].iov_len = iov[i].iov_len - off;
+        off = 0;
+        n++;
+    }
+    return n;
+}
+
+static inline void fbuf_chain_reset(fbuffer_t *head)
+{
+    for (; head != NULL; head = head->next) {
+        FBUF_REST(head);
+    }
+}
+
+static inline void fbuf_chain_free(fbuffer_t *head)
+{
+    fbuffer_t *next;
+    for (; head != NULL; head = next) {
+        next = head->next;
+        FBUF_FREE(head);
+    }
+}
+
+#endif
@@ -2,6 +2,18 @@
 #include <stdio.h>
 #include "base/ini.h"
 
+/* 出口地址池，多个地址用逗号或空格分开 */
+static void parse_source_addrs(const char *value)
+{
+    char buf[1024], *addr, *save;
+
+    snprintf(buf, sizeof(buf), "%s", value);
+    for (addr = strtok_r(buf, ", ", &save); addr != NULL;
+         addr = strtok_r(NULL, ", ", &save)) {
+        fnet_source_add(addr);
+    }
+}
+
 static int handler(void* user, const char* section, const char* name,
                    const char* value)
 {
@@ -16,6 +28,48 @@ static int handler(void* user, const char* section, const char* name,
             strcpy(server->port, value);
         } else if (strcmp("connections", name) == 0) {
             server->connections = atoi(value);
+        } else if (strcmp("accept_batch", name) == 0) {
+            server->accept_batch = atoi(value);
+        } else if (strcmp("stats_interval", name) == 0) {
+            server->stats_interval = atoi(value);
+        } else if (strcmp("coalesce_batch", name) == 0) {
+            server->coalesce_batch = atoi(value);
+        } else if (strcmp("coalesce_delay", name) == 0) {
+            server->coalesce_delay = atoi(value);
+        } else if (strcmp("zerocopy_threshold", name) == 0) {
+            server->zerocopy_threshold = atoi(value);
+        } else if (strcmp("resolver_threads", name) == 0) {
+            server->resolver_threads = atoi(value);
+        } else if (strcmp("dns_cache_size", name) == 0) {
+            server->dns_cache_size = atoi(value);
+        } else if (strcmp("dns_ttl", name) == 0) {
+            server->dns_ttl = atoi(value);
+        } else if (strcmp("dns_negative_ttl", name) == 0) {
+            server->dns_negative_ttl = atoi(value);
+        } else if (strcmp("connect_timeout", name) == 0) {
+            server->connect_timeout = atoi(value);
+        } else if (strcmp("happy_eyeballs_delay", name) == 0) {
+            server->happy_eyeballs_delay = atoi(value);
+        } else if (strcmp("fastopen", name) == 0) {
+            server->fastopen = atoi(value);
+        } else if (strcmp("breaker_threshold", name) == 0) {
+            server->breaker_threshold = atoi(value);
+        } else if (strcmp("breaker_backoff", name) == 0) {
+            server->breaker_backoff = atoi(value);
+        } else if (strcmp("breaker_max_backoff", name) == 0) {
+            server->breaker_max_backoff = atoi(value);
+        } else if (strcmp("ticket_lifetime", name) == 0) {
+            server->ticket_lifetime = atoi(value);
+        } else if (strcmp("ticket_secret", name) == 0) {
+            snprintf(server->ticket_secret, sizeof(server->ticket_secret), "%s", value);
+        } else if (strcmp("replay_window", name) == 0) {
+            server->replay_window = atoi(value);
+        } else if (strcmp("replay_cache", name) == 0) {
+            server->replay_cache = atoi(value);
+        } else if (strcmp("udp_timeout", name) == 0) {
+            server->udp_timeout = atoi(value);
+        } else if (strcmp("source_addrs", name) == 0) {
+            parse_source_addrs(value);
         } else {
             return 0;
         }
@@ -64,7 +64,30 @@ static context_t *context_create()
         free(c);
         return NULL;
     }
+    c->addrs = malloc(sizeof(struct fnet_addrlist));
+    c->conn_fds = calloc(FNET_MAX_ADDRS, sizeof(int));
+    if (c->addrs == NULL || c->conn_fds == NULL) {
+        FBUF_FREE(c->req);
+        FBUF_FREE(c->res);
+        free(c->crypto);
+        free(c->addrs);
+        free(c->conn_fds);
+        free(c);
+        return NULL;
+    }
+    c->naddrs = c->addr_idx = c->nconnecting = 0;
+    c->hs_state = 0;
+    c->hs_size = HANDSHAKE_SIZE;
+    c->early_len = 0;
     c->user = NULL;
+    c->timer = c->flush_timer = NULL;
+    c->resolving = NULL;
+    c->zerocopy = 0;
+    c->mux = NULL;
+    c->stream = NULL;
+    c->udp = NULL;
+    c->upstream = 0;
+    c->stripe = NULL;
     c->client_fd = c->remote_fd = 0;
 
     return c;
@@ -101,6 +124,34 @@ context_t *context_pool_get(context_pool_t *pool, int mask)
     return node->c;
 }
 
+/* 等待足够长的时间，保证内核已经不再引用这块内存 */
+#define PINNED_RETIRE_MS (60*1000)
+
+static long pinned_retire_cb(struct event_loop *loop, void *evdata)
+{
+    fbuf_chain_free(evdata);
+    return EV_TIMER_END;
+}
+
+/*
+ * 连接关闭后就收不到 MSG_ZEROCOPY 的完成通知了，但关闭前排队的数据内核
+ * 仍会发送，因此不能把这块 buffer 交给下一个连接，换一块新的，旧的延迟释放
+ */
+static void retire_pinned_buffer(context_t *c)
+{
+    fbuffer_t *fresh;
+
+    FBUF_CREATE(fresh);
+    if (fresh == NULL) {
+        return;
+    }
+    if (create_time_event(c->loop, PINNED_RETIRE_MS, &pinned_retire_cb, c->res) == NULL) {
+        FBUF_FREE(fresh);
+        return;
+    }
+    c->res = fresh;
+}
+
 static inline void delete_and_close_fd(context_t *c, int fd)
 {   
     LOG_FOR_DEBUG("delete event context %p fd %d", (void *)c, fd);
@@ -111,6 +162,21 @@ static inline void delete_and_close_fd(context_t *c, int fd)
     }
 }
 
+/* 关闭所有还在进行的 remote 连接 */
+void context_abort_connect(context_t *c)
+{
+    int i;
+
+    for (i = 0; i < c->naddrs && c->nconnecting > 0; i++) {
+        if (c->conn_fds[i] != 0) {
+            delete_and_close_fd(c, c->conn_fds[i]);
+            c->conn_fds[i] = 0;
+            c->nconnecting--;
+        }
+    }
+    c->nconnecting = 0;
+}
+
 void context_pool_release(context_pool_t *pool, context_t *c, int mask)
 {
     if (pool == NULL || c == NULL || mask == MASK_NONE) return;
@@ -132,8 +198,53 @@ void context_pool_release(context_pool_t *pool, context_t *c, int mask)
 
     node->mask &= (~mask);
     if (node->mask == MASK_NONE) {
-        FBUF_REST(node->c->req);
-        FBUF_REST(node->c->res);
+        if (c->timer != NULL) {
+            delete_time_event(c->loop, c->timer);
+            c->timer = NULL;
+        }
+        if (c->flush_timer != NULL) {
+            delete_time_event(c->loop, c->flush_timer);
+            c->flush_timer = NULL;
+        }
+        if (c->nconnecting > 0) {
+            context_abort_connect(c);
+        }
+        /* 解析结果回来时 context 可能已经给了别的连接 */
+        if (c->resolving != NULL) {
+            fresolver_cancel(c->resolving);
+            c->resolving = NULL;
+        }
+        /* 没有连上 remote，通知隧道上的对端 */
+        if (c->stream != NULL) {
+            fmux_stream_t *s = c->stream;
+            c->stream = NULL;
+            fmux_stream_reset(s);
+        }
+        if (c->mux != NULL) {
+            fmux_destroy(c->mux);
+            c->mux = NULL;
+        }
+        if (c->udp != NULL) {
+            fudp_destroy(c->udp);
+            c->udp = NULL;
+        }
+        /* 主连接离开时释放其它连接 */
+        if (c->stripe != NULL) {
+            fstripe_t *s = c->stripe;
+            c->stripe = NULL;
+            fstripe_leave(s, c);
+        }
+        if (FBUF_PINNED(c->res)) {
+            retire_pinned_buffer(c);
+        }
+        c->zerocopy = 0;
+        c->upstream = 0;
+        c->hs_state = 0;
+        c->hs_size = HANDSHAKE_SIZE;
+        c->early_len = 0;
+        c->user = NULL;
+        fbuf_chain_reset(node->c->req);
+        fbuf_chain_reset(node->c->res);
         node->next = pool->free_context;
         pool->free_context = node;
         pool->free_size++;
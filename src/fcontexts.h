@@ -7,6 +7,18 @@
 #define MASK_CLIENT 1
 #define MASK_REMOTE 2
 
+/* 握手的进度 */
+#define HS_STARTED 1    /* 头部已经解析，开始连接 remote */
+#define HS_READ 2       /* hs_size 的数据都已经读完 */
+#define HS_CONNECTED 4  /* remote 已经连接上 */
+#define HS_RESUMED 8    /* 使用 session ticket，没有回复 */
+#define HS_TICKET 16    /* client 请求 session ticket */
+#define HS_MUX 32       /* 多路复用的隧道 */
+#define HS_SOCKS 64     /* client: 连上 server 之后回复 SOCKS5 */
+#define HS_UDP 128      /* UDP 转发的隧道 */
+#define HS_STRIPE 256   /* 加入 stripe 的连接，没有 remote */
+#define HS_RETRY 512    /* client: early data 被拒绝之后重新做的握手 */
+
 struct context {
     int client_fd;
     int remote_fd;
@@ -21,6 +33,27 @@ struct context {
 
     fuser_t *user;
     fcrypt_ctx_t *crypto;
+
+    time_event *timer; /* 握手或者连接 remote 的超时定时器 */
+    time_event *flush_timer; /* 攒数据的最长等待时间 */
+    struct fresolve_job *resolving; /* 正在解析 remote 的域名 */
+
+    /* 连接 remote 时依次尝试的地址，conn_fds 是每个地址正在进行的连接 */
+    struct fnet_addrlist *addrs;
+    int *conn_fds;
+    int naddrs, addr_idx, nconnecting;
+    unsigned long dest_key; /* 目标在 breaker 中的 key */
+    int hs_state;
+    int hs_size; /* 整个握手数据的长度，v1 固定为 HANDSHAKE_SIZE */
+    int early_len; /* 握手数据最后的 early data 长度 */
+
+    int zerocopy; /* client_fd 是否使用 MSG_ZEROCOPY 发送 */
+
+    fmux_t *mux; /* 这个连接是多路复用的隧道 */
+    fmux_stream_t *stream; /* server: 正在为隧道上的这个 stream 连接 remote */
+    fudp_t *udp; /* 这个连接是 UDP 转发的隧道 */
+    int upstream; /* client: 连接的是第几个 server */
+    fstripe_t *stripe; /* 这个连接属于一个使用多条连接的请求 */
 };
 
 struct context_pool_node {
@@ -52,5 +85,6 @@ void context_pool_destroy(context_pool_t *pool);
 
 context_t *context_pool_get(context_pool_t *pool, int mask);
 void context_pool_release(context_pool_t *pool, context_t *c, int mask);
+void context_abort_connect(context_t *c);
 
 #endif
@@ -76,4 +76,31 @@ static inline int fcrypt_decrypt(fcrypt_ctx_t *ctx, fbuffer_t *buffer)
                      FBUF_DATA_AT(buffer), FBUF_DATA_AT(buffer));
 }
 
+
+/* CFB 是流模式，跨越多块 buffer 时只要按顺序处理，就可以就地加解密 */
+static inline void fcrypt_encrypt_iov(fcrypt_ctx_t *ctx, const struct iovec *iov,
+                                      int cnt, size_t len)
+{
+    int i;
+    for (i = 0; i < cnt && len > 0; i++) {
+        size_t n = (iov[i].iov_len < len) ? iov[i].iov_len : len;
+        aes_crypt_cfb128(&ctx->aes, AES_ENCRYPT, n, &ctx->e_pos, ctx->e_iv,
+                         iov[i].iov_base, iov[i].iov_base);
+        len -= n;
+    }
+}
+
+
+static inline void fcrypt_decrypt_iov(fcrypt_ctx_t *ctx, const struct iovec *iov,
+                                      int cnt, size_t len)
+{
+    int i;
+    for (i = 0; i < cnt && len > 0; i++) {
+        size_t n = (iov[i].iov_len < len) ? iov[i].iov_len : len;
+        aes_crypt_cfb128(&ctx->aes, AES_DECRYPT, n, &ctx->d_pos, ctx->d_iv,
+                         iov[i].iov_base, iov[i].iov_base);
+        len -= n;
+    }
+}
+
 #endif
@@ -1,46 +1,77 @@
 #include "fhandler.h"
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "fakio.h"
 
+#define HANDSHAKE_TIMEOUT (10*1000)
 
 static void client_handshake_cb(struct event_loop *loop, int fd, int mask, void *evdata);
+static void handshake_resolved_cb(fresolve_job_t *job);
+static void handshake_reply(context_t *c);
+static int remote_connect(context_t *c, int naddrs);
+static int remote_connect_next(context_t *c);
+static void remote_connect_failed(context_t *c);
+static long connect_timer_cb(struct event_loop *loop, void *evdata);
+static void remote_connected_cb(struct event_loop *loop, int fd, int mask, void *evdata);
 static void client_readable_cb(struct event_loop *loop, int fd, int mask, void *evdata);
 static void client_writable_cb(struct event_loop *loop, int fd, int mask, void *evdata);
 static void remote_writable_cb(struct event_loop *loop, int fd, int mask, void *evdata);
 static void remote_readable_cb(struct event_loop *loop, int fd, int mask, void *evdata);
+static void mux_stream_open(fmux_t *m, fmux_stream_t *s, const uint8_t *addr, int len);
 
 static long handshake_timeout_cb(struct event_loop *loop, void *evdata)
 {   
     context_t *c = evdata;
 
-    if (context_get_mask(c) == MASK_CLIENT) {
-        fakio_log(LOG_WARNING,"client %d handshake timeout!", c->client_fd);
-        context_pool_release(c->pool, c, MASK_CLIENT);
-    }
+    /* 返回 EV_TIMER_END 后由 event loop 释放定时器 */
+    c->timer = NULL;
+    fakio_log(LOG_WARNING,"client %d handshake timeout!", c->client_fd);
+    context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
     
     return EV_TIMER_END;
 }
 
+/* 预算用完时看一下 accept 队列，队列满说明内核已经在丢弃新连接 */
+static void check_backlog(fserver_t *server, int listen_fd)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (getsockopt(listen_fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+        return;
+    }
+    /* listen socket 的 tcpi_unacked 是当前队列长度，tcpi_sacked 是 backlog */
+    if (info.tcpi_unacked >= info.tcpi_sacked) {
+        server->stats.backlog_full++;
+    }
+}
+
 void server_accept_cb(struct event_loop *loop, int fd, int mask, void *evdata)
 {
-    while (1) {
-        int client_fd = accept(fd, NULL, NULL);
+    fserver_t *server = evdata;
+    int n = 0;
+
+    server->stats.accept_wakeups++;
+
+    while (n < server->accept_batch) {
+        int client_fd = fnet_accept(fd);
         if (client_fd < 0) {
-            if (errno != EWOULDBLOCK) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                server->stats.accept_errors++;
                 fakio_log(LOG_WARNING,"accept() failed: %s", strerror(errno));
-                break;
             }
-            continue;
+            break;
         }
-        set_nonblocking(client_fd);
-        set_socket_option(client_fd);
+        n++;
 
-        fserver_t *server = evdata;
         context_t *c = context_pool_get(server->pool, MASK_CLIENT);
         if (c == NULL) {
+            server->stats.accept_drops++;
             fakio_log(LOG_WARNING,"Client %d Can't get context", client_fd);
             close(client_fd);
-            return;
+            continue;
         }
         c->client_fd = client_fd;
         c->loop = loop;
@@ -48,166 +79,1024 @@ void server_accept_cb(struct event_loop *loop, int fd, int mask, void *evdata)
 
         LOG_FOR_DEBUG("new client %d comming connection", client_fd);
         create_event(loop, client_fd, EV_RDABLE, &client_handshake_cb, c);
-        create_time_event(loop, 10*1000, &handshake_timeout_cb, c);
+        c->timer = create_time_event(loop, HANDSHAKE_TIMEOUT, &handshake_timeout_cb, c);
+    }
+
+    server->stats.accepted += n;
+    if (n > server->stats.accept_max_batch) {
+        server->stats.accept_max_batch = n;
+    }
+    if (n == server->accept_batch) {
+        server->stats.accept_budget_out++;
+        check_backlog(server, fd);
+    }
+}
+
+
+/* 加密部分的开始位置，跳过 IV 和用户名或者 ticket */
+static inline int handshake_body_offset(const uint8_t *buf)
+{
+    if (buf[16] == 0) {
+        return 16 + 1 + 2 + ntohs(*(uint16_t *)(buf + 17));
+    }
+    return 16 + 1 + buf[16];
+}
+
+/*
+ * 出示 session ticket 的握手: NONCE(16) | 0(1) | TLEN(2) | TICKET | 加密部分
+ *
+ * 用户名长度为 0 表示后面是 ticket，加密部分和 v2/v3 相同，但是使用由
+ * ticket 中的 secret 和 NONCE 算出的本次连接的密钥，server 不需要回复。
+ * NONCE 的前 4 字节是 client 的时间，见 freplay.h
+ *
+ * Return value: 1 ticket 有效, 0 数据还不够, -1 出错
+ */
+static int handshake_open_ticket(context_t *c, frequest_t *req)
+{
+    int len = FBUF_DATA_LEN(c->req);
+    uint8_t *buf = FBUF_DATA_AT(c->req);
+
+    if (len < 19) {
+        return 0;
+    }
+    int off = handshake_body_offset(buf);
+    if (off - 19 > FTICKET_MAX_LEN) {
+        fakio_log(LOG_WARNING,"ticket too long: %d", off - 19);
+        return -1;
+    }
+    if (len < off + 2) {
+        return 0;
+    }
+
+    if (c->user == NULL) {
+        uint8_t secret[FTICKET_SECRET_LEN], bytes[48], name[256];
+        int name_len;
+
+        if (c->server->tickets == NULL
+            || fticket_open(c->server->tickets, buf + 19, off - 19, secret, name, &name_len) < 0) {
+            c->server->stats.tickets_rejected++;
+            fakio_log(LOG_WARNING,"client %d invalid ticket", c->client_fd);
+            return -1;
+        }
+        c->user = fuser_find_user(c->server->users, name, name_len);
+        if (c->user == NULL) {
+            c->server->stats.tickets_rejected++;
+            fakio_log(LOG_WARNING,"ticket user Not Found!");
+            return -1;
+        }
+        /* 不等回复的握手可以被录下来重放，NONCE 只能用一次 */
+        if (c->server->replay != NULL && freplay_check(c->server->replay, buf) < 0) {
+            c->server->stats.replays_rejected++;
+            fakio_log(LOG_WARNING,"client %d ticket handshake replayed or clock skewed",
+                      c->client_fd);
+            return -1;
+        }
+        fticket_derive(secret, buf, bytes);
+        fcrypt_ctx_init(c->crypto, bytes);
+        memset(secret, 0, sizeof(secret));
+        memset(bytes, 0, sizeof(bytes));
+        c->hs_state |= HS_RESUMED;
+    }
+
+    memcpy(req->IV, c->crypto->d_iv, 16);
+    memcpy(req->username, c->user->username, c->user->name_len);
+    req->username[c->user->name_len] = '\0';
+    req->name_len = c->user->name_len;
+    req->rlen = off;
+    return 1;
+}
+
+static void stripe_closed_cb(fstripe_t *s)
+{
+    fstripe_unlink(s);
+}
+
+/* 主连接登记它的 GROUP，之后的连接按 GROUP 加入，Return value: -1 出错 */
+static int stripe_create(context_t *c, const uint8_t *id)
+{
+    if (fstripe_lookup(id) != NULL) {
+        fakio_log(LOG_WARNING,"client %d duplicate stripe", c->client_fd);
+        return -1;
+    }
+    c->stripe = fstripe_create(c, FSTRIPE_SERVER, id, NULL, &stripe_closed_cb, NULL);
+    if (c->stripe == NULL) {
+        return -1;
+    }
+    fstripe_link(c->stripe);
+    return 0;
+}
+
+/*
+ * 只能加入同一个用户的、remote 还没有关闭的 stripe，请求已经结束时 client
+ * 还在建立的连接会被拒绝，client 只是少用一条连接
+ */
+static int stripe_join(context_t *c, const uint8_t *id)
+{
+    fstripe_t *s = fstripe_lookup(id);
+
+    if (s == NULL || s->c->user != c->user || fstripe_join(s, c) < 0) {
+        LOG_FOR_DEBUG("client %d can't join stripe", c->client_fd);
+        return -1;
+    }
+    c->stripe = s;
+    return 0;
+}
+
+/*
+ * 握手数据: IV(16) | name_len(1) | name | 加密部分
+ *
+ * v1 的加密部分是 VER(5) | ATYP | addr | port | 填充，总长固定为
+ * HANDSHAKE_SIZE；v2 是 VER(2) | ATYP | addr | port | PLEN | PLEN 字节的
+ * 填充，一般只有几十字节；v3 在 PLEN 后面多了 ELEN(2)，填充后面是 ELEN
+ * 字节的 early data。版本用解密出来的第一个字节区分。头部到齐就开始认证、
+ * 解析 DNS 和连接 remote，剩下的数据继续在后台读取，两边都完成后才回复
+ * client
+ *
+ * Return value: 1 头部完整, 0 数据还不够, -1 出错
+ */
+static int handshake_parse(context_t *c, frequest_t *req)
+{
+    int r, len = FBUF_DATA_LEN(c->req);
+    uint8_t *buf = FBUF_DATA_AT(c->req);
+    uint8_t plain[2+1+255+2+1+2+FSTRIPE_ID_LEN];
+
+    if (len < 17) {
+        return 0;
+    }
+
+    if (buf[16] == 0) {
+        r = handshake_open_ticket(c, req);
+        if (r <= 0) {
+            return r;
+        }
+    } else {
+        if (len < 17 + buf[16] + 2) {
+            return 0;
+        }
+
+        // 用户认证
+        fakio_request_resolve(buf, len, req, FNET_RESOLVE_USER);
+        if (c->user == NULL) {
+            c->user = fuser_find_user(c->server->users, req->username, req->name_len);
+            if (c->user == NULL) {
+                fakio_log(LOG_WARNING,"user: %s Not Found!", req->username);
+                return -1;
+            }
+            fcrypt_set_key(c->crypto, c->user->key, 256);
+        }
+    }
+
+    /* 头部很短，每次都从头解密到临时缓冲区，req 中的数据不变 */
+    int n = len - req->rlen;
+    if (n > (int)sizeof(plain)) {
+        n = sizeof(plain);
+    }
+    uint8_t iv[16];
+    memcpy(iv, req->IV, 16);
+    fcrypt_decrypt_all(c->crypto, iv, n, buf + req->rlen, plain);
+
+    /* 完整握手时才能在回复中附带 ticket */
+    if (plain[0] & FAKIO_HS_TICKET_REQ) {
+        if (!(c->hs_state & HS_RESUMED)) {
+            c->hs_state |= HS_TICKET;
+        }
+        plain[0] &= ~FAKIO_HS_TICKET_REQ;
+    }
+
+    /* 多路复用或者 UDP 转发的隧道: VER | PLEN | 填充，没有目标地址 */
+    if (plain[0] == FAKIO_HS_MUX || plain[0] == FAKIO_HS_UDP) {
+        if (n < 2) {
+            return 0;
+        }
+        if (plain[0] == FAKIO_HS_UDP && c->server->udp_timeout < 0) {
+            fakio_log(LOG_WARNING,"client %d udp relay disabled", c->client_fd);
+            return -1;
+        }
+        c->hs_size = req->rlen + 2 + plain[1];
+        c->hs_state |= (plain[0] == FAKIO_HS_MUX) ? HS_MUX : HS_UDP;
+        return 1;
+    }
+
+    /* 加入 stripe 的连接: VER | PLEN | GROUP | 填充，没有目标地址 */
+    if (plain[0] == FAKIO_HS_STRIPE_JOIN) {
+        if (n < 2 + FSTRIPE_ID_LEN) {
+            return 0;
+        }
+        if (stripe_join(c, plain + 2) < 0) {
+            return -1;
+        }
+        c->hs_size = req->rlen + 2 + FSTRIPE_ID_LEN + plain[1];
+        c->hs_state |= HS_STRIPE;
+        return 1;
+    }
+
+    int need;
+    switch (plain[1]) {
+    case SOCKS_ATYPE_IPV4:
+        need = 2 + 4 + 2;
+        break;
+    case SOCKS_ATYPE_IPV6:
+        need = 2 + 16 + 2;
+        break;
+    case SOCKS_ATYPE_DNAME:
+        if (n < 3) return 0;
+        need = 2 + 1 + plain[2] + 2;
+        break;
+    default:
+        need = 0;
         break;
     }
+    /* 地址后面还有填充长度，v3 还有 early data 的长度，stripe 还有 GROUP */
+    if (plain[0] == FAKIO_HS_V2) {
+        need += 1;
+    } else if (plain[0] == FAKIO_HS_V3) {
+        need += 1 + 2;
+    } else if (plain[0] == FAKIO_HS_STRIPE) {
+        need += 1 + FSTRIPE_ID_LEN;
+    }
+    if (n < need) {
+        return 0;
+    }
+
+    int ulen = req->rlen;
+    if (fakio_request_resolve(plain, n, req, FNET_RESOLVE_NET) != 1) {
+        fakio_log(LOG_WARNING,"socks5 request resolve error");
+        return -1;
+    }
+    uint8_t *p = plain + req->rlen - ulen;
+    if (plain[0] == FAKIO_HS_V2) {
+        c->hs_size = req->rlen + 1 + p[0];
+    } else if (plain[0] == FAKIO_HS_V3) {
+        c->early_len = ntohs(*(uint16_t *)(p + 1));
+        if (c->early_len > FAKIO_EARLY_DATA_MAX) {
+            fakio_log(LOG_WARNING,"early data too long: %d", c->early_len);
+            return -1;
+        }
+        /* early data 会在重放时再次发给 remote，IV 只能用一次，ticket 握手已经检查过 */
+        if (!(c->hs_state & HS_RESUMED) && c->server->replay != NULL
+            && freplay_check(c->server->replay, buf) < 0) {
+            c->server->stats.replays_rejected++;
+            fakio_log(LOG_WARNING,"client %d early data replayed or clock skewed",
+                      c->client_fd);
+            return -1;
+        }
+        c->hs_size = req->rlen + 1 + 2 + p[0] + c->early_len;
+    } else if (plain[0] == FAKIO_HS_STRIPE) {
+        if (stripe_create(c, p + 1) < 0) {
+            return -1;
+        }
+        c->hs_size = req->rlen + 1 + FSTRIPE_ID_LEN + p[0];
+    }
+    return 1;
 }
 
+/*
+ * 头部已经解析出来，开始解析 DNS 和连接 remote
+ *
+ * Return value: 0 正在进行, -1 失败并且 context 已经释放
+ */
+static int handshake_start(context_t *c, frequest_t *req)
+{
+    int r;
+
+    c->hs_state |= HS_STARTED;
+
+    /* 目标最近一直连不上，直接拒绝，不占用 DNS 和连接的资源 */
+    c->dest_key = fbreaker_key(req->addr, req->port);
+    if (!fbreaker_allow(c->server->breaker, c->dest_key)) {
+        c->server->stats.breaker_rejects++;
+        LOG_FOR_DEBUG("%s:%s rejected by breaker", req->addr, req->port);
+        context_pool_release(c->pool, c, MASK_CLIENT);
+        return -1;
+    }
+
+    /* IP 地址不需要解析，直接连接 */
+    struct addrinfo *result;
+    if (fnet_resolve_numeric(req->addr, req->port, &result) == 0) {
+        r = fnet_addrlist_copy(c->addrs, result);
+        freeaddrinfo(result);
+        return remote_connect(c, r);
+    }
+
+    /* 先查 DNS 缓存 */
+    r = fnet_dns_cache_get(req->addr, req->port, c->addrs);
+    if (r == FNET_DNS_NEGATIVE) {
+        c->server->stats.dns_negative_hits++;
+        fakio_log(LOG_WARNING,"%s:%s resolve failed (cached)", req->addr, req->port);
+        context_pool_release(c->pool, c, MASK_CLIENT);
+        return -1;
+    }
+    if (r > 0) {
+        c->server->stats.dns_cache_hits++;
+        return remote_connect(c, r);
+    }
+
+    /* 
+     * 域名交给 resolver 线程，握手超时仍然有效，超时后 context
+     * 释放时会取消解析
+     */
+    c->resolving = fresolver_submit(c->server->resolver, req->addr, req->port,
+                                    &handshake_resolved_cb, c);
+    if (c->resolving == NULL) {
+        fakio_log(LOG_WARNING,"%s:%s can't submit to resolver", req->addr, req->port);
+        context_pool_release(c->pool, c, MASK_CLIENT);
+        return -1;
+    }
+    c->server->stats.dns_lookups++;
+    return 0;
+}
 
 static void client_handshake_cb(struct event_loop *loop, int fd, int mask, void *evdata)
 {
-    int r, need, client_fd = fd;
+    int need, client_fd = fd;
     context_t *c = evdata;
 
-    while (1) {
-        need = HANDSHAKE_SIZE - FBUF_DATA_LEN(c->req);
+    while (FBUF_DATA_LEN(c->req) < c->hs_size) {
+        need = c->hs_size - FBUF_DATA_LEN(c->req);
         int rc = recv(client_fd, FBUF_WRITE_AT(c->req), need, 0);
 
         if (rc < 0) {
             if (errno == EAGAIN) {
-                return;    
+                break;
             }
-            context_pool_release(c->pool, c, MASK_CLIENT);
+            context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
             return;
         }
         if (rc == 0) {
             LOG_FOR_DEBUG("client %d connection closed", client_fd);
-            context_pool_release(c->pool, c, MASK_CLIENT);
+            context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
             return;
         }
+        FBUF_COMMIT_WRITE(c->req, rc);
+    }
 
-        if (rc > 0) {
-            FBUF_COMMIT_WRITE(c->req, rc);
-            if (FBUF_DATA_LEN(c->req) < HANDSHAKE_SIZE) {
-                continue;
+    if (!(c->hs_state & HS_STARTED)) {
+        frequest_t req;
+        int r = handshake_parse(c, &req);
+        if (r < 0) {
+            context_pool_release(c->pool, c, MASK_CLIENT);
+            return;
+        }
+        if (r == 0) {
+            if (FBUF_DATA_LEN(c->req) == HANDSHAKE_SIZE) {
+                fakio_log(LOG_WARNING,"client %d bad handshake", client_fd);
+                context_pool_release(c->pool, c, MASK_CLIENT);
             }
-            break;
+            return;
+        }
+        /*
+         * 版本还不知道时按 v1 读取，v2 的 client 在回复之前不会多发数据；
+         * 使用 ticket 的 client 不等回复，多出来的是后面的数据，一起解密转发
+         */
+        if (FBUF_DATA_LEN(c->req) > c->hs_size && !(c->hs_state & HS_RESUMED)) {
+            fakio_log(LOG_WARNING,"client %d bad handshake", client_fd);
+            context_pool_release(c->pool, c, MASK_CLIENT);
+            return;
+        }
+        if (c->hs_state & (HS_MUX|HS_UDP|HS_STRIPE)) {
+            c->hs_state |= HS_STARTED|HS_CONNECTED;
+        } else if (handshake_start(c, &req) < 0) {
+            return;
         }
     }
 
-    // 用户认证
-    frequest_t req;
-    fakio_request_resolve(FBUF_DATA_AT(c->req), HANDSHAKE_SIZE,
-                          &req, FNET_RESOLVE_USER);
+    if (FBUF_DATA_LEN(c->req) < c->hs_size) {
+        return;
+    }
 
-    c->user = fuser_find_user(c->server->users, req.username, req.name_len);
-    if (c->user == NULL) {
-        fakio_log(LOG_WARNING,"user: %s Not Found!", req.username);
+    /* 握手数据已经读完，回复之前不再读 client */
+    c->hs_state |= HS_READ;
+    delete_event(loop, client_fd, EV_RDABLE);
+    if (c->hs_state & HS_CONNECTED) {
+        handshake_reply(c);
+    }
+}
+
+static void handshake_resolved_cb(fresolve_job_t *job)
+{
+    context_t *c = job->data;
+
+    c->resolving = NULL;
+    fnet_dns_cache_put(job->host, job->result, job->err);
+    if (job->err != 0) {
+        c->server->stats.dns_failed++;
+        fakio_log(LOG_WARNING, "%s:%s getaddrinfo: %s",
+                  job->host, job->port, gai_strerror(job->err));
         context_pool_release(c->pool, c, MASK_CLIENT);
         return;
     }
-    
-    fcrypt_set_key(c->crypto, c->user->key, 256);
+    remote_connect(c, fnet_addrlist_copy(c->addrs, job->result));
+}
 
-    uint8_t buffer[HANDSHAKE_SIZE];
-    
-    fcrypt_decrypt_all(c->crypto, req.IV, HANDSHAKE_SIZE-req.rlen,
-                       FBUF_DATA_SEEK(c->req, req.rlen), buffer+req.rlen);
+/*
+ * 连接 remote (RFC 8305 Happy Eyeballs): 地址按 IPv6/IPv4 交替排列，依次
+ * 发起非阻塞 connect，前一个在 happy_eyeballs_delay 毫秒内没有连上就同时
+ * 开始下一个，某个连接失败时立即开始下一个。最先连上(SO_ERROR 为 0)的
+ * 留下，其余的关闭。最后一个地址开始后 connect_timeout 毫秒内都没有连上
+ * 则关闭 client
+ */
+static int remote_connect(context_t *c, int naddrs)
+{
+    c->naddrs = fnet_addrlist_interleave(c->addrs, naddrs);
+    c->addr_idx = 0;
+    c->nconnecting = 0;
+    return remote_connect_next(c);
+}
 
-    r = fakio_request_resolve(buffer+req.rlen, HANDSHAKE_SIZE-req.rlen,
-                              &req, FNET_RESOLVE_NET);
-    if (r != 1) {
-        fakio_log(LOG_WARNING,"socks5 request resolve error");
+static void arm_connect_timer(context_t *c)
+{
+    long ms = c->server->connect_timeout;
+
+    if (c->addr_idx < c->naddrs && c->server->happy_eyeballs_delay < ms) {
+        ms = c->server->happy_eyeballs_delay;
+    }
+    if (c->timer != NULL) {
+        delete_time_event(c->loop, c->timer);
+    }
+    c->timer = create_time_event(c->loop, ms, &connect_timer_cb, c);
+}
+
+/* Return value: 0 正在连接, -1 全部失败并且 context 已经释放 */
+static int remote_connect_next(context_t *c)
+{
+    char buf[64];
+    struct addrinfo *ai;
+
+    while (c->addr_idx < c->naddrs) {
+        int i = c->addr_idx++;
+        ai = &c->addrs->ai[i];
+
+        int fd = fnet_connect_addr(ai->ai_addr, ai->ai_addrlen);
+        if (fd < 0) {
+            fakio_log(LOG_WARNING, "connect %s - %s",
+                      fnet_addr_str(&c->addrs->addrs[i], buf, sizeof(buf)),
+                      strerror(errno));
+            continue;
+        }
+        if (create_event(c->loop, fd, EV_WRABLE, &remote_connected_cb, c) < 0) {
+            close(fd);
+            continue;
+        }
+        c->conn_fds[i] = fd;
+        c->nconnecting++;
+        if (i > 0) {
+            c->server->stats.connect_fallbacks++;
+        }
+        arm_connect_timer(c);
+        return 0;
+    }
+
+    /* 没有可以尝试的地址了，等待正在进行的连接 */
+    if (c->nconnecting > 0) {
+        arm_connect_timer(c);
+        return 0;
+    }
+    remote_connect_failed(c);
+    return -1;
+}
+
+/* 所有地址都没有连上 */
+static void remote_connect_failed(context_t *c)
+{
+    c->server->stats.connect_failed++;
+    if (fbreaker_failure(c->server->breaker, c->dest_key)) {
+        c->server->stats.breaker_trips++;
+    }
+    context_pool_release(c->pool, c, MASK_CLIENT);
+}
+
+static long connect_timer_cb(struct event_loop *loop, void *evdata)
+{
+    context_t *c = evdata;
+
+    c->timer = NULL;
+
+    /* 当前的连接还没有结果，同时开始下一个 */
+    if (c->addr_idx < c->naddrs) {
+        remote_connect_next(c);
+        return EV_TIMER_END;
+    }
+
+    c->server->stats.connect_timeouts++;
+    fakio_log(LOG_WARNING, "client %d connect remote timeout", c->client_fd);
+    remote_connect_failed(c);
+
+    return EV_TIMER_END;
+}
+
+static void remote_connected_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    context_t *c = evdata;
+    char buf[64];
+    int i;
+
+    for (i = 0; i < c->naddrs && c->conn_fds[i] != fd; i++);
+    if (i == c->naddrs) {
+        return;
+    }
+
+    delete_event(loop, fd, EV_WRABLE);
+    c->conn_fds[i] = 0;
+    c->nconnecting--;
+
+    int err = fnet_connect_result(fd);
+    if (err != 0) {
+        fakio_log(LOG_WARNING, "connect %s - %s",
+                  fnet_addr_str(&c->addrs->addrs[i], buf, sizeof(buf)),
+                  strerror(err));
+        close(fd);
+        if (c->addr_idx < c->naddrs || c->nconnecting == 0) {
+            remote_connect_next(c);
+        }
+        return;
+    }
+
+    /* 最先连上的留下，其余的关闭 */
+    context_abort_connect(c);
+    fbreaker_success(c->server->breaker, c->dest_key);
+    if (c->timer != NULL) {
+        delete_time_event(loop, c->timer);
+        c->timer = NULL;
+    }
+    if (c->addrs->addrs[i].sa.sa_family == AF_INET6) {
+        c->server->stats.connect_v6++;
+    } else {
+        c->server->stats.connect_v4++;
+    }
+
+    /* 隧道上的 stream，fd 交给 stream，context 就用完了 */
+    if (c->stream != NULL) {
+        fmux_stream_t *s = c->stream;
+        c->stream = NULL;
+        set_socket_option(fd);
+        context_pool_release(c->pool, c, MASK_CLIENT);
+        fmux_stream_connected(s, fd);
+        return;
+    }
+
+    c->remote_fd = fd;
+    context_set_mask(c, MASK_CLIENT|MASK_REMOTE);
+    c->hs_state |= HS_CONNECTED;
+
+    /* 填充数据还没有读完，继续等待，超时仍然有效 */
+    if (!(c->hs_state & HS_READ)) {
+        c->timer = create_time_event(loop, HANDSHAKE_TIMEOUT, &handshake_timeout_cb, c);
+        return;
+    }
+    handshake_reply(c);
+}
+
+/*
+ * 请求 ticket 时回复后面附加: LIFETIME(4) | SECRET(32) | TLEN(2) | TICKET，
+ * 继续使用握手的 key 和 IV 加密。不签发 ticket 时 TLEN 为 0
+ */
+static void handshake_ticket(context_t *c, uint8_t iv[16])
+{
+    uint8_t ext[4+FTICKET_SECRET_LEN+2+FTICKET_MAX_LEN];
+    int tlen = 0;
+
+    memset(ext, 0, 4+FTICKET_SECRET_LEN+2);
+    if (c->server->tickets != NULL) {
+        random_bytes(c->server->r, ext+4, FTICKET_SECRET_LEN);
+        tlen = fticket_issue(c->server->tickets, c->server->r, c->user,
+                             ext+4, ext+4+FTICKET_SECRET_LEN+2);
+        if (tlen > 0) {
+            *(uint32_t *)ext = htonl(c->server->ticket_lifetime);
+            c->server->stats.tickets_issued++;
+        } else {
+            memset(ext+4, 0, FTICKET_SECRET_LEN);
+            tlen = 0;
+        }
+    }
+    *(uint16_t *)(ext+4+FTICKET_SECRET_LEN) = htons(tlen);
+
+    int len = 4 + FTICKET_SECRET_LEN + 2 + tlen;
+    fcrypt_encrypt_all(c->crypto, iv, len, ext, FBUF_WRITE_AT(c->res));
+    FBUF_COMMIT_WRITE(c->res, len);
+    memset(ext, 0, 4+FTICKET_SECRET_LEN);
+}
+
+/*
+ * 多路复用的隧道没有 remote，回复之后 client_fd 交给 fmux，context 一直
+ * 持有它直到隧道关闭。使用 ticket 时和握手一起收到的帧已经解密，留在
+ * req 中
+ */
+static void handshake_mux(context_t *c)
+{
+    if (c->timer != NULL) {
+        delete_time_event(c->loop, c->timer);
+        c->timer = NULL;
+    }
+    if (c->hs_state & HS_RESUMED) {
+        c->server->stats.tickets_resumed++;
+    }
+
+    c->mux = fmux_create(c, c->client_fd, &mux_stream_open, NULL, NULL);
+    if (c->mux == NULL
+        || fmux_write_raw(c->mux, FBUF_DATA_AT(c->res), FBUF_DATA_LEN(c->res)) < 0) {
+        context_pool_release(c->pool, c, MASK_CLIENT);
+        return;
+    }
+    c->server->stats.mux_sessions++;
+    fbuf_chain_reset(c->res);
+    if (fmux_start(c->mux, FBUF_DATA_AT(c->req), FBUF_DATA_LEN(c->req)) == 0) {
+        fbuf_chain_reset(c->req);
+    }
+}
+
+/*
+ * 隧道上新的 stream，和普通的握手一样经过 breaker、DNS 缓存和 Happy Eyeballs
+ * 连接 remote。使用一个没有 client_fd 的 context，连上之后 fd 交给 stream，
+ * 失败时 context 释放的同时通知对端
+ */
+static void mux_stream_open(fmux_t *m, fmux_stream_t *s, const uint8_t *addr, int len)
+{
+    fserver_t *server = m->c->server;
+    uint8_t buf[1+1+MAX_ADDR_LEN+2];
+    frequest_t req;
+
+    /* 地址部分和握手相同，补上版本号 */
+    buf[0] = SOCKS_VER;
+    memcpy(buf+1, addr, len);
+    memcpy(req.username, m->c->user->username, m->c->user->name_len);
+    req.username[m->c->user->name_len] = '\0';
+    req.rlen = 0;
+    if (fakio_request_resolve(buf, len+1, &req, FNET_RESOLVE_NET) != 1) {
+        fmux_stream_reset(s);
+        return;
+    }
+
+    context_t *c = context_pool_get(server->pool, MASK_CLIENT);
+    if (c == NULL) {
+        server->stats.accept_drops++;
+        fakio_log(LOG_WARNING,"mux %d Can't get context", m->fd);
+        fmux_stream_reset(s);
+        return;
+    }
+    c->loop = m->loop;
+    c->server = server;
+    c->user = m->c->user;
+    c->stream = s;
+    s->data = c;
+    server->stats.mux_streams++;
+
+    c->timer = create_time_event(c->loop, HANDSHAKE_TIMEOUT, &handshake_timeout_cb, c);
+    handshake_start(c, &req);
+}
+
+static void udp_resolved_cb(fresolve_job_t *job)
+{
+    context_t *c = job->data;
+
+    c->resolving = NULL;
+    fnet_dns_cache_put(job->host, job->result, job->err);
+    if (job->err != 0) {
+        c->server->stats.dns_failed++;
+        fakio_log(LOG_WARNING, "%s:%s getaddrinfo: %s",
+                  job->host, job->port, gai_strerror(job->err));
+    }
+}
+
+/*
+ * 数据报的目标是域名时只查 DNS 缓存，没有命中就交给 resolver 并丢掉这个
+ * 数据报，结果放进缓存之后，发往这个域名的数据报就可以转发了。同一个
+ * 关联同时只解析一个域名
+ */
+static int udp_resolve(fudp_t *u, const char *host, const char *port,
+                       union fnet_addr *addr)
+{
+    context_t *c = u->c;
+    struct fnet_addrlist list;
+
+    int r = fnet_dns_cache_get(host, port, &list);
+    if (r > 0) {
+        c->server->stats.dns_cache_hits++;
+        memcpy(addr, list.ai[0].ai_addr, list.ai[0].ai_addrlen);
+        return 0;
+    }
+    if (r == FNET_DNS_NEGATIVE) {
+        c->server->stats.dns_negative_hits++;
+        return -1;
+    }
+    if (c->resolving == NULL) {
+        c->resolving = fresolver_submit(c->server->resolver, host, port,
+                                        &udp_resolved_cb, c);
+        if (c->resolving != NULL) {
+            c->server->stats.dns_lookups++;
+        }
+    }
+    return -1;
+}
+
+/*
+ * UDP 转发的隧道和多路复用的隧道一样没有 remote，回复之后 client_fd 交给
+ * fudp，每个关联使用一个同时收发 IPv4 和 IPv6 的 UDP socket
+ */
+static void handshake_udp(context_t *c)
+{
+    if (c->timer != NULL) {
+        delete_time_event(c->loop, c->timer);
+        c->timer = NULL;
+    }
+    if (c->hs_state & HS_RESUMED) {
+        c->server->stats.tickets_resumed++;
+    }
+
+    int udp_fd = fnet_create_udp(NULL);
+    if (udp_fd < 0) {
+        context_pool_release(c->pool, c, MASK_CLIENT);
+        return;
+    }
+    c->udp = fudp_create(c, c->client_fd, udp_fd, FUDP_SERVER,
+                         c->server->udp_timeout * 1000, &udp_resolve, NULL, NULL);
+    if (c->udp == NULL) {
+        close(udp_fd);
         context_pool_release(c->pool, c, MASK_CLIENT);
         return;
     }
-    int remote_fd = fnet_create_and_connect(req.addr, req.port, FNET_CONNECT_NONBLOCK);
-    if (remote_fd < 0) {
+    c->udp->stats = &c->server->stats.udp;
+    if (fudp_write_raw(c->udp, FBUF_DATA_AT(c->res), FBUF_DATA_LEN(c->res)) < 0) {
         context_pool_release(c->pool, c, MASK_CLIENT);
         return;
     }
+    c->server->stats.udp_sessions++;
+    fbuf_chain_reset(c->res);
+    if (fudp_start(c->udp, FBUF_DATA_AT(c->req), FBUF_DATA_LEN(c->req)) == 0) {
+        fbuf_chain_reset(c->req);
+    }
+}
+
+/*
+ * 加入 stripe 的连接也没有 remote，client 在它上面不再发送数据，回复之后
+ * client_fd 交给 fstripe，用来发送分到这条连接上的帧
+ */
+static void handshake_stripe(context_t *c)
+{
+    if (c->timer != NULL) {
+        delete_time_event(c->loop, c->timer);
+        c->timer = NULL;
+    }
+    if (c->hs_state & HS_RESUMED) {
+        c->server->stats.tickets_resumed++;
+    }
+    c->server->stats.stripe_joins++;
+    fbuf_chain_reset(c->req);
+    fstripe_start(c->stripe, c);
+}
+
+/* remote 已经连接上，回复 client，握手完成 */
+static void handshake_reply(context_t *c)
+{
+    int r, client_fd = c->client_fd, remote_fd = c->remote_fd;
+    struct event_loop *loop = c->loop;
 
-    if (set_socket_option(remote_fd) < 0) {
+    if (!(c->hs_state & (HS_MUX|HS_UDP|HS_STRIPE)) && set_socket_option(remote_fd) < 0) {
         fakio_log(LOG_WARNING,"set socket option error");
     }
     
     LOG_FOR_DEBUG("client %d remote %d at %p", client_fd, remote_fd, c);
     
-    c->remote_fd = remote_fd;
-    context_set_mask(c, MASK_CLIENT|MASK_REMOTE);
-    FBUF_REST(c->req);
-    FBUF_REST(c->res);
+    /*
+     * early data 在握手数据的最后，和头部一起解密后留在 req 中，先于
+     * client 后面的数据发给 remote。使用 ticket 时加密部分用的是本次连接
+     * 的密钥，没有 early data 也要解密一遍，使 crypto 的状态跟上 client
+     */
+    uint8_t *buf = FBUF_DATA_AT(c->req);
+    int off = handshake_body_offset(buf);
+    if (c->hs_state & HS_RESUMED) {
+        FBUF_COMMIT_READ(c->req, off);
+        fcrypt_decrypt(c->crypto, c->req);
+        FBUF_COMMIT_READ(c->req, c->hs_size - off - c->early_len);
+    } else if (c->early_len > 0) {
+        uint8_t iv[16];
+        memcpy(iv, buf, 16);
+        fcrypt_decrypt_all(c->crypto, iv, c->hs_size - off, buf + off, buf + off);
+        FBUF_COMMIT_READ(c->req, c->hs_size - c->early_len);
+    } else {
+        fbuf_chain_reset(c->req);
+    }
+    fbuf_chain_reset(c->res);
 
-    random_bytes(c->server->r, buffer, 64);
+    if (!(c->hs_state & HS_RESUMED)) {
+        /* 回复: IV | 加密后的 EIV,DIV,KEY，直接生成在 res 中 */
+        uint8_t bytes[64], iv[16];
+        random_bytes(c->server->r, bytes, 64);
+        memcpy(iv, bytes, 16);
+        memcpy(FBUF_WRITE_AT(c->res), bytes, 16);
+        fcrypt_encrypt_all(c->crypto, iv, 48, bytes+16, FBUF_WRITE_AT(c->res)+16);
+        FBUF_COMMIT_WRITE(c->res, 64);
 
-    uint8_t bytes[64];
-    memcpy(bytes, buffer, 64);
-    fcrypt_encrypt_all(c->crypto, bytes, 48, buffer+16, buffer+16);
+        if (c->hs_state & HS_TICKET) {
+            handshake_ticket(c, iv);
+        }
 
-    //TODO:
-    send(client_fd, buffer, 64, 0);
+        fcrypt_ctx_init(c->crypto, bytes+16);
+        memset(bytes, 0, sizeof(bytes));
+    }
 
-    fcrypt_ctx_init(c->crypto, bytes+16);
+    c->server->stats.handshakes++;
+    if (c->hs_state & HS_MUX) {
+        handshake_mux(c);
+        return;
+    }
+    if (c->hs_state & HS_UDP) {
+        handshake_udp(c);
+        return;
+    }
+    if (c->hs_state & HS_STRIPE) {
+        handshake_stripe(c);
+        return;
+    }
+
+    /* stripe 的 res 中是一个个帧，不使用 MSG_ZEROCOPY */
+    if (c->server->zerocopy_threshold > 0 && c->stripe == NULL) {
+        c->zerocopy = (fnet_zerocopy_enable(client_fd) == 0);
+    }
+
+    if (c->early_len > 0) {
+        c->server->stats.early_data++;
+        c->server->stats.early_bytes += c->early_len;
+    }
+    /* 使用 ticket 时和握手一起读到的后续数据也已经解密，同样先发出去 */
+    if (FBUF_DATA_LEN(c->req) > 0) {
+        r = fnet_send_chain(remote_fd, &c->req, 0);
+        if (r < 0) {
+            LOG_FOR_DEBUG("send() to remote %d failed: %s", remote_fd, strerror(errno));
+            context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+            return;
+        }
+        if (r == 0) {
+            create_event(loop, remote_fd, EV_WRABLE, &remote_writable_cb, c);
+        }
+    }
 
-    delete_event(loop, client_fd, EV_RDABLE);
     create_event(loop, client_fd, EV_RDABLE, &client_readable_cb, c);
 
-    memset(buffer, 0, HANDSHAKE_SIZE);
-    return;
+    /* 上传和普通的请求一样，remote 的数据和回复由 fstripe 发送 */
+    if (c->stripe != NULL) {
+        if (c->hs_state & HS_RESUMED) {
+            c->server->stats.tickets_resumed++;
+        }
+        c->server->stats.stripe_sessions++;
+        fstripe_start(c->stripe, c);
+        return;
+    }
+
+    if (c->hs_state & HS_RESUMED) {
+        c->server->stats.tickets_resumed++;
+        create_event(loop, remote_fd, EV_RDABLE, &remote_readable_cb, c);
+        return;
+    }
+
+    r = fnet_send_chain(client_fd, &c->res, 0);
+    if (r < 0) {
+        context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+    } else if (r == 0) {
+        create_event(loop, client_fd, EV_WRABLE, &client_writable_cb, c);
+    } else {
+        create_event(loop, remote_fd, EV_RDABLE, &remote_readable_cb, c);
+    }
 }
 
 
+/*
+ * 两个方向的数据流相互独立:
+ *
+ *     client --> req chain(解密) --> remote
+ *     remote --> res chain(加密) --> client
+ *
+ * 读到数据后直接发送，发不完的部分留在 chain 中并等待可写，在此期间只要
+ * chain 还有空间就继续读，新数据和剩下的数据在下一次 writev 时一起发出，
+ * chain 满了才暂停读取
+ */
+
+/* 不小于阈值的数据块使用 MSG_ZEROCOPY 发送 */
+static inline int zerocopy_flags(context_t *c)
+{
+    if (c->zerocopy && fbuf_chain_len(c->res) >= c->server->zerocopy_threshold) {
+        c->server->stats.zerocopy_sends++;
+        return MSG_ZEROCOPY;
+    }
+    return 0;
+}
+
+/* res 被内核引用(MSG_ZEROCOPY)或者已满时不能再读取 remote 的数据 */
+static inline int res_writable(context_t *c)
+{
+    return !FBUF_PINNED(c->res) && fbuf_chain_space(c->res) > 0;
+}
+
+/*
+ * 读取 client_fd 上 MSG_ZEROCOPY 的完成通知(通过 EPOLLERR 触发)，res 在内核
+ * 释放之前不能写入，释放之后才继续读取 remote 的数据
+ */
+static void zerocopy_reap(context_t *c)
+{
+    int copied = 0;
+
+    if (!FBUF_PINNED(c->res)) return;
+    if (fnet_zerocopy_reap(c->client_fd, c->res, &copied) < 0) return;
+
+    if (copied && c->zerocopy) {
+        /* 内核做了复制(比如 loopback)，这个连接后面就不用 MSG_ZEROCOPY 了 */
+        c->zerocopy = 0;
+        c->server->stats.zerocopy_copied++;
+    }
+    if (c->remote_fd != 0 && res_writable(c)) {
+        arm_event(c->loop, c->remote_fd, EV_RDABLE, &remote_readable_cb, c);
+    }
+}
+
 static void client_readable_cb(struct event_loop *loop, int fd, int mask, void *evdata)
 {
     context_t *c = evdata;
+    struct iovec iov[FBUF_CHAIN_MAX];
+    int iovcnt;
 
-    while (1) {
-        int rc = recv(fd, FBUF_WRITE_AT(c->req), BUFSIZE, 0);
+    zerocopy_reap(c);
 
-        if (rc < 0) {
-            if (errno == EAGAIN) {
-                return;
-            }
-            LOG_FOR_DEBUG("recv() from client %d failed: %s", fd, strerror(errno));
-            context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+    /* remote 已经关闭，只等 res 中剩下的数据发完 */
+    if (c->remote_fd == 0) {
+        delete_event(loop, fd, EV_RDABLE);
+        return;
+    }
+
+    int pending = fbuf_chain_len(c->req) > 0;
+    int rc = fnet_recv_chain(fd, c->req, FBUF_CHAIN_SIZE, iov, &iovcnt);
+    if (rc < 0) {
+        if (errno == EAGAIN) {
             return;
         }
-        if (rc == 0) {
-            LOG_FOR_DEBUG("client %d connection closed", fd);
-            context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+        if (errno == ENOBUFS) {
+            delete_event(loop, fd, EV_RDABLE);
             return;
         }
-        FBUF_COMMIT_WRITE(c->req, rc);
-        
-        break;
+        LOG_FOR_DEBUG("recv() from client %d failed: %s", fd, strerror(errno));
+        context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+        return;
+    }
+    if (rc == 0) {
+        LOG_FOR_DEBUG("client %d connection closed", fd);
+        /* 还有数据没发给 remote 时先只关闭 client，见 remote_writable_cb */
+        if (pending) {
+            context_pool_release(c->pool, c, MASK_CLIENT);
+        } else {
+            context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+        }
+        return;
     }
 
-    fcrypt_decrypt(c->crypto, c->req);
-    delete_event(loop, fd, EV_RDABLE);
-    create_event(loop, c->remote_fd, EV_WRABLE, &remote_writable_cb, c);
+    fcrypt_decrypt_iov(c->crypto, iov, iovcnt, rc);
+
+    /* 已经在等待 remote 可写了，新数据会在 remote_writable_cb 中一起发送 */
+    if (!pending) {
+        /* remote 几乎总是可写的，先直接发送，发不完再等待 EPOLLOUT */
+        int r = fnet_send_chain(c->remote_fd, &c->req, 0);
+        if (r < 0) {
+            LOG_FOR_DEBUG("send() to remote %d failed: %s", c->remote_fd, strerror(errno));
+            context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+            return;
+        }
+        if (r == 0) {
+            create_event(loop, c->remote_fd, EV_WRABLE, &remote_writable_cb, c);
+        }
+    }
+    if (fbuf_chain_space(c->req) == 0) {
+        delete_event(loop, fd, EV_RDABLE);
+    }
 }
 
 
 /* client 可写 */
 static void client_writable_cb(struct event_loop *loop, int fd, int mask, void *evdata)
 {
-
     context_t *c = evdata;
 
-    while (1) {
-        int rc = send(fd, FBUF_DATA_AT(c->res), FBUF_DATA_LEN(c->res), 0);
-        if (rc < 0) {
-            if (errno == EAGAIN) {
-                return;
-            }
-            LOG_FOR_DEBUG("send() to client %d failed: %s", fd, strerror(errno));
-            context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+    zerocopy_reap(c);
+    if (fbuf_chain_len(c->res) == 0) {
+        return;
+    }
+
+    /* 当发送 rc 字节的数据后，如果系统发送缓冲区满，则会产生 EAGAIN 错误，
+     * 此时剩下的数据仍然留在 res chain 中，等待下次可写时发送
+     */
+    int r = fnet_send_chain(fd, &c->res, zerocopy_flags(c));
+    if (r < 0) {
+        LOG_FOR_DEBUG("send() to client %d failed: %s", fd, strerror(errno));
+        context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+        return;
+    }
+    if (r == 1) {
+        delete_event(loop, fd, EV_WRABLE);
+
+        /* 如果 remote 端已经关闭，则此次请求结束 */
+        if (c->remote_fd == 0) {
+            context_pool_release(c->pool, c, MASK_CLIENT);
             return;
         }
-        
-        if (rc >= 0) {
-            /* 当发送 rc 字节的数据后，如果系统发送缓冲区满，则会产生 EAGAIN 错误，
-             * 此时若 rc < c->recvlen，则再次发送时，会丢失 recv buffer 中的
-             * c->recvlen - rc 中的数据，因此应该将其移到 recv buffer 前面
-             */
-            FBUF_COMMIT_READ(c->res, rc);
-            if (FBUF_DATA_LEN(c->res) <= 0) {
-                delete_event(loop, fd, EV_WRABLE);
-                create_event(loop, c->client_fd, EV_RDABLE, &client_readable_cb, c);
-                create_event(loop, c->remote_fd, EV_RDABLE, &remote_readable_cb, c);
-                return;
-            }
-        }
+    }
+    if (c->remote_fd != 0 && res_writable(c)) {
+        arm_event(loop, c->remote_fd, EV_RDABLE, &remote_readable_cb, c);
     }
 }
 
@@ -216,47 +1105,87 @@ static void remote_writable_cb(struct event_loop *loop, int fd, int mask, void *
 {
     context_t *c = evdata;
 
-    while (1) {
-        int rc = send(fd, FBUF_DATA_AT(c->req), FBUF_DATA_LEN(c->req), 0);
-        if (rc < 0) {
-            if (errno == EAGAIN) {
-                return;
-            }
-            LOG_FOR_DEBUG("send() failed to remote %d: %s", fd, strerror(errno));
-            context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+    int r = fnet_send_chain(fd, &c->req, 0);
+    if (r < 0) {
+        LOG_FOR_DEBUG("send() failed to remote %d: %s", fd, strerror(errno));
+        context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+        return;
+    }
+    if (r == 1) {
+        delete_event(loop, fd, EV_WRABLE);
+        
+        /* 如果 client 端已经关闭，则此次请求结束 */
+        if (c->client_fd == 0) {
+            context_pool_release(c->pool, c, MASK_REMOTE);
             return;
         }
-        if (rc >= 0) {
-            FBUF_COMMIT_READ(c->req, rc)
-            if (FBUF_DATA_LEN(c->req) <= 0) {
-
-                delete_event(loop, fd, EV_WRABLE);
-                
-                /* 如果 client 端已经关闭，则此次请求结束 */
-                if (c->client_fd == 0) {
-                    context_pool_release(c->pool, c, MASK_REMOTE);
-                } else {
-                    create_event(loop, fd, EV_RDABLE, &remote_readable_cb, c);
-                    create_event(loop, c->client_fd, EV_RDABLE, &client_readable_cb, c);
-                }
-                break;
-            }
-        }
     }
+    if (c->client_fd != 0 && fbuf_chain_space(c->req) > 0) {
+        arm_event(loop, c->client_fd, EV_RDABLE, &client_readable_cb, c);
+    }
+}
+
+/* 
+ * 发送 res 中已加密的数据给 client，flags 为 MSG_MORE 时内核会暂时
+ * 留住最后一个不满的报文段，等下一次 send 再一起发出
+ */
+static int flush_to_client(context_t *c, int flags)
+{
+    if (c->flush_timer != NULL) {
+        delete_time_event(c->loop, c->flush_timer);
+        c->flush_timer = NULL;
+    }
+
+    int r = fnet_send_chain(c->client_fd, &c->res, flags|zerocopy_flags(c));
+    if (r < 0) {
+        LOG_FOR_DEBUG("send() to client %d failed: %s", c->client_fd, strerror(errno));
+        context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+        return -1;
+    }
+    if (r == 0) {
+        create_event(c->loop, c->client_fd, EV_WRABLE, &client_writable_cb, c);
+    }
+    /* 被 pin 住时要等内核释放 res 之后再读 remote，见 zerocopy_reap */
+    if (c->remote_fd != 0 && !res_writable(c)) {
+        delete_event(c->loop, c->remote_fd, EV_RDABLE);
+    }
+    return r;
+}
+
+/* 攒数据的时间到了，不管够不够一个 batch 都发出去 */
+static long flush_timeout_cb(struct event_loop *loop, void *evdata)
+{
+    context_t *c = evdata;
+
+    c->flush_timer = NULL;
+    flush_to_client(c, 0);
+
+    return EV_TIMER_END;
 }
 
 static void remote_readable_cb(struct event_loop *loop, int fd, int mask, void *evdata)
 {
     context_t *c = evdata;
-    if (FBUF_DATA_LEN(c->res) > 0) {
+    struct iovec iov[FBUF_CHAIN_MAX];
+    int iovcnt, batch = c->server->coalesce_batch;
+
+    /* client 已经关闭，只等 req 中剩下的数据发完 */
+    if (c->client_fd == 0) {
         delete_event(loop, fd, EV_RDABLE);
         return;
     }
 
-    int rc = recv(fd, FBUF_WRITE_AT(c->res), BUFSIZE, 0);
+    /* 有数据在等待 client 可写(而不是在攒数据) */
+    int pending = fbuf_chain_len(c->res) > 0 && c->flush_timer == NULL;
+
+    int rc = fnet_recv_chain(fd, c->res, FBUF_CHAIN_SIZE, iov, &iovcnt);
     if (rc < 0) {
         if (errno == EAGAIN) {
-                return;
+            return;
+        }
+        if (errno == ENOBUFS) {
+            delete_event(loop, fd, EV_RDABLE);
+            return;
         }
         LOG_FOR_DEBUG("recv() failed form remote %d: %s", fd, strerror(errno));
         context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
@@ -264,14 +1193,50 @@ static void remote_readable_cb(struct event_loop *loop, int fd, int mask, void *
     }
     if (rc == 0) {
         LOG_FOR_DEBUG("remote %d Connection closed", fd);
-        context_pool_release(c->pool, c, MASK_REMOTE|MASK_CLIENT);
+        /* 把攒下的数据尽量发出去再关闭 */
+        if (!pending && fbuf_chain_len(c->res) > 0 && flush_to_client(c, 0) < 0) {
+            return;
+        }
+        /* 还有数据没发给 client 时先只关闭 remote，见 client_writable_cb */
+        if (fbuf_chain_len(c->res) > 0) {
+            context_pool_release(c->pool, c, MASK_REMOTE);
+        } else {
+            context_pool_release(c->pool, c, MASK_REMOTE|MASK_CLIENT);
+        }
         return;
     }
 
-    FBUF_COMMIT_WRITE(c->res, rc);
-    
-    fcrypt_encrypt(c->crypto, c->res);
-    
-    delete_event(loop, fd, EV_RDABLE);
-    create_event(loop, c->client_fd, EV_WRABLE, &client_writable_cb, c);
+    fcrypt_encrypt_iov(c->crypto, iov, iovcnt, rc);
+
+    if (pending) {
+        if (!res_writable(c)) {
+            delete_event(loop, fd, EV_RDABLE);
+        }
+        return;
+    }
+
+    int flags = 0;
+    if (fbuf_chain_len(c->res) < batch) {
+        /* 
+         * remote 的数据暂时读完了，但还不够一个 batch，如果允许延迟，就先攒着，
+         * 最多等待 coalesce_delay 毫秒，交互式的流量因此不会被拖太久
+         */
+        if (c->server->coalesce_delay > 0) {
+            if (c->flush_timer == NULL) {
+                c->flush_timer = create_time_event(loop, c->server->coalesce_delay,
+                                                   &flush_timeout_cb, c);
+            }
+            if (c->flush_timer != NULL) {
+                return;
+            }
+        }
+    } else {
+        /* 读满了一个 batch，如果 socket 中还有数据，那么紧接着还会有 send */
+        int queued = 0;
+        if (ioctl(fd, FIONREAD, &queued) == 0 && queued > 0) {
+            flags = MSG_MORE;
+        }
+    }
+
+    flush_to_client(c, flags);
 }
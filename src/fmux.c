@@ -0,0 +1,767 @@
+#include "fmux.h"
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+static void mux_readable_cb(struct event_loop *loop, int fd, int mask, void *evdata);
+static void mux_writable_cb(struct event_loop *loop, int fd, int mask, void *evdata);
+static void stream_readable_cb(struct event_loop *loop, int fd, int mask, void *evdata);
+static void stream_writable_cb(struct event_loop *loop, int fd, int mask, void *evdata);
+
+static inline void frame_header(uint8_t *hdr, int type, uint32_t id, int len)
+{
+    hdr[0] = type;
+    *(uint32_t *)(hdr + 1) = htonl(id);
+    *(uint16_t *)(hdr + 5) = htons(len);
+}
+
+/*
+ * stream 的 buf 最多要放下一个窗口的数据，不受 FBUF_CHAIN_MAX 的限制，
+ * 需要时在链尾分配新的 buffer
+ */
+static int chain_append(fbuffer_t *head, const fbuffer_t *src, int off, int len)
+{
+    int n;
+    fbuffer_t *b = fbuf_chain_tail(head);
+
+    while (len > 0) {
+        n = FBUF_WRITE_LEN(b);
+        if (n == 0) {
+            if (b->next == NULL) {
+                FBUF_CREATE(b->next);
+                if (b->next == NULL) return -1;
+            }
+            b = b->next;
+            continue;
+        }
+        if (n > len) n = len;
+        fbuf_chain_peek(src, off, FBUF_WRITE_AT(b), n);
+        FBUF_COMMIT_WRITE(b, n);
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* buf 写空之后只留下 FBUF_CHAIN_MAX 块，窗口大小的峰值不会一直占着内存 */
+static void chain_trim(fbuffer_t *head)
+{
+    int n = 1;
+
+    for (; head->next != NULL; head = head->next) {
+        if (++n > FBUF_CHAIN_MAX) {
+            fbuf_chain_free(head->next);
+            head->next = NULL;
+            break;
+        }
+    }
+}
+
+/* 隧道出错，释放持有它的 context，同时销毁 session */
+static inline void mux_fail(fmux_t *m)
+{
+    context_pool_release(m->c->pool, m->c, MASK_CLIENT|MASK_REMOTE);
+}
+
+/* 不在 session 自己的回调中时，等隧道可写再发送，避免 session 在调用者手中被销毁 */
+static inline void mux_flush_later(fmux_t *m)
+{
+    if (m->started) {
+        arm_event(m->loop, m->fd, EV_WRABLE, &mux_writable_cb, m);
+    }
+}
+
+/* 在 out 中写入一个帧并加密，Return value: 0 成功, -1 空间不够 */
+static int mux_put_frame(fmux_t *m, int type, uint32_t id,
+                         const uint8_t *data, int len)
+{
+    struct iovec iov[FBUF_CHAIN_MAX];
+    uint8_t hdr[FMUX_HDR_LEN];
+    int i, cnt, space = 0, n = FMUX_HDR_LEN + len;
+
+    if (fbuf_chain_space(m->out) < n) {
+        return -1;
+    }
+    cnt = fbuf_chain_write_iov(m->out, iov, n);
+    for (i = 0; i < cnt; i++) {
+        space += iov[i].iov_len;
+    }
+    if (space < n) {
+        return -1;
+    }
+
+    frame_header(hdr, type, id, len);
+    fbuf_iov_copy(iov, cnt, 0, hdr, FMUX_HDR_LEN);
+    fbuf_iov_copy(iov, cnt, FMUX_HDR_LEN, data, len);
+    fbuf_chain_commit_write(m->out, n);
+    fcrypt_encrypt_iov(m->crypto, iov, cnt, n);
+    return 0;
+}
+
+static inline fmux_stream_t *stream_find(fmux_t *m, uint32_t id)
+{
+    fmux_stream_t *s = m->table[id % FMUX_HASH_SIZE];
+
+    while (s != NULL && s->id != id) {
+        s = s->hnext;
+    }
+    return s;
+}
+
+static fmux_stream_t *stream_new(fmux_t *m, uint32_t id, int fd)
+{
+    fmux_stream_t *s = malloc(sizeof(*s));
+    if (s == NULL) return NULL;
+
+    FBUF_CREATE(s->buf);
+    if (s->buf == NULL) {
+        free(s);
+        return NULL;
+    }
+    s->id = id;
+    s->fd = fd;
+    s->flags = 0;
+    s->send_window = FMUX_WINDOW_SIZE;
+    s->recv_pending = 0;
+    s->syn = NULL;
+    s->syn_len = 0;
+    s->mux = m;
+    s->data = NULL;
+    s->wnext = NULL;
+
+    s->hnext = m->table[id % FMUX_HASH_SIZE];
+    m->table[id % FMUX_HASH_SIZE] = s;
+    s->prev = NULL;
+    s->next = m->streams;
+    if (m->streams != NULL) {
+        m->streams->prev = s;
+    }
+    m->streams = s;
+    m->nstreams++;
+    return s;
+}
+
+/* 从 hash 表中去掉，之后对端发来的帧都会被忽略 */
+static void stream_unhash(fmux_stream_t *s)
+{
+    fmux_stream_t **p = &s->mux->table[s->id % FMUX_HASH_SIZE];
+
+    for (; *p != NULL; p = &(*p)->hnext) {
+        if (*p == s) {
+            *p = s->hnext;
+            break;
+        }
+    }
+}
+
+static void mux_wait(fmux_stream_t *s)
+{
+    fmux_t *m = s->mux;
+
+    if (s->flags & FMUX_S_WAITING) return;
+    s->flags |= FMUX_S_WAITING;
+    s->wnext = NULL;
+    if (m->waiting_tail == NULL) {
+        m->waiting = s;
+    } else {
+        m->waiting_tail->wnext = s;
+    }
+    m->waiting_tail = s;
+}
+
+static void mux_unwait(fmux_stream_t *s)
+{
+    fmux_t *m = s->mux;
+    fmux_stream_t **p, *prev = NULL;
+
+    for (p = &m->waiting; *p != NULL; prev = *p, p = &(*p)->wnext) {
+        if (*p == s) {
+            *p = s->wnext;
+            if (m->waiting_tail == s) {
+                m->waiting_tail = prev;
+            }
+            break;
+        }
+    }
+    s->flags &= ~FMUX_S_WAITING;
+}
+
+static void stream_free(fmux_stream_t *s)
+{
+    fmux_t *m = s->mux;
+
+    stream_unhash(s);
+    if (s->flags & FMUX_S_WAITING) {
+        mux_unwait(s);
+    }
+    if (s->prev != NULL) {
+        s->prev->next = s->next;
+    } else {
+        m->streams = s->next;
+    }
+    if (s->next != NULL) {
+        s->next->prev = s->prev;
+    }
+    m->nstreams--;
+
+    if (s->fd != 0) {
+        delete_event(m->loop, s->fd, EV_WRABLE);
+        delete_event(m->loop, s->fd, EV_RDABLE);
+        close(s->fd);
+    }
+    /* 还在为它连接 remote，取消 */
+    if (s->data != NULL) {
+        context_t *c = s->data;
+        c->stream = NULL;
+        context_pool_release(c->pool, c, MASK_CLIENT|MASK_REMOTE);
+    }
+    free(s->syn);
+    fbuf_chain_free(s->buf);
+    free(s);
+}
+
+/*
+ * 已经关闭的 stream 在控制帧都发出、buf 中的数据都写完(或者没有 fd 可写)
+ * 之后释放
+ *
+ * Return value: 1 已经释放
+ */
+static int stream_maybe_free(fmux_stream_t *s)
+{
+    if ((s->flags & FMUX_S_CLOSING) && !(s->flags & (FMUX_S_SYN|FMUX_S_FIN))
+        && (s->fd == 0 || fbuf_chain_len(s->buf) == 0)) {
+        stream_free(s);
+        return 1;
+    }
+    return 0;
+}
+
+/* 按顺序写入 stream 等待发出的控制帧，Return value: 0 都已写入, -1 空间不够 */
+static int stream_service(fmux_stream_t *s)
+{
+    fmux_t *m = s->mux;
+
+    if (!m->started) {
+        return -1;
+    }
+    if (s->flags & FMUX_S_SYN) {
+        if (mux_put_frame(m, FMUX_SYN, s->id, s->syn, s->syn_len) < 0) {
+            return -1;
+        }
+        free(s->syn);
+        s->syn = NULL;
+        s->flags &= ~FMUX_S_SYN;
+    }
+    if (s->flags & FMUX_S_WINDOW) {
+        uint32_t n = htonl(s->recv_pending);
+        if (mux_put_frame(m, FMUX_WINDOW, s->id, (uint8_t *)&n, 4) < 0) {
+            return -1;
+        }
+        s->recv_pending = 0;
+        s->flags &= ~FMUX_S_WINDOW;
+    }
+    if (s->flags & FMUX_S_FIN) {
+        if (mux_put_frame(m, FMUX_FIN, s->id, NULL, 0) < 0) {
+            return -1;
+        }
+        s->flags &= ~FMUX_S_FIN;
+        stream_unhash(s);
+    }
+    return 0;
+}
+
+/* 尽量立即写入控制帧，写不下就排队，Return value: 1 stream 已经释放 */
+static int stream_kick(fmux_stream_t *s)
+{
+    if ((s->flags & FMUX_S_WAITING) || stream_service(s) < 0) {
+        mux_wait(s);
+        return 0;
+    }
+    return stream_maybe_free(s);
+}
+
+/* 本地的一端关闭或者出错，通知对端 */
+static void stream_close(fmux_stream_t *s, int discard)
+{
+    if (s->fd != 0) {
+        delete_event(s->mux->loop, s->fd, EV_RDABLE);
+    }
+    if (discard) {
+        fbuf_chain_reset(s->buf);
+    }
+    if (!(s->flags & FMUX_S_CLOSING)) {
+        s->flags |= FMUX_S_CLOSING|FMUX_S_FIN;
+    }
+    s->flags &= ~FMUX_S_WINDOW;
+    stream_kick(s);
+}
+
+/* 对端关闭了 stream，buf 中剩下的数据写完后释放 */
+static void stream_peer_fin(fmux_stream_t *s)
+{
+    stream_unhash(s);
+    s->flags |= FMUX_S_CLOSING;
+    s->flags &= ~(FMUX_S_FIN|FMUX_S_WINDOW);
+    if (s->fd != 0) {
+        delete_event(s->mux->loop, s->fd, EV_RDABLE);
+    }
+    stream_maybe_free(s);
+}
+
+/*
+ * 把 buf 中的数据写给 fd，写出去的数据累计到一半窗口时通知对端
+ *
+ * Return value: 0 正常, -1 stream 已经关闭
+ */
+static int stream_flush(fmux_stream_t *s)
+{
+    struct event_loop *loop = s->mux->loop;
+    int before = fbuf_chain_len(s->buf);
+
+    int r = fnet_send_chain(s->fd, &s->buf, 0);
+    if (r < 0) {
+        LOG_FOR_DEBUG("send() to stream %u fd %d failed: %s", s->id, s->fd, strerror(errno));
+        stream_close(s, 1);
+        return -1;
+    }
+    if (!(s->flags & FMUX_S_CLOSING)) {
+        s->recv_pending += before - fbuf_chain_len(s->buf);
+    }
+    if (r == 0) {
+        arm_event(loop, s->fd, EV_WRABLE, &stream_writable_cb, s);
+        return 0;
+    }
+
+    if (get_event_mask(loop, s->fd) & EV_WRABLE) {
+        delete_event(loop, s->fd, EV_WRABLE);
+    }
+    chain_trim(s->buf);
+    if (stream_maybe_free(s)) {
+        return -1;
+    }
+    if (s->recv_pending >= FMUX_WINDOW_SIZE / 2) {
+        s->flags |= FMUX_S_WINDOW;
+        if (stream_kick(s)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * 读取 fd 的数据直接作为 DATA 帧写入 out，头部预留在前面，读完再填上长度，
+ * 窗口用完或者 out 满了就暂停读取
+ */
+static void stream_read(fmux_stream_t *s)
+{
+    fmux_t *m = s->mux;
+    struct iovec iov[FBUF_CHAIN_MAX], riov[FBUF_CHAIN_MAX];
+    uint8_t hdr[FMUX_HDR_LEN];
+    int cnt, rcnt, rc, limit;
+
+    while (1) {
+        if (s->send_window <= 0) {
+            /* 收到 WINDOW 时恢复 */
+            delete_event(m->loop, s->fd, EV_RDABLE);
+            return;
+        }
+        limit = fbuf_chain_space(m->out) - FMUX_HDR_LEN;
+        if (limit < BUFSIZE - FMUX_HDR_LEN) {
+            delete_event(m->loop, s->fd, EV_RDABLE);
+            mux_wait(s);
+            return;
+        }
+        if (limit > FMUX_FRAME_MAX) limit = FMUX_FRAME_MAX;
+        if (limit > s->send_window) limit = s->send_window;
+
+        cnt = fbuf_chain_write_iov(m->out, iov, FMUX_HDR_LEN + limit);
+        rcnt = fbuf_iov_skip(iov, cnt, FMUX_HDR_LEN, riov);
+        if (rcnt == 0) {
+            delete_event(m->loop, s->fd, EV_RDABLE);
+            mux_wait(s);
+            return;
+        }
+
+        do {
+            rc = readv(s->fd, riov, rcnt);
+        } while (rc < 0 && errno == EINTR);
+
+        if (rc < 0) {
+            if (errno == EAGAIN) {
+                return;
+            }
+            LOG_FOR_DEBUG("recv() from stream %u fd %d failed: %s", s->id, s->fd, strerror(errno));
+            stream_close(s, 1);
+            return;
+        }
+        if (rc == 0) {
+            LOG_FOR_DEBUG("stream %u fd %d connection closed", s->id, s->fd);
+            stream_close(s, 0);
+            return;
+        }
+
+        frame_header(hdr, FMUX_DATA, s->id, rc);
+        fbuf_iov_copy(iov, cnt, 0, hdr, FMUX_HDR_LEN);
+        fbuf_chain_commit_write(m->out, FMUX_HDR_LEN + rc);
+        fcrypt_encrypt_iov(m->crypto, iov, cnt, FMUX_HDR_LEN + rc);
+        s->send_window -= rc;
+
+        /* socket 暂时读空了 */
+        if (rc < limit) {
+            return;
+        }
+    }
+}
+
+/* 有空间了，按排队的顺序写入控制帧并恢复读取 */
+static void mux_serve(fmux_t *m)
+{
+    fmux_stream_t *s;
+
+    if (!m->started) return;
+
+    while ((s = m->waiting) != NULL && fbuf_chain_space(m->out) >= BUFSIZE) {
+        if (stream_service(s) < 0) {
+            break;
+        }
+        m->waiting = s->wnext;
+        if (m->waiting == NULL) {
+            m->waiting_tail = NULL;
+        }
+        s->wnext = NULL;
+        s->flags &= ~FMUX_S_WAITING;
+
+        if (stream_maybe_free(s)) {
+            continue;
+        }
+        if (!(s->flags & FMUX_S_CLOSING) && s->fd != 0 && s->send_window > 0) {
+            arm_event(m->loop, s->fd, EV_RDABLE, &stream_readable_cb, s);
+        }
+    }
+}
+
+/* Return value: 0 正常, -1 出错并且 session 已经销毁 */
+static int mux_flush(fmux_t *m)
+{
+    int r;
+
+    while (1) {
+        r = fnet_send_chain(m->fd, &m->out, 0);
+        if (r < 0) {
+            LOG_FOR_DEBUG("send() to mux %d failed: %s", m->fd, strerror(errno));
+            mux_fail(m);
+            return -1;
+        }
+        if (r == 0) {
+            arm_event(m->loop, m->fd, EV_WRABLE, &mux_writable_cb, m);
+            return 0;
+        }
+        if (get_event_mask(m->loop, m->fd) & EV_WRABLE) {
+            delete_event(m->loop, m->fd, EV_WRABLE);
+        }
+        if (m->waiting == NULL) {
+            return 0;
+        }
+        mux_serve(m);
+        if (fbuf_chain_len(m->out) == 0) {
+            return 0;
+        }
+    }
+}
+
+/* 处理一个完整的帧，payload 在 in 中帧头的后面，Return value: -1 协议错误 */
+static int mux_frame(fmux_t *m, int type, uint32_t id, int len)
+{
+    fmux_stream_t *s = stream_find(m, id);
+    uint8_t buf[1+MAX_ADDR_LEN+2];
+    int pending;
+    uint32_t n;
+
+    switch (type) {
+    case FMUX_SYN:
+        if (m->open == NULL || s != NULL || len > (int)sizeof(buf)) {
+            fakio_log(LOG_WARNING, "mux %d bad SYN for stream %u", m->fd, id);
+            return -1;
+        }
+        fbuf_chain_peek(m->in, FMUX_HDR_LEN, buf, len);
+        s = stream_new(m, id, 0);
+        if (s == NULL) {
+            /* 没有 stream 可以排队，FIN 写不进 out 时对端会一直等下去 */
+            if (mux_put_frame(m, FMUX_FIN, id, NULL, 0) < 0) {
+                fakio_log(LOG_WARNING, "mux %d can't refuse stream %u", m->fd, id);
+                return -1;
+            }
+            return 0;
+        }
+        m->open(m, s, buf, len);
+        return 0;
+
+    case FMUX_DATA:
+        /* 已经关闭的 stream，丢掉 */
+        if (s == NULL || (s->flags & FMUX_S_CLOSING)) {
+            return 0;
+        }
+        pending = fbuf_chain_len(s->buf);
+        if (pending + s->recv_pending + len > FMUX_WINDOW_SIZE) {
+            fakio_log(LOG_WARNING, "mux %d stream %u window overflow", m->fd, id);
+            return -1;
+        }
+        if (chain_append(s->buf, m->in, FMUX_HDR_LEN, len) < 0) {
+            stream_close(s, 1);
+            return 0;
+        }
+        /* 还在连接 remote 时先留着；已经在等待可写时会一起写出 */
+        if (s->fd != 0 && pending == 0) {
+            stream_flush(s);
+        }
+        return 0;
+
+    case FMUX_FIN:
+        if (s != NULL) {
+            stream_peer_fin(s);
+        }
+        return 0;
+
+    case FMUX_WINDOW:
+        if (len != 4) {
+            return -1;
+        }
+        if (s == NULL || (s->flags & FMUX_S_CLOSING)) {
+            return 0;
+        }
+        fbuf_chain_peek(m->in, FMUX_HDR_LEN, (uint8_t *)&n, 4);
+        n = ntohl(n);
+        if (n > FMUX_WINDOW_SIZE || s->send_window + (int)n > FMUX_WINDOW_SIZE) {
+            fakio_log(LOG_WARNING, "mux %d stream %u bad window update", m->fd, id);
+            return -1;
+        }
+        s->send_window += n;
+        if (s->fd != 0 && !(s->flags & FMUX_S_SYN)) {
+            arm_event(m->loop, s->fd, EV_RDABLE, &stream_readable_cb, s);
+        }
+        return 0;
+
+    default:
+        /* 不认识的帧，留给以后的版本 */
+        return 0;
+    }
+}
+
+/* 处理 in 中所有完整的帧，Return value: 0 正常, -1 出错并且 session 已经销毁 */
+static int mux_input(fmux_t *m)
+{
+    uint8_t hdr[FMUX_HDR_LEN];
+    int len, avail;
+
+    while ((avail = fbuf_chain_len(m->in)) >= FMUX_HDR_LEN) {
+        fbuf_chain_peek(m->in, 0, hdr, FMUX_HDR_LEN);
+        len = ntohs(*(uint16_t *)(hdr + 5));
+        if (len > FMUX_FRAME_MAX) {
+            fakio_log(LOG_WARNING, "mux %d frame too long: %d", m->fd, len);
+            mux_fail(m);
+            return -1;
+        }
+        if (avail < FMUX_HDR_LEN + len) {
+            break;
+        }
+        if (mux_frame(m, hdr[0], ntohl(*(uint32_t *)(hdr + 1)), len) < 0) {
+            mux_fail(m);
+            return -1;
+        }
+        fbuf_chain_commit_read(&m->in, FMUX_HDR_LEN + len);
+    }
+    return 0;
+}
+
+static void mux_readable_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    fmux_t *m = evdata;
+    struct iovec iov[FBUF_CHAIN_MAX];
+    int iovcnt;
+
+    /* 帧不超过一块 buffer，处理完之后剩下的不完整的帧不会占满 in */
+    int rc = fnet_recv_chain(fd, m->in, FBUF_CHAIN_SIZE, iov, &iovcnt);
+    if (rc < 0) {
+        if (errno == EAGAIN) {
+            return;
+        }
+        LOG_FOR_DEBUG("recv() from mux %d failed: %s", fd, strerror(errno));
+        mux_fail(m);
+        return;
+    }
+    if (rc == 0) {
+        LOG_FOR_DEBUG("mux %d connection closed", fd);
+        mux_fail(m);
+        return;
+    }
+
+    fcrypt_decrypt_iov(m->crypto, iov, iovcnt, rc);
+    m->received += rc;
+    if (mux_input(m) < 0) {
+        return;
+    }
+    mux_flush(m);
+}
+
+static void mux_writable_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    mux_flush(evdata);
+}
+
+static void stream_readable_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    fmux_stream_t *s = evdata;
+    fmux_t *m = s->mux;
+
+    stream_read(s);
+    mux_flush(m);
+}
+
+static void stream_writable_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    fmux_stream_t *s = evdata;
+    fmux_t *m = s->mux;
+
+    stream_flush(s);
+    mux_flush(m);
+}
+
+fmux_t *fmux_create(context_t *c, int fd, fmux_open_callback *open,
+                    fmux_close_callback *close, void *data)
+{
+    fmux_t *m = malloc(sizeof(*m));
+    if (m == NULL) return NULL;
+
+    FBUF_CREATE(m->in);
+    FBUF_CREATE(m->out);
+    if (m->in == NULL || m->out == NULL) {
+        FBUF_FREE(m->in);
+        FBUF_FREE(m->out);
+        free(m);
+        return NULL;
+    }
+    m->fd = fd;
+    m->c = c;
+    m->loop = c->loop;
+    m->crypto = c->crypto;
+    m->started = 0;
+    m->received = 0;
+    m->next_id = 1;
+    m->nstreams = 0;
+    memset(m->table, 0, sizeof(m->table));
+    m->streams = NULL;
+    m->waiting = m->waiting_tail = NULL;
+    m->open = open;
+    m->close = close;
+    m->data = data;
+    return m;
+}
+
+void fmux_destroy(fmux_t *m)
+{
+    if (m->close != NULL) {
+        m->close(m);
+    }
+    while (m->streams != NULL) {
+        stream_free(m->streams);
+    }
+    fbuf_chain_free(m->in);
+    fbuf_chain_free(m->out);
+    free(m);
+}
+
+int fmux_write_raw(fmux_t *m, const uint8_t *data, int len)
+{
+    struct iovec iov[FBUF_CHAIN_MAX];
+    int i, cnt, space = 0;
+
+    cnt = fbuf_chain_write_iov(m->out, iov, len);
+    for (i = 0; i < cnt; i++) {
+        space += iov[i].iov_len;
+    }
+    if (space < len) {
+        return -1;
+    }
+    fbuf_iov_copy(iov, cnt, 0, data, len);
+    fbuf_chain_commit_write(m->out, len);
+    return 0;
+}
+
+int fmux_start(fmux_t *m, const uint8_t *plain, int len)
+{
+    struct iovec iov[FBUF_CHAIN_MAX];
+    int i, cnt, space = 0;
+
+    m->started = 1;
+    if (create_event(m->loop, m->fd, EV_RDABLE, &mux_readable_cb, m) < 0) {
+        mux_fail(m);
+        return -1;
+    }
+
+    if (len > 0) {
+        cnt = fbuf_chain_write_iov(m->in, iov, len);
+        for (i = 0; i < cnt; i++) {
+            space += iov[i].iov_len;
+        }
+        if (space < len) {
+            mux_fail(m);
+            return -1;
+        }
+        fbuf_iov_copy(iov, cnt, 0, plain, len);
+        fbuf_chain_commit_write(m->in, len);
+        m->received += len;
+        if (mux_input(m) < 0) {
+            return -1;
+        }
+    }
+    mux_serve(m);
+    return mux_flush(m);
+}
+
+fmux_stream_t *fmux_stream_open(fmux_t *m, int fd, const uint8_t *addr, int len)
+{
+    fmux_stream_t *s = stream_new(m, m->next_id, fd);
+    if (s == NULL) return NULL;
+
+    s->syn = malloc(len);
+    if (s->syn == NULL) {
+        s->fd = 0;
+        stream_free(s);
+        return NULL;
+    }
+    memcpy(s->syn, addr, len);
+    s->syn_len = len;
+    s->flags |= FMUX_S_SYN;
+    mux_wait(s);
+
+    if (++m->next_id == 0) {
+        m->next_id = 1;
+    }
+    mux_flush_later(m);
+    return s;
+}
+
+void fmux_stream_connected(fmux_stream_t *s, int fd)
+{
+    fmux_t *m = s->mux;
+
+    s->fd = fd;
+    s->data = NULL;
+    if (fbuf_chain_len(s->buf) > 0 && stream_flush(s) < 0) {
+        mux_flush_later(m);
+        return;
+    }
+    if (s->send_window > 0) {
+        create_event(m->loop, fd, EV_RDABLE, &stream_readable_cb, s);
+    }
+    mux_flush_later(m);
+}
+
+void fmux_stream_reset(fmux_stream_t *s)
+{
+    fmux_t *m = s->mux;
+
+    s->data = NULL;
+    stream_close(s, 1);
+    mux_flush_later(m);
+}
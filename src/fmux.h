@@ -0,0 +1,109 @@
+#ifndef _FAKIO_MUX_H_
+#define _FAKIO_MUX_H_
+
+#include "fakio.h"
+
+/*
+ * 多路复用的隧道: client 和 server 之间的一条连接上同时承载多个 stream，
+ * 握手之后两个方向都是加密的帧:
+ *
+ *     TYPE(1) | ID(4) | LEN(2) | payload
+ *
+ * SYN 由 client 发出，payload 是目标地址 ATYP | addr | port；DATA 是 stream
+ * 的数据；FIN 表示发送方已经关闭这个 stream，接收方把剩下的数据写完后也
+ * 关闭；WINDOW 的 payload 是 4 字节的增量。每个 stream 单独做流量控制，
+ * 发送方最多可以有 FMUX_WINDOW 字节对方还没有写出去的数据，一个慢的
+ * stream 不会挡住隧道上的其它 stream
+ */
+
+#define FMUX_SYN 1
+#define FMUX_DATA 2
+#define FMUX_FIN 3
+#define FMUX_WINDOW 4
+
+#define FMUX_HDR_LEN 7
+#define FMUX_FRAME_MAX (BUFSIZE - FMUX_HDR_LEN) /* 一个帧不超过一块 buffer */
+#define FMUX_WINDOW_SIZE (256*1024)
+#define FMUX_HASH_SIZE 256
+
+/* stream 的状态 */
+#define FMUX_S_SYN 1      /* SYN 还没有发出 */
+#define FMUX_S_FIN 2      /* FIN 还没有发出 */
+#define FMUX_S_WINDOW 4   /* 有 WINDOW 还没有发出 */
+#define FMUX_S_WAITING 8  /* 在等待 out 的空间 */
+#define FMUX_S_CLOSING 16 /* 已经关闭，只等 buf 中的数据写完 */
+
+/* server: 对端打开了新的 stream，addr 是 ATYP | addr | port */
+typedef void fmux_open_callback(fmux_t *m, fmux_stream_t *s,
+                                const uint8_t *addr, int len);
+/* session 销毁之前调用 */
+typedef void fmux_close_callback(fmux_t *m);
+
+struct fmux_stream {
+    uint32_t id;
+    int fd;      /* 本地的一端，server 是 remote，client 是本地程序；0 表示还在连接 */
+    int flags;
+
+    int send_window;  /* 还可以发给对端的字节数 */
+    int recv_pending; /* 已经写给 fd 但还没有通知对端的字节数 */
+    fbuffer_t *buf;   /* 对端发来的、等待写给 fd 的数据，长度受窗口限制 */
+
+    uint8_t *syn;     /* client: 还没有发出的 SYN 的 payload */
+    int syn_len;
+
+    fmux_t *mux;
+    void *data;       /* server: 正在为它连接 remote 的 context */
+
+    struct fmux_stream *hnext;       /* hash 表中的下一个 */
+    struct fmux_stream *prev, *next; /* session 的所有 stream */
+    struct fmux_stream *wnext;       /* 等待 out 空间的下一个 */
+};
+
+struct fmux {
+    int fd;
+    context_t *c;     /* 持有 fd 和 crypto 的 context，它释放时销毁 session */
+    struct event_loop *loop;
+    fcrypt_ctx_t *crypto;
+
+    fbuffer_t *in;    /* 收到并解密的帧 */
+    fbuffer_t *out;   /* 已加密、等待发送的帧 */
+    int started;      /* crypto 已经可以使用 */
+    long long received;
+
+    uint32_t next_id;
+    int nstreams;
+    fmux_stream_t *table[FMUX_HASH_SIZE];
+    fmux_stream_t *streams;
+    fmux_stream_t *waiting, *waiting_tail; /* FIFO */
+
+    fmux_open_callback *open;
+    fmux_close_callback *close;
+    void *data;
+};
+
+fmux_t *fmux_create(context_t *c, int fd, fmux_open_callback *open,
+                    fmux_close_callback *close, void *data);
+
+/* 由 context 释放时调用，关闭所有 stream，不关闭隧道的 fd */
+void fmux_destroy(fmux_t *m);
+
+/* 握手的回复等不加密的数据，放在所有帧之前 */
+int fmux_write_raw(fmux_t *m, const uint8_t *data, int len);
+
+/*
+ * crypto 已经可以使用，开始收发帧，plain 是和握手一起收到的已经解密的帧
+ *
+ * Return value: 0 正常, -1 出错并且 session 已经销毁
+ */
+int fmux_start(fmux_t *m, const uint8_t *plain, int len);
+
+/* client: 打开一个 stream，SYN 在 session 开始之后发出 */
+fmux_stream_t *fmux_stream_open(fmux_t *m, int fd, const uint8_t *addr, int len);
+
+/* server: remote 已经连接上 */
+void fmux_stream_connected(fmux_stream_t *s, int fd);
+
+/* server: remote 连接失败，通知对端并释放 stream */
+void fmux_stream_reset(fmux_stream_t *s);
+
+#endif
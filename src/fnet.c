@@ -1,13 +1,25 @@
 #include "fnet.h"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
+#include <linux/errqueue.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <strings.h>
+#include <ctype.h>
 
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
 
 int set_nonblocking(int fd)
 {
@@ -39,35 +51,212 @@ int set_socket_option(int fd)
     return 1;
 }
 
-int fnet_create_and_bind(const char *addr, const char *port)
+/* 
+ * accept4 直接得到非阻塞的 fd，省去两次 fcntl；TCP_NODELAY 等选项在 Linux 下
+ * 会从 listen fd 继承，因此 listen fd 设置过 set_socket_option 即可
+ */
+int fnet_accept(int listen_fd)
+{
+    int fd;
+
+    do {
+        fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+    } while (fd < 0 && (errno == EINTR || errno == ECONNABORTED));
+
+    return fd;
+}
+
+/*
+ * 直接发送 chain 中的数据，大部分时候 socket 都是可写的，这样可以省掉一次
+ * epoll_wait 以及相应的 epoll_ctl。多块 buffer 通过 sendmsg 一次发送，
+ * flags 会传给 sendmsg(如 MSG_MORE)，使用 MSG_ZEROCOPY 时每次成功的调用
+ * 都会 pin 住 chain 一次
+ *
+ * Return value: 1 全部发送完, 0 遇到 EAGAIN 或只发送了一部分(剩下的数据
+ *               仍在 chain 中), -1 出错
+ */
+int fnet_send_chain(int fd, fbuffer_t **head, int flags)
+{
+    int i, cnt, len, rc;
+    struct iovec iov[FBUF_CHAIN_MAX];
+    struct msghdr msg;
+
+    while ((cnt = fbuf_chain_data_iov(*head, iov, FBUF_CHAIN_MAX)) > 0) {
+        for (len = 0, i = 0; i < cnt; i++) {
+            len += iov[i].iov_len;
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+
+        rc = sendmsg(fd, &msg, flags);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            /* TCP_FASTOPEN_CONNECT 没有 cookie 时只发出了 SYN，等连上再发 */
+            if (errno == EINPROGRESS) return 0;
+            /* 超过 optmem 限制，这一次退回到普通的发送 */
+            if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+                flags &= ~MSG_ZEROCOPY;
+                continue;
+            }
+            return -1;
+        }
+        if (flags & MSG_ZEROCOPY) {
+            (*head)->pinned++;
+        }
+        fbuf_chain_commit_read(head, rc);
+        if (rc < len) return 0;
+    }
+    return 1;
+}
+
+/*
+ * 使用 readv 读取最多 limit 字节到 chain 的空闲空间中，iov 至少要有
+ * FBUF_CHAIN_MAX 个元素，返回时 iov/iovcnt 为本次使用的空间，调用者
+ * 可以据此就地加解密新读到的数据
+ *
+ * Return value: 同 readv，chain 已满时返回 -1 并设置 errno 为 ENOBUFS
+ */
+int fnet_recv_chain(int fd, fbuffer_t *head, int limit,
+                    struct iovec *iov, int *iovcnt)
+{
+    int rc;
+
+    *iovcnt = fbuf_chain_write_iov(head, iov, limit);
+    if (*iovcnt == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    do {
+        rc = readv(fd, iov, *iovcnt);
+    } while (rc < 0 && errno == EINTR);
+
+    if (rc > 0) {
+        fbuf_chain_commit_write(head, rc);
+    }
+    return rc;
+}
+
+int fnet_zerocopy_enable(int fd)
+{
+    int opt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt)) == -1) {
+        LOG_FOR_DEBUG("setsockopt SO_ZEROCOPY: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * 从 fd 的 error queue 中读取 MSG_ZEROCOPY 的完成通知，每个通知对应一段
+ * 连续的 send 调用，据此减少 buf 的 pin 计数。内核退回到复制方式时
+ * (比如 loopback) 会设置 *copied，此时再用 MSG_ZEROCOPY 已经没有意义
+ *
+ * Return value: 完成的 send 次数，-1 出错
+ */
+int fnet_zerocopy_reap(int fd, fbuffer_t *buf, int *copied)
+{
+    int done = 0;
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+
+    while (buf->pinned > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            int n = serr->ee_data - serr->ee_info + 1;
+            buf->pinned -= n;
+            done += n;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                *copied = 1;
+            }
+        }
+    }
+    if (buf->pinned < 0) {
+        buf->pinned = 0;
+    }
+    return done;
+}
+
+/*
+ * addr 可以是 IPv4 或者 IPv6 地址，为空时监听所有 IPv4 地址。监听 "::" 时
+ * 关闭 IPV6_V6ONLY，同时接受 IPv4 的连接
+ */
+int fnet_create_and_bind(const char *addr, const char *port, int flags)
 {
-    struct sockaddr_in sa;
+    struct addrinfo hints;
+    struct addrinfo *result;
+    int opt = 0, on = 1;
 
-    int sfd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+    if (addr == NULL || addr[0] == '\0') {
+        addr = "0.0.0.0";
+    }
+
+    int err = getaddrinfo(addr, port, &hints, &result);
+    if (err != 0) {
+        fakio_log(LOG_WARNING, "invalid bind address %s: %s", addr, gai_strerror(err));
+        return -1;
+    }
+
+    int sfd = socket(result->ai_family, SOCK_STREAM, 0);
     if (sfd < 0) {
         fakio_log(LOG_WARNING, "can't create socket: %s", strerror(errno));
+        freeaddrinfo(result);
+        return -1;
     }
 
     if (set_socket_option(sfd) < 0) {
         fakio_log(LOG_WARNING, "set socket option error");
     }
+    if (result->ai_family == AF_INET6 &&
+        setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt)) == -1) {
+        fakio_log(LOG_WARNING, "setsockopt IPV6_V6ONLY: %s", strerror(errno));
+    }
 
-    memset(&sa, 0, sizeof(sa));
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(atoi(port));
-    sa.sin_addr.s_addr = htonl(INADDR_ANY);
-    
-    if (addr && inet_pton(AF_INET, addr, &sa.sin_addr) != 1) {
-        fakio_log(LOG_WARNING, "invalid bind address");
+    if ((flags & FNET_BIND_TRANSPARENT) &&
+        setsockopt(sfd, result->ai_family == AF_INET6 ? SOL_IPV6 : SOL_IP,
+                   result->ai_family == AF_INET6 ? IPV6_TRANSPARENT : IP_TRANSPARENT,
+                   &on, sizeof(on)) == -1) {
+        fakio_log(LOG_WARNING, "setsockopt IP_TRANSPARENT: %s", strerror(errno));
+        freeaddrinfo(result);
+        close(sfd);
+        return -1;
+    }
+    if ((flags & FNET_BIND_REUSEPORT) &&
+        setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+        fakio_log(LOG_WARNING, "setsockopt SO_REUSEPORT: %s", strerror(errno));
+        freeaddrinfo(result);
         close(sfd);
         return -1;
     }
 
-    if (bind(sfd, (struct sockaddr*)&sa, sizeof(sa)) == -1) {
+    if (bind(sfd, result->ai_addr, result->ai_addrlen) == -1) {
         fakio_log(LOG_WARNING, "bind: %s", strerror(errno));
+        freeaddrinfo(result);
         close(sfd);
         return -1;
     }
+    freeaddrinfo(result);
 
     if (set_nonblocking(sfd) < 0) {
         fakio_log(LOG_WARNING, "set nonblocking error");
@@ -76,29 +265,109 @@ int fnet_create_and_bind(const char *addr, const char *port)
     return sfd;
 }
 
-int fnet_create_and_connect(const char *addr, const char *port, int blocking)
+/*
+ * 非阻塞的 UDP socket，绑定到 addr 的 IP 和随机端口。addr 为空时绑定所有
+ * 地址，优先使用关闭了 IPV6_V6ONLY 的 IPv6 socket，同时收发 IPv4
+ */
+int fnet_create_udp(const union fnet_addr *addr)
+{
+    union fnet_addr local;
+    int fd, opt = 0;
+
+    memset(&local, 0, sizeof(local));
+    if (addr != NULL) {
+        memcpy(&local, addr, addr->sa.sa_family == AF_INET6 ? sizeof(addr->v6) : sizeof(addr->v4));
+        local.v4.sin_port = 0; /* sin_port 和 sin6_port 的位置相同 */
+        fd = socket(local.sa.sa_family, SOCK_DGRAM, 0);
+    } else {
+        local.v6.sin6_family = AF_INET6;
+        local.v6.sin6_addr = in6addr_any;
+        fd = socket(AF_INET6, SOCK_DGRAM, 0);
+        if (fd >= 0 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt)) == -1) {
+            close(fd);
+            fd = -1;
+        }
+        /* 内核没有 IPv6 */
+        if (fd < 0) {
+            memset(&local, 0, sizeof(local));
+            local.v4.sin_family = AF_INET;
+            local.v4.sin_addr.s_addr = htonl(INADDR_ANY);
+            fd = socket(AF_INET, SOCK_DGRAM, 0);
+        }
+    }
+    if (fd < 0) {
+        fakio_log(LOG_WARNING, "can't create udp socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if (bind(fd, &local.sa, local.sa.sa_family == AF_INET6 ? sizeof(local.v6) : sizeof(local.v4)) == -1) {
+        fakio_log(LOG_WARNING, "udp bind: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (set_nonblocking(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * 地址是数字形式(IP)时直接得到 addrinfo，不会阻塞，域名则返回非 0，
+ * 需要交给 resolver 解析
+ */
+int fnet_resolve_numeric(const char *addr, const char *port, struct addrinfo **result)
 {
     struct addrinfo hints;
-    struct addrinfo *result, *rp;
-    int listen_fd = 0;
 
     memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;        /* IPv4 Only */ 
+    hints.ai_family = AF_UNSPEC;      /* IPv4 or IPv6 */
     hints.ai_socktype = SOCK_STREAM;  /* TCP Only */
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
 
-    int err = getaddrinfo(addr, port, &hints, &result);
-    if (err != 0) {
-        fakio_log(LOG_WARNING, "%s:%s getaddrinfo: %s", addr, port, gai_strerror(err));
+    return getaddrinfo(addr, port, &hints, result);
+}
+
+/*
+ * listen fd 开启 TCP Fast Open，qlen 为还没有完成三次握手但已经带了数据的
+ * 连接队列长度，需要 net.ipv4.tcp_fastopen 打开服务端(第 2 位)
+ */
+int fnet_fastopen_listen(int fd, int qlen)
+{
+    if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) == -1) {
+        fakio_log(LOG_WARNING, "setsockopt TCP_FASTOPEN: %s", strerror(errno));
         return -1;
     }
+    return 0;
+}
+
+/*
+ * 依次尝试 result 中的地址，返回第一个连接成功(或正在连接)的 fd
+ *
+ * flags 带 FNET_CONNECT_FASTOPEN 时使用 TCP_FASTOPEN_CONNECT: 有 cookie 时
+ * connect 立即返回，SYN 推迟到第一次 send 时和数据一起发出；没有 cookie
+ * 时第一次 send 可能返回 EINPROGRESS，见 fnet_send_chain
+ */
+int fnet_connect_addrinfo(struct addrinfo *result, const char *addr,
+                          const char *port, int flags)
+{
+    struct addrinfo *rp;
+    int fd, opt = 1;
+    int blocking = flags & FNET_CONNECT_BLOCK;
+
     for (rp = result; rp != NULL; rp = rp->ai_next) {
-        listen_fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (listen_fd == -1)
+        fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (fd == -1)
             continue;
+
+        if ((flags & FNET_CONNECT_FASTOPEN) &&
+            setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &opt, sizeof(opt)) == -1) {
+            LOG_FOR_DEBUG("setsockopt TCP_FASTOPEN_CONNECT: %s", strerror(errno));
+        }
         
         if (!blocking) {
-            if (set_nonblocking(listen_fd) < 0) {
-                close(listen_fd);
+            if (set_nonblocking(fd) < 0) {
+                close(fd);
                 continue;
             }    
         }
@@ -106,42 +375,519 @@ int fnet_create_and_connect(const char *addr, const char *port, int blocking)
         /* 以非阻塞模式 connect，防止阻塞其它请求，超时时间是默认的，大概75s左右,
          * 如果timeout ，则会自动中断 connect 
          */
-        if (connect(listen_fd, rp->ai_addr, rp->ai_addrlen) < 0) {
-            if (!blocking) {
-                if (errno == EHOSTUNREACH) {
-                    fakio_log(LOG_WARNING, "connect %s:%s - %s", addr, port, strerror(errno));
-                    close(listen_fd);
-                    continue;
-                } else if (errno == EINPROGRESS) {
-                    goto end;
-                } else {
-                    fakio_log(LOG_WARNING, "connect %s:%s - %s", addr, port, strerror(errno));
-                    close(listen_fd);
-                    continue;
-                }   
-            } else {
-                fakio_log(LOG_WARNING, "connect %s:%s - %s", addr, port, strerror(errno));
+        if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+            return fd;
+        }
+        if (!blocking && errno == EINPROGRESS) {
+            return fd;
+        }
+        fakio_log(LOG_WARNING, "connect %s:%s - %s", addr, port, strerror(errno));
+        close(fd);
+    }
+
+    return -1;
+}
+
+int fnet_create_and_connect(const char *addr, const char *port, int flags)
+{
+    struct addrinfo hints;
+    struct addrinfo *result;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;      /* IPv4 or IPv6 */
+    hints.ai_socktype = SOCK_STREAM;  /* TCP Only */
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    int err = getaddrinfo(addr, port, &hints, &result);
+    if (err != 0) {
+        fakio_log(LOG_WARNING, "%s:%s getaddrinfo: %s", addr, port, gai_strerror(err));
+        return -1;
+    }
+
+    int fd = fnet_connect_addrinfo(result, addr, port, flags);
+    freeaddrinfo(result);
+    return fd;
+}
+
+static void addrlist_set(struct fnet_addrlist *list, int i,
+                         const struct sockaddr *sa, socklen_t len)
+{
+    memset(&list->ai[i], 0, sizeof(struct addrinfo));
+    memcpy(&list->addrs[i], sa, len);
+    list->ai[i].ai_family = sa->sa_family;
+    list->ai[i].ai_socktype = SOCK_STREAM;
+    list->ai[i].ai_protocol = IPPROTO_TCP;
+    list->ai[i].ai_addr = &list->addrs[i].sa;
+    list->ai[i].ai_addrlen = len;
+    if (i > 0) {
+        list->ai[i-1].ai_next = &list->ai[i];
+    }
+}
+
+/* 复制 result 中的地址到 list，最多 FNET_MAX_ADDRS 个，返回地址个数 */
+int fnet_addrlist_copy(struct fnet_addrlist *list, const struct addrinfo *result)
+{
+    int n = 0;
+
+    for (; result != NULL && n < FNET_MAX_ADDRS; result = result->ai_next) {
+        if (result->ai_addrlen > sizeof(union fnet_addr)) continue;
+        addrlist_set(list, n++, result->ai_addr, result->ai_addrlen);
+    }
+    return n;
+}
+
+/*
+ * 按 RFC 8305 重新排列地址: IPv6 优先，之后两种地址交替出现，这样依次
+ * 发起连接时，一种地址的路径不通不会拖住另一种
+ *
+ * Return value: 地址个数
+ */
+int fnet_addrlist_interleave(struct fnet_addrlist *list, int n)
+{
+    int i, k = 0, i6 = 0, i4 = 0;
+    union fnet_addr v6[FNET_MAX_ADDRS], v4[FNET_MAX_ADDRS];
+    socklen_t l6[FNET_MAX_ADDRS], l4[FNET_MAX_ADDRS];
+    int n6 = 0, n4 = 0;
+
+    for (i = 0; i < n; i++) {
+        if (list->addrs[i].sa.sa_family == AF_INET6) {
+            l6[n6] = list->ai[i].ai_addrlen;
+            v6[n6++] = list->addrs[i];
+        } else {
+            l4[n4] = list->ai[i].ai_addrlen;
+            v4[n4++] = list->addrs[i];
+        }
+    }
+    if (n6 == 0 || n4 == 0) {
+        return n;
+    }
+
+    while (i6 < n6 || i4 < n4) {
+        if (i6 < n6) {
+            addrlist_set(list, k++, &v6[i6].sa, l6[i6]);
+            i6++;
+        }
+        if (i4 < n4) {
+            addrlist_set(list, k++, &v4[i4].sa, l4[i4]);
+            i4++;
+        }
+    }
+    return n;
+}
+
+/* 生成 ip:port 格式的字符串，用于日志 */
+const char *fnet_addr_str(const union fnet_addr *addr, char *buf, size_t len)
+{
+    char ip[INET6_ADDRSTRLEN];
+
+    if (addr->sa.sa_family == AF_INET6) {
+        inet_ntop(AF_INET6, &addr->v6.sin6_addr, ip, sizeof(ip));
+        snprintf(buf, len, "[%s]:%d", ip, ntohs(addr->v6.sin6_port));
+    } else {
+        inet_ntop(AF_INET, &addr->v4.sin_addr, ip, sizeof(ip));
+        snprintf(buf, len, "%s:%d", ip, ntohs(addr->v4.sin_port));
+    }
+    return buf;
+}
+
+/*
+ * 出口地址池。只有一个出口 IP 时，连接同一个目标(ip:port)最多只能用掉一个
+ * 临时端口范围，配置多个源地址后按目标的地址族轮流 bind。使用
+ * IP_BIND_ADDRESS_NO_PORT 时 bind 不会分配端口，端口推迟到 connect 时按
+ * 完整的四元组分配，这样不同的目标可以复用同一个端口
+ */
+static struct fnet_source sources[FNET_MAX_SOURCES];
+static int nsources;
+static unsigned int source_next;
+
+int fnet_source_add(const char *addr)
+{
+    struct addrinfo hints;
+    struct addrinfo *result;
+
+    if (nsources == FNET_MAX_SOURCES) {
+        fakio_log(LOG_WARNING, "too many source addresses, max %d", FNET_MAX_SOURCES);
+        return -1;
+    }
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST;
+
+    int err = getaddrinfo(addr, NULL, &hints, &result);
+    if (err != 0) {
+        fakio_log(LOG_WARNING, "invalid source address %s: %s", addr, gai_strerror(err));
+        return -1;
+    }
+
+    struct fnet_source *src = &sources[nsources++];
+    memset(src, 0, sizeof(*src));
+    memcpy(&src->addr, result->ai_addr, result->ai_addrlen);
+    src->addrlen = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+
+const struct fnet_source *fnet_source_list(int *n)
+{
+    *n = nsources;
+    return sources;
+}
+
+/* 在 family 相同的源地址中选第 n 个(取模) */
+static struct fnet_source *source_pick(int family, unsigned int n)
+{
+    int i, match = 0;
+
+    for (i = 0; i < nsources; i++) {
+        if (sources[i].addr.sa.sa_family == family) match++;
+    }
+    if (match == 0) {
+        return NULL;
+    }
+
+    n %= match;
+    for (i = 0; i < nsources; i++) {
+        if (sources[i].addr.sa.sa_family == family && n-- == 0) {
+            break;
+        }
+    }
+    return &sources[i];
+}
+
+static int source_bind(int fd, struct fnet_source *src)
+{
+    int opt = 1;
+
+    if (setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &opt, sizeof(opt)) == -1) {
+        LOG_FOR_DEBUG("setsockopt IP_BIND_ADDRESS_NO_PORT: %s", strerror(errno));
+    }
+    return bind(fd, &src->addr.sa, src->addrlen);
+}
+
+/*
+ * 以非阻塞方式连接 addr，返回的 fd 可能已经连接上，也可能正在连接，
+ * 需要等待可写之后用 fnet_connect_result 检查结果。配置了出口地址池时
+ * 先 bind 源地址，某个源地址端口用完(EADDRNOTAVAIL)时换下一个
+ *
+ * Return value: fd, -1 出错
+ */
+int fnet_connect_addr(const struct sockaddr *addr, socklen_t len)
+{
+    int i, fd, err;
+    unsigned int cur = source_next++;
+    struct fnet_source *src = NULL;
+
+    for (i = 0; i < (nsources ? nsources : 1); i++) {
+        fd = socket(addr->sa_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return -1;
+        }
+
+        src = source_pick(addr->sa_family, cur++);
+        if (src != NULL && source_bind(fd, src) < 0) {
+            err = errno;
+            src->failed++;
+            close(fd);
+            errno = err;
+            if (err == EADDRINUSE || err == EADDRNOTAVAIL) {
                 continue;
-            }    
+            }
+            return -1;
+        }
+
+        if (connect(fd, addr, len) == 0 || errno == EINPROGRESS) {
+            if (src != NULL) {
+                src->connects++;
+            }
+            return fd;
+        }
+
+        err = errno;
+        close(fd);
+        errno = err;
+        if (src == NULL || err != EADDRNOTAVAIL) {
+            return -1;
+        }
+        /* 这个源地址到 addr 的端口用完了，换下一个 */
+        src->failed++;
+    }
+    return -1;
+}
+
+/* 
+ * 非阻塞 connect 的 fd 可写之后检查连接结果
+ *
+ * Return value: 0 连接成功，否则为连接失败的 errno
+ */
+int fnet_connect_result(int fd)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+        return errno;
+    }
+    return err;
+}
+
+/*
+ * 透明代理的连接原来的目标: iptables REDIRECT 改写了目标地址，要用
+ * SO_ORIGINAL_DST 从 conntrack 中取回；TPROXY 不改写，本地地址就是原来的
+ * 目标。没有经过 REDIRECT 直接连过来的连接取不到(ENOENT)
+ *
+ * Return value: 0 成功, -1 出错
+ */
+int fnet_original_dst(int fd, int tproxy, union fnet_addr *addr)
+{
+    union fnet_addr local;
+    socklen_t len = sizeof(*addr);
+    int r;
+
+    if (getsockname(fd, &addr->sa, &len) < 0) {
+        return -1;
+    }
+    if (tproxy) {
+        return 0;
+    }
+
+    local = *addr;
+    len = sizeof(*addr);
+    if (addr->sa.sa_family == AF_INET6) {
+        r = getsockopt(fd, SOL_IPV6, IP6T_SO_ORIGINAL_DST, &addr->v6, &len);
+    } else {
+        r = getsockopt(fd, SOL_IP, SO_ORIGINAL_DST, &addr->v4, &len);
+    }
+    if (r < 0) {
+        return -1;
+    }
+
+    /* 有 conntrack 但没有被 REDIRECT，原来的目标就是自己，转发出去会绕回来 */
+    if (addr->sa.sa_family == AF_INET6
+        ? (memcmp(&addr->v6.sin6_addr, &local.v6.sin6_addr, 16) == 0
+           && addr->v6.sin6_port == local.v6.sin6_port)
+        : (addr->v4.sin_addr.s_addr == local.v4.sin_addr.s_addr
+           && addr->v4.sin_port == local.v4.sin_port)) {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * 按 SOCKS5 的格式写入 ATYP | addr | port，IPv4-mapped 的 IPv6 地址写成
+ * IPv4 地址
+ *
+ * Return value: 写入的长度
+ */
+int fnet_addr_to_socks(const union fnet_addr *addr, uint8_t *buf)
+{
+    if (addr->sa.sa_family == AF_INET6
+        && !IN6_IS_ADDR_V4MAPPED(&addr->v6.sin6_addr)) {
+        buf[0] = SOCKS_ATYPE_IPV6;
+        memcpy(buf + 1, &addr->v6.sin6_addr, 16);
+        memcpy(buf + 17, &addr->v6.sin6_port, 2);
+        return 1 + 16 + 2;
+    }
+
+    buf[0] = SOCKS_ATYPE_IPV4;
+    if (addr->sa.sa_family == AF_INET6) {
+        memcpy(buf + 1, addr->v6.sin6_addr.s6_addr + 12, 4);
+        memcpy(buf + 5, &addr->v6.sin6_port, 2);
+    } else {
+        memcpy(buf + 1, &addr->v4.sin_addr, 4);
+        memcpy(buf + 5, &addr->v4.sin_port, 2);
+    }
+    return 1 + 4 + 2;
+}
+
+/*
+ * DNS 缓存，只在 event loop 线程中使用。getaddrinfo 不返回 TTL，因此成功的
+ * 结果缓存 dns_ttl 秒，失败(NXDOMAIN 等)缓存 dns_negative_ttl 秒。
+ * 条目数量固定，满了以后淘汰最久没有使用的(LRU)
+ */
+struct dns_entry {
+    char host[MAX_HOST_LEN+1];
+    int naddrs;               /* 0 表示缓存的是失败结果 */
+    union fnet_addr addrs[FNET_MAX_ADDRS];
+    socklen_t addrlens[FNET_MAX_ADDRS];
+    long long expire;         /* 毫秒 */
+
+    struct dns_entry *hnext;      /* 哈希链，空闲时为空闲链表 */
+    struct dns_entry *prev, *next; /* LRU 链表，表头是最近使用的 */
+};
+
+static struct {
+    struct dns_entry *entries;
+    struct dns_entry *free;
+    struct dns_entry **buckets;
+    unsigned long mask;
+    struct dns_entry lru;     /* 哨兵 */
+    long long ttl, negative_ttl;
+} dns_cache;
+
+/* 域名不区分大小写 */
+static unsigned long dns_hash(const char *host)
+{
+    unsigned long h = 5381;
+    while (*host) {
+        h = h * 33 + tolower((unsigned char)*host++);
+    }
+    return h;
+}
+
+static inline void lru_unlink(struct dns_entry *e)
+{
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static inline void lru_push_front(struct dns_entry *e)
+{
+    e->next = dns_cache.lru.next;
+    e->prev = &dns_cache.lru;
+    dns_cache.lru.next->prev = e;
+    dns_cache.lru.next = e;
+}
+
+static void dns_cache_remove(struct dns_entry *e)
+{
+    struct dns_entry **pp = &dns_cache.buckets[dns_hash(e->host) & dns_cache.mask];
+
+    while (*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = e->hnext;
+    lru_unlink(e);
+
+    e->hnext = dns_cache.free;
+    dns_cache.free = e;
+}
+
+static struct dns_entry *dns_cache_find(const char *host)
+{
+    struct dns_entry *e = dns_cache.buckets[dns_hash(host) & dns_cache.mask];
+
+    for (; e != NULL; e = e->hnext) {
+        if (strcasecmp(e->host, host) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* size 为 0 时不使用缓存 */
+int fnet_dns_cache_init(int size, int ttl, int negative_ttl)
+{
+    int i;
+    unsigned long nbuckets = 1;
+
+    if (size <= 0) return 0;
+    while (nbuckets < (unsigned long)size) {
+        nbuckets <<= 1;
+    }
+
+    dns_cache.entries = calloc(size, sizeof(struct dns_entry));
+    dns_cache.buckets = calloc(nbuckets, sizeof(struct dns_entry *));
+    if (dns_cache.entries == NULL || dns_cache.buckets == NULL) {
+        free(dns_cache.entries);
+        free(dns_cache.buckets);
+        dns_cache.entries = NULL;
+        dns_cache.buckets = NULL;
+        return -1;
+    }
+    dns_cache.mask = nbuckets - 1;
+    dns_cache.free = NULL;
+    for (i = size - 1; i >= 0; i--) {
+        dns_cache.entries[i].hnext = dns_cache.free;
+        dns_cache.free = &dns_cache.entries[i];
+    }
+    dns_cache.lru.next = dns_cache.lru.prev = &dns_cache.lru;
+    dns_cache.ttl = (long long)ttl * 1000;
+    dns_cache.negative_ttl = (long long)negative_ttl * 1000;
+    return 0;
+}
+
+/*
+ * 查找 host 的缓存，命中时把地址和 port 填入 list，list->ai 可以直接交给
+ * fnet_connect_addrinfo 使用
+ *
+ * Return value: 地址个数, 0 没有缓存, FNET_DNS_NEGATIVE 缓存了失败结果
+ */
+int fnet_dns_cache_get(const char *host, const char *port, struct fnet_addrlist *list)
+{
+    int i;
+    struct dns_entry *e;
+
+    if (dns_cache.entries == NULL) return 0;
+
+    e = dns_cache_find(host);
+    if (e == NULL) {
+        return 0;
+    }
+    if (e->expire <= fakio_now_ms()) {
+        dns_cache_remove(e);
+        return 0;
+    }
+    lru_unlink(e);
+    lru_push_front(e);
+
+    if (e->naddrs == 0) {
+        return FNET_DNS_NEGATIVE;
+    }
+
+    uint16_t nport = htons(atoi(port));
+    for (i = 0; i < e->naddrs; i++) {
+        addrlist_set(list, i, &e->addrs[i].sa, e->addrlens[i]);
+        if (list->addrs[i].sa.sa_family == AF_INET6) {
+            list->addrs[i].v6.sin6_port = nport;
         } else {
-            goto end;
+            list->addrs[i].v4.sin_port = nport;
         }
     }
+    return e->naddrs;
+}
 
-    if (rp == NULL) {
-        fakio_log(LOG_WARNING, "connect %s:%s - %s", addr, port, strerror(errno));
-        goto done;
+/* 缓存 getaddrinfo 的结果，err 不为 0 时缓存失败结果 */
+void fnet_dns_cache_put(const char *host, struct addrinfo *result, int err)
+{
+    struct addrinfo *rp;
+    struct dns_entry *e;
+
+    if (dns_cache.entries == NULL || strlen(host) > MAX_HOST_LEN) return;
+    if (err != 0 && dns_cache.negative_ttl <= 0) return;
+
+    e = dns_cache_find(host);
+    if (e != NULL) {
+        dns_cache_remove(e);
     }
+    /* 满了，淘汰最久没有使用的 */
+    if (dns_cache.free == NULL) {
+        dns_cache_remove(dns_cache.lru.prev);
+    }
+    e = dns_cache.free;
+    dns_cache.free = e->hnext;
 
-done:
-    listen_fd = -1;
+    strcpy(e->host, host);
+    e->naddrs = 0;
+    if (err == 0) {
+        for (rp = result; rp != NULL && e->naddrs < FNET_MAX_ADDRS; rp = rp->ai_next) {
+            if (rp->ai_addrlen > sizeof(union fnet_addr)) continue;
+            memcpy(&e->addrs[e->naddrs], rp->ai_addr, rp->ai_addrlen);
+            e->addrlens[e->naddrs] = rp->ai_addrlen;
+            e->naddrs++;
+        }
+    }
+    e->expire = fakio_now_ms() + (e->naddrs > 0 ? dns_cache.ttl : dns_cache.negative_ttl);
 
-end:
-    freeaddrinfo(rp);
-    return listen_fd;
+    unsigned long idx = dns_hash(host) & dns_cache.mask;
+    e->hnext = dns_cache.buckets[idx];
+    dns_cache.buckets[idx] = e;
+    lru_push_front(e);
 }
 
-/* 使用 IPv4:port 格式生成服务器地址 */
+/* 使用 IP:port 格式生成服务器地址，reply 至少要有 22 字节 */
 int socks5_get_server_reply(const char *ip, const char *port, uint8_t *reply)
 {
     if (reply == NULL) {
@@ -151,20 +897,21 @@ int socks5_get_server_reply(const char *ip, const char *port, uint8_t *reply)
     reply[1] = SOCKS_REP_SUCCEED;
     reply[2] = SOCKS_RSV;
     reply[3] = SOCKS_ATYPE_IPV4;
-    
-    int r = inet_pton(AF_INET, ip, reply+4);
-    if (r == 0) {
-        fakio_log(LOG_WARNING, "IPv4 addr not enable");
-        return -1;
-    } else if (r == -1) {
-        fakio_log(LOG_WARNING, "IPv4 %s", strerror(errno));
-        return -1;
-    }
 
     uint16_t ports = htons(atoi(port));
-    *(uint16_t *)(reply + 8) = ports;
     
-    return 10;
+    if (inet_pton(AF_INET, ip, reply+4) == 1) {
+        *(uint16_t *)(reply + 8) = ports;
+        return 10;
+    }
+    if (inet_pton(AF_INET6, ip, reply+4) == 1) {
+        reply[3] = SOCKS_ATYPE_IPV6;
+        *(uint16_t *)(reply + 20) = ports;
+        return 22;
+    }
+
+    fakio_log(LOG_WARNING, "invalid addr: %s", ip);
+    return -1;
 }
 
 int socks5_request_resolve(const uint8_t *buffer, int buflen, frequest_t *req)
@@ -187,9 +934,21 @@ int socks5_request_resolve(const uint8_t *buffer, int buflen, frequest_t *req)
             fakio_log(LOG_WARNING, "IPv4 Error %s", strerror(errno));
         }
         ports = ntohs(*(uint16_t*)(buffer + 8));
-        snprintf(req->port, 5, "%d", ports);
+        snprintf(req->port, sizeof(req->port), "%d", ports);
         req->rlen = 10;
     } 
+    else if (buffer[3] == SOCKS_ATYPE_IPV6) {
+        if (buflen < 22) {
+            fakio_log(LOG_WARNING, "buffer is less 22");
+            return -1;
+        }
+        if (inet_ntop(AF_INET6, buffer + 4, req->addr, INET6_ADDRSTRLEN) == NULL) {
+            fakio_log(LOG_WARNING, "IPv6 Error %s", strerror(errno));
+        }
+        ports = ntohs(*(uint16_t*)(buffer + 20));
+        snprintf(req->port, sizeof(req->port), "%d", ports);
+        req->rlen = 22;
+    }
     else if (buffer[3] == SOCKS_ATYPE_DNAME) {
         uint8_t domain_len = *(uint8_t *)(buffer + 4);
         int i;
@@ -198,7 +957,7 @@ int socks5_request_resolve(const uint8_t *buffer, int buflen, frequest_t *req)
         }
         req->addr[domain_len] = '\0';
         ports = ntohs(*(uint16_t*)(buffer + 4 + domain_len + 1));
-        snprintf(req->port, 5, "%d", ports);
+        snprintf(req->port, sizeof(req->port), "%d", ports);
         req->rlen = 7 + domain_len;
     }
     else {
@@ -216,12 +975,11 @@ int fakio_request_resolve(const uint8_t *buffer, int buflen,
 {
     uint16_t ports;
     
-    if (buflen < 10) {
-        fakio_log(LOG_WARNING, "buffer is less 10");
-        return -1;
-    }
-    
     if (action == FNET_RESOLVE_USER) {
+        if (buflen < 17 || buflen < 17 + buffer[16]) {
+            fakio_log(LOG_WARNING, "buffer is less username");
+            return -1;
+        }
         /* IV */
         memcpy(req->IV, buffer, 16);
         
@@ -236,28 +994,54 @@ int fakio_request_resolve(const uint8_t *buffer, int buflen,
 
     if (action == FNET_RESOLVE_NET) {
         
-        /* 版本号 */
-        if (buffer[0] != SOCKS_VER) {
-            fakio_log(LOG_WARNING, "SOCKS_VER not 5");
+        if (buflen < 2) {
+            fakio_log(LOG_WARNING, "buffer is less 2");
+            return -1;
+        }
+
+        /* 版本号，各个版本的地址部分相同 */
+        if (buffer[0] != SOCKS_VER && buffer[0] != FAKIO_HS_V2
+            && buffer[0] != FAKIO_HS_V3 && buffer[0] != FAKIO_HS_STRIPE) {
+            fakio_log(LOG_WARNING, "unknown version: %d", buffer[0]);
             return -1;
         }
 
         /*  IPv4 */
         if (buffer[1] == SOCKS_ATYPE_IPV4) {
+            if (buflen < 8) {
+                fakio_log(LOG_WARNING, "buffer is less 8");
+                return -1;
+            }
             if (inet_ntop(AF_INET, buffer + 2, req->addr, INET_ADDRSTRLEN) == NULL) {
                 fakio_log(LOG_WARNING, "IPv4 Error %s", strerror(errno));
             }
             ports = ntohs(*(uint16_t*)(buffer + 6));
-            snprintf(req->port, 5, "%d", ports);
+            snprintf(req->port, sizeof(req->port), "%d", ports);
             req->rlen = req->rlen + 1 + 1 + 4 + 2;
 
+        } else if (buffer[1] == SOCKS_ATYPE_IPV6) {
+            if (buflen < 20) {
+                fakio_log(LOG_WARNING, "buffer is less 20");
+                return -1;
+            }
+            if (inet_ntop(AF_INET6, buffer + 2, req->addr, INET6_ADDRSTRLEN) == NULL) {
+                fakio_log(LOG_WARNING, "IPv6 Error %s", strerror(errno));
+            }
+            ports = ntohs(*(uint16_t*)(buffer + 18));
+            snprintf(req->port, sizeof(req->port), "%d", ports);
+            req->rlen = req->rlen + 1 + 1 + 16 + 2;
+
         } else if (buffer[1] == SOCKS_ATYPE_DNAME) {
+            if (buflen < 3 || buflen < 3 + buffer[2] + 2) {
+                fakio_log(LOG_WARNING, "buffer is less domain");
+                return -1;
+            }
             uint8_t domain_len = *(uint8_t *)(buffer + 2);
             memcpy(req->addr, buffer+3, domain_len);
             req->addr[domain_len] = '\0';
 
             ports = ntohs(*(uint16_t*)(buffer + domain_len + 3));
-            snprintf(req->port, 5, "%d", ports);
+            snprintf(req->port, sizeof(req->port), "%d", ports);
             req->rlen = req->rlen + 1 + 1 + 1 + domain_len + 2;
         } else {
             fakio_log(LOG_WARNING, "unsupported addrtype: %d", buffer[1]);
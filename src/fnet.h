@@ -2,6 +2,9 @@
 #define _FAKIO_NET_H_
 
 #include "fakio.h"
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
 
 /* Socks5 define */
 #define SOCKS_VER 0x05
@@ -9,15 +12,81 @@
 #define SOCKS_NO_AUTH 0x00
 #define SOCKS_RSV 0x00
 #define SOCKS_CONNECT 0x01
+#define SOCKS_UDP_ASSOCIATE 0x03
 #define SOCKS_REP_SUCCEED 0x00
 #define SOCKS_REP_FAIL 0x01
+#define SOCKS_REP_CMD_UNSUPPORTED 0x07
 #define SOCKS_ATYPE_IPV4 0x01
 #define SOCKS_ATYPE_DNAME 0x03
+#define SOCKS_ATYPE_IPV6 0x04
+
+/* 握手协议的版本，v1 沿用 SOCKS_VER，见 docs/protocol.txt */
+#define FAKIO_HS_V2 0x02
+#define FAKIO_HS_V3 0x03 /* v2 加上 0-RTT 的 early data */
+#define FAKIO_HS_MUX 0x04 /* 多路复用的隧道，没有目标地址，见 fmux.h */
+#define FAKIO_HS_UDP 0x06 /* UDP 转发的隧道，没有目标地址，见 fudp.h */
+#define FAKIO_HS_STRIPE 0x07 /* v2 加上 GROUP，remote 的数据分散到多条连接，见 fstripe.h */
+#define FAKIO_HS_STRIPE_JOIN 0x08 /* 加入一个 GROUP，没有目标地址 */
+#define FAKIO_HS_TICKET_REQ 0x80 /* v2/v3 的 VER 带上此位表示请求 session ticket */
+#define FAKIO_HS_PAD_MAX 255
+#define FAKIO_EARLY_DATA_MAX 1024
 
 #define MAX_ADDR_LEN 256
 
 #define FNET_CONNECT_BLOCK 1
 #define FNET_CONNECT_NONBLOCK 0
+#define FNET_CONNECT_FASTOPEN 2 /* 可以和上面两个组合使用 */
+
+#define FNET_BIND_REUSEPORT 1 /* 多个线程各自监听同一个端口，由内核分配连接 */
+#define FNET_BIND_TRANSPARENT 2 /* 接受 TPROXY 转过来的连接，需要 CAP_NET_ADMIN */
+
+/* iptables REDIRECT 之前的目标地址，见 linux/netfilter_ipv4.h */
+#ifndef SO_ORIGINAL_DST
+#define SO_ORIGINAL_DST 80
+#endif
+#ifndef IP6T_SO_ORIGINAL_DST
+#define IP6T_SO_ORIGINAL_DST 80
+#endif
+
+/* 老版本的 glibc 没有定义，需要 Linux 4.11+ */
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 30
+#endif
+
+/* 老版本的 glibc 没有定义，需要 Linux 4.14+ */
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+/* 一个域名最多使用的地址个数 */
+#define FNET_MAX_ADDRS 8
+#define FNET_DNS_NEGATIVE -1
+
+union fnet_addr {
+    struct sockaddr sa;
+    struct sockaddr_in v4;
+    struct sockaddr_in6 v6;
+};
+
+/* 出口地址池 */
+#define FNET_MAX_SOURCES 16
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+struct fnet_source {
+    union fnet_addr addr;
+    socklen_t addrlen;
+    unsigned long connects;  /* 使用这个地址发起的连接数 */
+    unsigned long failed;    /* bind/connect 时端口不够用的次数 */
+};
+
+/* 由 DNS 缓存生成的地址列表，ai 链接在一起，指向 addrs */
+struct fnet_addrlist {
+    struct addrinfo ai[FNET_MAX_ADDRS];
+    union fnet_addr addrs[FNET_MAX_ADDRS];
+};
 
 #define FNET_RESOLVE_USER 0
 #define FNET_RESOLVE_NET  1
@@ -34,8 +103,35 @@ struct frequest {
 int set_nonblocking(int fd);
 int set_socket_option(int fd);
 
-int fnet_create_and_bind(const char *addr, const char *port);
-int fnet_create_and_connect(const char *addr, const char *port, int blocking);
+int fnet_accept(int listen_fd);
+int fnet_send_chain(int fd, fbuffer_t **head, int flags);
+int fnet_recv_chain(int fd, fbuffer_t *head, int limit,
+                    struct iovec *iov, int *iovcnt);
+
+int fnet_zerocopy_enable(int fd);
+int fnet_zerocopy_reap(int fd, fbuffer_t *buf, int *copied);
+
+int fnet_create_and_bind(const char *addr, const char *port, int flags);
+int fnet_create_udp(const union fnet_addr *addr);
+int fnet_fastopen_listen(int fd, int qlen);
+int fnet_create_and_connect(const char *addr, const char *port, int flags);
+int fnet_resolve_numeric(const char *addr, const char *port, struct addrinfo **result);
+int fnet_connect_addrinfo(struct addrinfo *result, const char *addr,
+                          const char *port, int flags);
+
+int fnet_addrlist_copy(struct fnet_addrlist *list, const struct addrinfo *result);
+int fnet_addrlist_interleave(struct fnet_addrlist *list, int n);
+const char *fnet_addr_str(const union fnet_addr *addr, char *buf, size_t len);
+int fnet_source_add(const char *addr);
+const struct fnet_source *fnet_source_list(int *n);
+int fnet_connect_addr(const struct sockaddr *addr, socklen_t len);
+int fnet_connect_result(int fd);
+int fnet_original_dst(int fd, int tproxy, union fnet_addr *addr);
+int fnet_addr_to_socks(const union fnet_addr *addr, uint8_t *buf);
+
+int fnet_dns_cache_init(int size, int ttl, int negative_ttl);
+int fnet_dns_cache_get(const char *host, const char *port, struct fnet_addrlist *list);
+void fnet_dns_cache_put(const char *host, struct addrinfo *result, int err);
 
 /* for client */
 int socks5_request_resolve(const uint8_t *buffer, int buflen,
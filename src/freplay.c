@@ -0,0 +1,111 @@
+#include "freplay.h"
+#include <stdlib.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+/*
+ * entries 是按到达顺序排列的环，从最老的一端淘汰已经过期的条目；
+ * buckets 按 tag 串起同一个桶中的条目，用于查找
+ */
+struct replay_entry {
+    uint8_t tag[FREPLAY_TAG_LEN];
+    uint32_t expire;  /* 在此之后同一个 tag 会因为时间不对被拒绝，可以淘汰 */
+    int next;         /* 同一个桶中的下一个, -1 结束 */
+};
+
+struct freplay {
+    struct replay_entry *entries;
+    int size;
+    int head;         /* 最老的条目 */
+    int count;
+
+    int *buckets;
+    unsigned long mask;
+
+    int window;
+    uint32_t start;   /* 启动时间，之前的握手可能在重启前已经见过 */
+};
+
+freplay_t *freplay_create(int size, int window)
+{
+    unsigned long n = 1;
+    int i;
+
+    freplay_t *r = malloc(sizeof(*r));
+    if (r == NULL) return NULL;
+
+    while (n < (unsigned long)size) {
+        n <<= 1;
+    }
+    r->entries = malloc(size * sizeof(struct replay_entry));
+    r->buckets = malloc(n * sizeof(int));
+    if (r->entries == NULL || r->buckets == NULL) {
+        free(r->entries);
+        free(r->buckets);
+        free(r);
+        return NULL;
+    }
+    for (i = 0; i < (int)n; i++) {
+        r->buckets[i] = -1;
+    }
+    r->mask = n - 1;
+    r->size = size;
+    r->head = r->count = 0;
+    r->window = window;
+    r->start = (uint32_t)time(NULL);
+    return r;
+}
+
+/* tag 的后 12 字节是随机数 */
+static inline int *bucket(freplay_t *r, const uint8_t *tag)
+{
+    uint32_t h;
+    memcpy(&h, tag + 4, sizeof(h));
+    return &r->buckets[h & r->mask];
+}
+
+static void evict_head(freplay_t *r)
+{
+    struct replay_entry *e = &r->entries[r->head];
+    int *p = bucket(r, e->tag);
+
+    while (*p != r->head) {
+        p = &r->entries[*p].next;
+    }
+    *p = e->next;
+    r->head = (r->head + 1) % r->size;
+    r->count--;
+}
+
+int freplay_check(freplay_t *r, const uint8_t tag[FREPLAY_TAG_LEN])
+{
+    uint32_t now = (uint32_t)time(NULL);
+    uint32_t t = ntohl(*(uint32_t *)tag);
+    int i;
+
+    if (t < r->start || t + r->window < now || t > now + r->window) {
+        return -1;
+    }
+
+    while (r->count > 0 && r->entries[r->head].expire < now) {
+        evict_head(r);
+    }
+
+    int *b = bucket(r, tag);
+    for (i = *b; i >= 0; i = r->entries[i].next) {
+        if (memcmp(r->entries[i].tag, tag, FREPLAY_TAG_LEN) == 0) {
+            return -1;
+        }
+    }
+    if (r->count == r->size) {
+        return -1;
+    }
+
+    i = (r->head + r->count) % r->size;
+    memcpy(r->entries[i].tag, tag, FREPLAY_TAG_LEN);
+    r->entries[i].expire = t + r->window;
+    r->entries[i].next = *b;
+    *b = i;
+    r->count++;
+    return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef _FAKIO_REPLAY_H_
+#define _FAKIO_REPLAY_H_
+
+#include "fakio.h"
+
+/*
+ * 0-RTT 握手的防重放: 出示 ticket 的握手和带 early data 的 v3 握手不等
+ * server 的回复，录下来原样重发时 server 会再次连接 remote 并转发同样的
+ * 数据。这两种握手的 NONCE(IV) 由 client 选取，前 4 字节是 client 的时间
+ * (秒，网络字节序)，server 只接受和自己的时间相差不超过 window 秒、并且
+ * 不早于启动时间的握手，同时记住 window 内见过的所有 NONCE，同一个 NONCE
+ * 第二次出现时拒绝。
+ *
+ * 表满了(window 内的 0-RTT 握手超过 size 个)时也拒绝。只在一个进程内
+ * 有效，多台 server 共用 ticket_secret 时，发给另一台 server 的重放挡不住
+ */
+
+#define FREPLAY_TAG_LEN 16
+
+freplay_t *freplay_create(int size, int window);
+
+/* Return value: 0 第一次见到, -1 时间不对、重放或者表满了 */
+int freplay_check(freplay_t *r, const uint8_t tag[FREPLAY_TAG_LEN]);
+
+#endif
@@ -0,0 +1,172 @@
+#include "fresolver.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+struct fresolver {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* 等待解析的请求，FIFO */
+    fresolve_job_t *head, *tail;
+    /* 解析完成，等待 event loop 处理的请求 */
+    fresolve_job_t *done;
+
+    int efd;
+    struct event_loop *loop;
+};
+
+static void *resolver_worker(void *arg)
+{
+    fresolver_t *r = arg;
+    fresolve_job_t *job;
+    struct addrinfo hints;
+    uint64_t one = 1;
+    sigset_t set;
+
+    /* 信号交给主线程处理 */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;      /* IPv4 or IPv6 */
+    hints.ai_socktype = SOCK_STREAM;  /* TCP Only */
+    hints.ai_flags = AI_ADDRCONFIG;   /* 没有配置 IPv6 地址时不查询 AAAA */
+
+    while (1) {
+        pthread_mutex_lock(&r->lock);
+        while (r->head == NULL) {
+            pthread_cond_wait(&r->cond, &r->lock);
+        }
+        job = r->head;
+        r->head = job->next;
+        if (r->head == NULL) {
+            r->tail = NULL;
+        }
+        pthread_mutex_unlock(&r->lock);
+
+        job->err = getaddrinfo(job->host, job->port, &hints, &job->result);
+        if (job->err != 0) {
+            job->result = NULL;
+        }
+
+        pthread_mutex_lock(&r->lock);
+        job->next = r->done;
+        r->done = job;
+        pthread_mutex_unlock(&r->lock);
+
+        if (write(r->efd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            fakio_log(LOG_WARNING, "resolver notify: %s", strerror(errno));
+        }
+    }
+    return NULL;
+}
+
+/* eventfd 可读，取出所有完成的请求并调用回调 */
+static void resolver_done_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    fresolver_t *r = evdata;
+    fresolve_job_t *job, *next, *list = NULL;
+    uint64_t n;
+
+    if (read(fd, &n, sizeof(n)) < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    job = r->done;
+    r->done = NULL;
+    pthread_mutex_unlock(&r->lock);
+
+    /* done 是倒序的，按完成的先后顺序处理 */
+    for (; job != NULL; job = next) {
+        next = job->next;
+        job->next = list;
+        list = job;
+    }
+
+    for (job = list; job != NULL; job = next) {
+        next = job->next;
+        if (!job->canceled) {
+            job->cb(job);
+        }
+        if (job->result != NULL) {
+            freeaddrinfo(job->result);
+        }
+        free(job);
+    }
+}
+
+fresolver_t *fresolver_create(struct event_loop *loop, int nthreads)
+{
+    int i;
+    pthread_t tid;
+
+    fresolver_t *r = malloc(sizeof(*r));
+    if (r == NULL) return NULL;
+
+    r->head = r->tail = r->done = NULL;
+    r->loop = loop;
+    r->efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (r->efd < 0) {
+        fakio_log(LOG_WARNING, "eventfd: %s", strerror(errno));
+        free(r);
+        return NULL;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+
+    if (create_event(loop, r->efd, EV_RDABLE, &resolver_done_cb, r) < 0) {
+        close(r->efd);
+        free(r);
+        return NULL;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&tid, NULL, &resolver_worker, r) != 0) {
+            fakio_log(LOG_WARNING, "can't create resolver thread: %s", strerror(errno));
+            break;
+        }
+        pthread_detach(tid);
+    }
+    if (i == 0) {
+        delete_event(loop, r->efd, EV_RDABLE);
+        close(r->efd);
+        free(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+fresolve_job_t *fresolver_submit(fresolver_t *r, const char *host, const char *port,
+                                 fresolve_callback *cb, void *data)
+{
+    if (r == NULL) return NULL;
+
+    fresolve_job_t *job = malloc(sizeof(*job));
+    if (job == NULL) return NULL;
+
+    snprintf(job->host, sizeof(job->host), "%s", host);
+    snprintf(job->port, sizeof(job->port), "%s", port);
+    job->err = 0;
+    job->result = NULL;
+    job->canceled = 0;
+    job->cb = cb;
+    job->data = data;
+    job->next = NULL;
+
+    pthread_mutex_lock(&r->lock);
+    if (r->tail == NULL) {
+        r->head = r->tail = job;
+    } else {
+        r->tail->next = job;
+        r->tail = job;
+    }
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+
+    return job;
+}
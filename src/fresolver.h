@@ -0,0 +1,40 @@
+#ifndef _FAKIO_RESOLVER_H_
+#define _FAKIO_RESOLVER_H_
+
+#include "fakio.h"
+#include <netdb.h>
+
+/*
+ * getaddrinfo 是阻塞的，放到 resolver 线程中执行，完成后通过 eventfd 通知
+ * event loop，回调总是在 event loop 所在的线程中调用
+ */
+
+typedef struct fresolve_job fresolve_job_t;
+typedef void fresolve_callback(fresolve_job_t *job);
+
+struct fresolve_job {
+    char host[MAX_HOST_LEN+1];
+    char port[MAX_PORT_LEN];
+
+    int err;                  /* getaddrinfo 的返回值 */
+    struct addrinfo *result;  /* 回调返回后由 resolver 释放 */
+
+    int canceled;
+    fresolve_callback *cb;
+    void *data;
+
+    struct fresolve_job *next;
+};
+
+fresolver_t *fresolver_create(struct event_loop *loop, int nthreads);
+
+fresolve_job_t *fresolver_submit(fresolver_t *r, const char *host, const char *port,
+                                 fresolve_callback *cb, void *data);
+
+/* 只能在 event loop 线程中调用，取消后不会再调用回调 */
+static inline void fresolver_cancel(fresolve_job_t *job)
+{
+    job->canceled = 1;
+}
+
+#endif
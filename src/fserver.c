@@ -3,6 +3,22 @@
 #include "fhandler.h"
 #include "fakio.h"
 
+#define DEFAULT_ACCEPT_BATCH 32
+#define DEFAULT_RESOLVER_THREADS 4
+#define DEFAULT_DNS_CACHE_SIZE 1024
+#define DEFAULT_DNS_TTL 60
+#define DEFAULT_DNS_NEGATIVE_TTL 5
+#define DEFAULT_CONNECT_TIMEOUT 3000
+#define DEFAULT_HAPPY_EYEBALLS_DELAY 250
+#define DEFAULT_BREAKER_SIZE 4096
+#define DEFAULT_BREAKER_THRESHOLD 5
+#define DEFAULT_BREAKER_BACKOFF 1000
+#define DEFAULT_BREAKER_MAX_BACKOFF 30000
+#define DEFAULT_TICKET_LIFETIME 3600
+#define DEFAULT_REPLAY_WINDOW 120
+#define DEFAULT_REPLAY_CACHE 65536
+#define DEFAULT_UDP_TIMEOUT 60
+
 static fserver_t server;
 
 static void signal_handler(int signo)
@@ -16,6 +32,58 @@ static void signal_handler(int signo)
     exit(1);
 }
 
+static long stats_timer_cb(struct event_loop *loop, void *evdata)
+{
+    fserver_t *server = evdata;
+    struct fstats *st = &server->stats;
+
+    fakio_log(LOG_INFO, "accept: wakeups=%lu accepted=%lu avg=%.2f max=%lu "
+              "budget_out=%lu backlog_full=%lu drops=%lu errors=%lu",
+              st->accept_wakeups, st->accepted,
+              st->accept_wakeups ? (double)st->accepted / st->accept_wakeups : 0.0,
+              st->accept_max_batch, st->accept_budget_out, st->backlog_full,
+              st->accept_drops, st->accept_errors);
+    unsigned long queries = st->dns_lookups + st->dns_cache_hits + st->dns_negative_hits;
+    fakio_log(LOG_INFO, "dns: lookups=%lu failed=%lu cache_hits=%lu negative_hits=%lu "
+              "hit_rate=%.1f%%", st->dns_lookups, st->dns_failed,
+              st->dns_cache_hits, st->dns_negative_hits,
+              queries ? 100.0 * (queries - st->dns_lookups) / queries : 0.0);
+    fakio_log(LOG_INFO, "connect: fallbacks=%lu timeouts=%lu failed=%lu v6=%lu v4=%lu",
+              st->connect_fallbacks, st->connect_timeouts, st->connect_failed,
+              st->connect_v6, st->connect_v4);
+    fakio_log(LOG_INFO, "breaker: trips=%lu rejects=%lu",
+              st->breaker_trips, st->breaker_rejects);
+    fakio_log(LOG_INFO, "handshake: total=%lu early_data=%lu early_bytes=%lu "
+              "tickets_issued=%lu resumed=%lu rejected=%lu replays=%lu",
+              st->handshakes, st->early_data, st->early_bytes,
+              st->tickets_issued, st->tickets_resumed, st->tickets_rejected,
+              st->replays_rejected);
+    fakio_log(LOG_INFO, "mux: sessions=%lu streams=%lu",
+              st->mux_sessions, st->mux_streams);
+    fakio_log(LOG_INFO, "udp: sessions=%lu sent=%lu avg=%.2f received=%lu avg=%.2f dropped=%lu",
+              st->udp_sessions, st->udp.sent,
+              st->udp.send_calls ? (double)st->udp.sent / st->udp.send_calls : 0.0,
+              st->udp.received,
+              st->udp.recv_calls ? (double)st->udp.received / st->udp.recv_calls : 0.0,
+              st->udp.dropped);
+    fakio_log(LOG_INFO, "stripe: sessions=%lu joins=%lu",
+              st->stripe_sessions, st->stripe_joins);
+    int i, n;
+    char buf[64];
+    const struct fnet_source *src = fnet_source_list(&n);
+    for (i = 0; i < n; i++) {
+        fakio_log(LOG_INFO, "source %s: connects=%lu failed=%lu",
+                  fnet_addr_str(&src[i].addr, buf, sizeof(buf)),
+                  src[i].connects, src[i].failed);
+    }
+    if (server->zerocopy_threshold > 0) {
+        fakio_log(LOG_INFO, "zerocopy: sends=%lu copied=%lu",
+                  st->zerocopy_sends, st->zerocopy_copied);
+    }
+
+    return server->stats_interval * 1000;
+}
+
 int main (int argc, char *argv[])
 {
     if (argc != 2) {
@@ -31,6 +99,86 @@ int main (int argc, char *argv[])
     }
     
     load_config_file(argv[1], &server);
+    if (server.accept_batch <= 0) {
+        server.accept_batch = DEFAULT_ACCEPT_BATCH;
+    }
+    if (server.coalesce_batch <= 0 || server.coalesce_batch > FBUF_CHAIN_SIZE) {
+        server.coalesce_batch = BUFSIZE;
+    }
+    if (server.coalesce_delay < 0) {
+        server.coalesce_delay = 0;
+    }
+    if (server.connect_timeout <= 0) {
+        server.connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+    }
+    if (server.happy_eyeballs_delay <= 0) {
+        server.happy_eyeballs_delay = DEFAULT_HAPPY_EYEBALLS_DELAY;
+    }
+    if (server.breaker_threshold == 0) {
+        server.breaker_threshold = DEFAULT_BREAKER_THRESHOLD;
+    }
+    if (server.breaker_backoff <= 0) {
+        server.breaker_backoff = DEFAULT_BREAKER_BACKOFF;
+    }
+    if (server.breaker_max_backoff <= 0) {
+        server.breaker_max_backoff = DEFAULT_BREAKER_MAX_BACKOFF;
+    }
+    if (server.breaker_threshold > 0) {
+        server.breaker = fbreaker_create(DEFAULT_BREAKER_SIZE, server.breaker_threshold,
+                                         server.breaker_backoff, server.breaker_max_backoff);
+        if (server.breaker == NULL) {
+            fakio_log(LOG_ERROR, "Create Breaker Error!");
+            exit(1);
+        }
+    }
+    if (server.ticket_lifetime == 0) {
+        server.ticket_lifetime = DEFAULT_TICKET_LIFETIME;
+    }
+    if (server.ticket_lifetime > 0) {
+        server.tickets = fticket_create(server.ticket_secret, server.ticket_lifetime);
+        memset(server.ticket_secret, 0, sizeof(server.ticket_secret));
+        if (server.tickets == NULL) {
+            fakio_log(LOG_ERROR, "Create Ticket Key Error!");
+            exit(1);
+        }
+    }
+    if (server.replay_window == 0) {
+        server.replay_window = DEFAULT_REPLAY_WINDOW;
+    }
+    if (server.replay_cache <= 0) {
+        server.replay_cache = DEFAULT_REPLAY_CACHE;
+    }
+    if (server.replay_window > 0) {
+        server.replay = freplay_create(server.replay_cache, server.replay_window);
+        if (server.replay == NULL) {
+            fakio_log(LOG_ERROR, "Create Replay Cache Error!");
+            exit(1);
+        }
+    }
+    if (server.udp_timeout == 0) {
+        server.udp_timeout = DEFAULT_UDP_TIMEOUT;
+    }
+    if (server.resolver_threads <= 0) {
+        server.resolver_threads = DEFAULT_RESOLVER_THREADS;
+    }
+    /* 没有配置时使用默认值，配置成负数表示关闭 */
+    if (server.dns_cache_size == 0) {
+        server.dns_cache_size = DEFAULT_DNS_CACHE_SIZE;
+    }
+    if (server.dns_ttl == 0) {
+        server.dns_ttl = DEFAULT_DNS_TTL;
+    }
+    if (server.dns_negative_ttl == 0) {
+        server.dns_negative_ttl = DEFAULT_DNS_NEGATIVE_TTL;
+    }
+    if (server.dns_ttl < 0) {
+        server.dns_cache_size = 0;
+    }
+    if (fnet_dns_cache_init(server.dns_cache_size, server.dns_ttl,
+                            server.dns_negative_ttl) < 0) {
+        fakio_log(LOG_ERROR, "Create DNS Cache Error!");
+        exit(1);
+    }
 
     server.r = fcrypt_rand_new();
     if (server.r == NULL) {
@@ -67,7 +215,13 @@ int main (int argc, char *argv[])
         exit(1);
     }
     
-    int listen_sd = fnet_create_and_bind(server.host, server.port);
+    server.resolver = fresolver_create(server.loop, server.resolver_threads);
+    if (server.resolver == NULL) {
+        fakio_log(LOG_ERROR, "Create Resolver Error!");
+        exit(1);
+    }
+
+    int listen_sd = fnet_create_and_bind(server.host, server.port, 0);
     
     if (listen_sd < 0) {
         fakio_log(LOG_ERROR, "create server bind error");
@@ -77,6 +231,10 @@ int main (int argc, char *argv[])
         fakio_log(LOG_ERROR, "create server listen error");
         exit(1);
     }
+    /* 客户端的握手数据可以直接放在 SYN 中，省掉一个 RTT */
+    if (server.fastopen > 0) {
+        fnet_fastopen_listen(listen_sd, server.fastopen);
+    }
 
     signal(SIGPIPE, SIG_IGN);
     
@@ -90,6 +248,10 @@ int main (int argc, char *argv[])
     sigaction(SIGINT, &act, NULL);
 
     create_event(server.loop, listen_sd, EV_RDABLE, &server_accept_cb, &server);
+    if (server.stats_interval > 0) {
+        create_time_event(server.loop, server.stats_interval * 1000,
+                          &stats_timer_cb, &server);
+    }
 
     fakio_log(LOG_INFO, "Fakio server start...... binding in %s:%s", server.host, server.port);
     fakio_log(LOG_INFO, "Fakio server event loop start, use %s", get_event_api_name());
@@ -0,0 +1,626 @@
+#include "fstripe.h"
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/*
+ * 主连接的 fd 同时用于上传，event loop 中每个 fd 只有一个 evdata，所以这里
+ * 的回调和 fhandler/fclient 一样以 context 为 evdata，由 c->stripe 找到 stripe
+ */
+static void source_readable_cb(struct event_loop *loop, int fd, int mask, void *evdata);
+static void member_writable_cb(struct event_loop *loop, int fd, int mask, void *evdata);
+static void member_closed_cb(struct event_loop *loop, int fd, int mask, void *evdata);
+static void member_readable_cb(struct event_loop *loop, int fd, int mask, void *evdata);
+static void local_writable_cb(struct event_loop *loop, int fd, int mask, void *evdata);
+static int stripe_output(fstripe_t *s);
+
+#define READ_ROUNDS 16 /* server 每次最多从 remote 读的帧数，不让一个请求占住 event loop */
+
+/* server 上正在进行的 stripe，按 GROUP 的 hash 分桶 */
+static fstripe_t *table[FSTRIPE_HASH_SIZE];
+
+static inline void frame_header(uint8_t *hdr, uint32_t seq, int len)
+{
+    *(uint32_t *)hdr = htonl(seq);
+    *(uint16_t *)(hdr + 4) = htons(len);
+}
+
+/* 连接的 fd: server 上是 client_fd，client 上是 remote_fd */
+static inline int member_fd(const fstripe_t *s, const context_t *c)
+{
+    return s->mode == FSTRIPE_SERVER ? c->client_fd : c->remote_fd;
+}
+
+static struct fstripe_member *member_find(fstripe_t *s, const context_t *c)
+{
+    int i;
+
+    for (i = 0; i < FSTRIPE_MAX; i++) {
+        if (s->members[i].c == c) {
+            return &s->members[i];
+        }
+    }
+    return NULL;
+}
+
+/* 请求出错，释放主连接，同时销毁 stripe 并释放其它连接 */
+static inline void stripe_fail(fstripe_t *s)
+{
+    context_pool_release(s->c->pool, s->c, MASK_CLIENT|MASK_REMOTE);
+}
+
+/*
+ * server: out 空间最多的连接，空间相同时从上次选中的下一个开始轮流。
+ * 发得慢的连接 out 中积压着帧，就分不到新的帧
+ *
+ * Return value: NULL 没有一条连接有 need 字节的空间
+ */
+static context_t *member_pick(fstripe_t *s, int need)
+{
+    int i, j, space, best = -1, most = need - 1;
+    context_t *c;
+
+    for (j = 0; j < FSTRIPE_MAX; j++) {
+        i = (s->next_member + j) % FSTRIPE_MAX;
+        c = s->members[i].c;
+        if (c == NULL || !s->members[i].started || c->client_fd == 0) {
+            continue;
+        }
+        space = fbuf_chain_space(c->res);
+        if (space > most) {
+            most = space;
+            best = i;
+        }
+    }
+    if (best < 0) {
+        return NULL;
+    }
+    s->next_member = (best + 1) % FSTRIPE_MAX;
+    return s->members[best].c;
+}
+
+/* server: Return value: 0 正常, -1 出错并且 stripe 已经销毁 */
+static int member_flush(fstripe_t *s, context_t *c)
+{
+    int r = fnet_send_chain(c->client_fd, &c->res, 0);
+    if (r < 0) {
+        LOG_FOR_DEBUG("send() to stripe %d failed: %s", c->client_fd, strerror(errno));
+        stripe_fail(s);
+        return -1;
+    }
+    if (r == 0) {
+        arm_event(s->loop, c->client_fd, EV_WRABLE, &member_writable_cb, c);
+    } else if (get_event_mask(s->loop, c->client_fd) & EV_WRABLE) {
+        delete_event(s->loop, c->client_fd, EV_WRABLE);
+    }
+    return 0;
+}
+
+/* server: FIN 已经放进 out 并且所有连接都发完了，请求结束，Return value: 1 已经结束 */
+static int stripe_done(fstripe_t *s)
+{
+    int i;
+
+    if (s->fin != 2) {
+        return 0;
+    }
+    for (i = 0; i < FSTRIPE_MAX; i++) {
+        if (s->members[i].started && fbuf_chain_len(s->members[i].c->res) > 0) {
+            return 0;
+        }
+    }
+    context_pool_release(s->c->pool, s->c, MASK_CLIENT|MASK_REMOTE);
+    return 1;
+}
+
+/*
+ * server: 所有数据帧之后放一个 FIN，没有连接有空间时等某条连接可写
+ *
+ * Return value: 0 正常, -1 stripe 已经销毁(出错或者请求结束)
+ */
+static int fin_put(fstripe_t *s)
+{
+    struct iovec iov[FBUF_CHAIN_MAX];
+    uint8_t hdr[FSTRIPE_HDR_LEN];
+    int cnt;
+
+    context_t *c = member_pick(s, FSTRIPE_HDR_LEN);
+    if (c == NULL) {
+        return 0;
+    }
+    cnt = fbuf_chain_write_iov(c->res, iov, FSTRIPE_HDR_LEN);
+    frame_header(hdr, s->seq, 0);
+    fbuf_iov_copy(iov, cnt, 0, hdr, FSTRIPE_HDR_LEN);
+    fbuf_chain_commit_write(c->res, FSTRIPE_HDR_LEN);
+    fcrypt_encrypt_iov(c->crypto, iov, cnt, FSTRIPE_HDR_LEN);
+    s->fin = 2;
+
+    if (member_flush(s, c) < 0 || stripe_done(s)) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * server: 读取 remote 的数据直接作为帧写入选中的连接的 out，头部预留在
+ * 前面，读完再填上 SEQ 和长度，每条连接用自己的 crypto 加密。所有连接的
+ * out 都放不下一个帧时暂停读取，某条连接可写时恢复
+ */
+static void source_readable_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    context_t *pc = evdata, *c;
+    fstripe_t *s = pc->stripe;
+    struct iovec iov[FBUF_CHAIN_MAX], riov[FBUF_CHAIN_MAX];
+    uint8_t hdr[FSTRIPE_HDR_LEN];
+    int n, cnt, rcnt, rc, limit;
+
+    /* 主连接的 client 已经关闭，只等 req 中剩下的数据发完 */
+    if (pc->client_fd == 0) {
+        delete_event(loop, fd, EV_RDABLE);
+        return;
+    }
+
+    for (n = 0; n < READ_ROUNDS; n++) {
+        c = member_pick(s, BUFSIZE);
+        if (c == NULL) {
+            delete_event(loop, fd, EV_RDABLE);
+            s->paused = 1;
+            return;
+        }
+        limit = FSTRIPE_FRAME_MAX;
+        cnt = fbuf_chain_write_iov(c->res, iov, FSTRIPE_HDR_LEN + limit);
+        rcnt = fbuf_iov_skip(iov, cnt, FSTRIPE_HDR_LEN, riov);
+
+        do {
+            rc = readv(fd, riov, rcnt);
+        } while (rc < 0 && errno == EINTR);
+
+        if (rc < 0) {
+            if (errno == EAGAIN) {
+                return;
+            }
+            LOG_FOR_DEBUG("recv() failed form remote %d: %s", fd, strerror(errno));
+            stripe_fail(s);
+            return;
+        }
+        if (rc == 0) {
+            /* 上传也没有地方发了，只留下主连接的 client 发送剩下的帧 */
+            LOG_FOR_DEBUG("remote %d Connection closed", fd);
+            s->fin = 1;
+            context_pool_release(pc->pool, pc, MASK_REMOTE);
+            fin_put(s);
+            return;
+        }
+
+        frame_header(hdr, s->seq++, rc);
+        fbuf_iov_copy(iov, cnt, 0, hdr, FSTRIPE_HDR_LEN);
+        fbuf_chain_commit_write(c->res, FSTRIPE_HDR_LEN + rc);
+        fcrypt_encrypt_iov(c->crypto, iov, cnt, FSTRIPE_HDR_LEN + rc);
+
+        if (member_flush(s, c) < 0) {
+            return;
+        }
+        /* socket 暂时读空了 */
+        if (rc < limit) {
+            return;
+        }
+    }
+}
+
+static void member_writable_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    context_t *c = evdata;
+    fstripe_t *s = c->stripe;
+
+    if (member_flush(s, c) < 0) {
+        return;
+    }
+    if (s->fin == 1) {
+        fin_put(s);
+        return;
+    }
+    if (stripe_done(s)) {
+        return;
+    }
+    if (s->paused && fbuf_chain_space(c->res) >= BUFSIZE) {
+        s->paused = 0;
+        arm_event(loop, s->c->remote_fd, EV_RDABLE, &source_readable_cb, s->c);
+    }
+}
+
+/* server: 其它连接上 client 不会再发数据，只等它关闭 */
+static void member_closed_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    context_t *c = evdata;
+    char buf[64];
+
+    int rc = recv(fd, buf, sizeof(buf), 0);
+    if (rc > 0 || (rc < 0 && errno == EAGAIN)) {
+        return;
+    }
+    LOG_FOR_DEBUG("stripe %d connection closed", fd);
+    stripe_fail(c->stripe);
+}
+
+/*
+ * client: 队头的帧，Return value: 1 完整, 0 还不完整, -1 格式错误。帧不超过
+ * 一块 buffer，in 满了的时候队头一定是完整的帧
+ */
+static int frame_head(fstripe_t *s, context_t *c, uint32_t *seq, int *len)
+{
+    uint8_t hdr[FSTRIPE_HDR_LEN];
+    int avail = fbuf_chain_len(c->res);
+
+    if (avail < FSTRIPE_HDR_LEN) {
+        return 0;
+    }
+    fbuf_chain_peek(c->res, 0, hdr, FSTRIPE_HDR_LEN);
+    *seq = ntohl(*(uint32_t *)hdr);
+    *len = ntohs(*(uint16_t *)(hdr + 4));
+    if (*len > FSTRIPE_FRAME_MAX || *seq < s->seq) {
+        return -1;
+    }
+    return avail >= FSTRIPE_HDR_LEN + *len;
+}
+
+/*
+ * client: 按 SEQ 把各条连接队头的帧移到 out。每条连接上的帧本来就是按
+ * SEQ 排好的，下一个帧只可能在某条连接的队头
+ *
+ * Return value: 1 下一个帧还没有到, 0 out 满了或者已经收到 FIN, -1 帧格式错误
+ */
+static int stripe_reorder(fstripe_t *s)
+{
+    struct iovec iov[FBUF_CHAIN_MAX];
+    struct fstripe_member *m;
+    uint32_t seq;
+    int i, j, r, cnt, off, len = 0;
+
+    while (!s->fin) {
+        if (fbuf_chain_space(s->out) < FSTRIPE_FRAME_MAX) {
+            return 0;
+        }
+        for (i = 0, m = NULL; i < FSTRIPE_MAX && m == NULL; i++) {
+            /* 还在握手的连接 res 中可能是 server 回复的一部分，不是帧 */
+            if (s->members[i].c == NULL || !s->members[i].started) {
+                continue;
+            }
+            r = frame_head(s, s->members[i].c, &seq, &len);
+            if (r < 0) {
+                return -1;
+            }
+            if (r > 0 && seq == s->seq) {
+                m = &s->members[i];
+            }
+        }
+        if (m == NULL) {
+            return 1;
+        }
+
+        if (len == 0) {
+            s->fin = 1;
+        } else {
+            cnt = fbuf_chain_write_iov(s->out, iov, len);
+            for (j = 0, off = FSTRIPE_HDR_LEN; j < cnt; off += iov[j].iov_len, j++) {
+                fbuf_chain_peek(m->c->res, off, iov[j].iov_base, iov[j].iov_len);
+            }
+            fbuf_chain_commit_write(s->out, len);
+            s->seq++;
+        }
+        fbuf_chain_commit_read(&m->c->res, FSTRIPE_HDR_LEN + len);
+
+        /* in 满了时暂停了读取，队头的帧取走之后继续 */
+        if (m->started && !m->eof) {
+            arm_event(s->loop, m->c->remote_fd, EV_RDABLE, &member_readable_cb, m->c);
+        }
+    }
+    return 0;
+}
+
+/*
+ * client: 所有连接都读完了，下一个帧却不在任何一条连接的队头，说明 server
+ * 那边出错了。还在握手的连接也可能带来帧
+ */
+static int stripe_stalled(fstripe_t *s)
+{
+    uint32_t seq;
+    int i, len;
+
+    if (s->fin) {
+        return 0;
+    }
+    for (i = 0; i < FSTRIPE_MAX; i++) {
+        if (s->members[i].c != NULL && !s->members[i].eof) {
+            return 0;
+        }
+    }
+    for (i = 0; i < FSTRIPE_MAX; i++) {
+        if (s->members[i].c != NULL && s->members[i].started
+            && frame_head(s, s->members[i].c, &seq, &len) > 0 && seq == s->seq) {
+            return 0;
+        }
+    }
+    fakio_log(LOG_WARNING, "stripe %d closed before FIN", s->c->remote_fd);
+    return 1;
+}
+
+/*
+ * client: 排好的数据写给本地程序，写完了再从各条连接取帧，直到写不出去
+ * 或者下一个帧还没有到
+ *
+ * Return value: 0 正常, -1 stripe 已经销毁(出错或者请求结束)
+ */
+static int stripe_output(fstripe_t *s)
+{
+    context_t *pc = s->c;
+    int r, waiting;
+
+    /* 本地程序已经关闭，只等主连接的 req 发完 */
+    if (pc->client_fd == 0) {
+        return 0;
+    }
+
+    while (1) {
+        waiting = stripe_reorder(s);
+        if (waiting < 0) {
+            fakio_log(LOG_WARNING, "stripe %d bad frame", pc->remote_fd);
+            stripe_fail(s);
+            return -1;
+        }
+        if (fbuf_chain_len(s->out) > 0) {
+            r = fnet_send_chain(pc->client_fd, &s->out, 0);
+            if (r < 0) {
+                LOG_FOR_DEBUG("send() to client %d failed: %s", pc->client_fd, strerror(errno));
+                stripe_fail(s);
+                return -1;
+            }
+            if (r == 0) {
+                arm_event(s->loop, pc->client_fd, EV_WRABLE, &local_writable_cb, pc);
+                return 0;
+            }
+        }
+        if (get_event_mask(s->loop, pc->client_fd) & EV_WRABLE) {
+            delete_event(s->loop, pc->client_fd, EV_WRABLE);
+        }
+        if (s->fin) {
+            context_pool_release(pc->pool, pc, MASK_CLIENT|MASK_REMOTE);
+            return -1;
+        }
+        if (waiting) {
+            break;
+        }
+    }
+    if (stripe_stalled(s)) {
+        stripe_fail(s);
+        return -1;
+    }
+    return 0;
+}
+
+static void local_writable_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    context_t *c = evdata;
+
+    stripe_output(c->stripe);
+}
+
+/*
+ * client: 读到的数据解密后留在这条连接的 in(c->res) 中，按顺序取出写给本地
+ * 程序。in 满了就暂停读取这条连接，TCP 的流量控制会让 server 把帧放到
+ * 别的连接上
+ */
+static void member_readable_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    context_t *c = evdata;
+    fstripe_t *s = c->stripe;
+    struct iovec iov[FBUF_CHAIN_MAX];
+    int iovcnt;
+
+    if (s->c->client_fd == 0) {
+        delete_event(loop, fd, EV_RDABLE);
+        return;
+    }
+
+    int rc = fnet_recv_chain(fd, c->res, FBUF_CHAIN_SIZE, iov, &iovcnt);
+    if (rc < 0) {
+        if (errno == EAGAIN) {
+            return;
+        }
+        if (errno == ENOBUFS) {
+            delete_event(loop, fd, EV_RDABLE);
+            return;
+        }
+        LOG_FOR_DEBUG("recv() from stripe %d failed: %s", fd, strerror(errno));
+        stripe_fail(s);
+        return;
+    }
+    if (rc == 0) {
+        /* 剩下的帧还要用，先不释放这条连接 */
+        LOG_FOR_DEBUG("stripe %d connection closed", fd);
+        member_find(s, c)->eof = 1;
+        delete_event(loop, fd, EV_RDABLE);
+        stripe_output(s);
+        return;
+    }
+
+    fcrypt_decrypt_iov(c->crypto, iov, iovcnt, rc);
+    s->received += rc;
+    if (stripe_output(s) < 0) {
+        return;
+    }
+
+    /* 确实是个大的下载才值得多建几条连接，open 中连接失败不会销毁 stripe */
+    if (!s->opened && !s->fin && s->received >= FSTRIPE_OPEN_BYTES) {
+        s->opened = 1;
+        if (s->open != NULL) {
+            s->open(s);
+        }
+    }
+}
+
+fstripe_t *fstripe_create(context_t *c, int mode, const uint8_t *id,
+                          fstripe_open_callback *open, fstripe_close_callback *close,
+                          void *data)
+{
+    fstripe_t *s = malloc(sizeof(*s));
+    if (s == NULL) return NULL;
+
+    /* members、计数和标志都从 0 开始 */
+    memset(s, 0, sizeof(*s));
+    if (mode == FSTRIPE_CLIENT) {
+        FBUF_CREATE(s->out);
+        if (s->out == NULL) {
+            free(s);
+            return NULL;
+        }
+    }
+    memcpy(s->id, id, FSTRIPE_ID_LEN);
+    s->mode = mode;
+    s->c = c;
+    s->loop = c->loop;
+    s->members[0].c = c;
+    s->nmembers = 1;
+    s->open = open;
+    s->close = close;
+    s->data = data;
+    return s;
+}
+
+int fstripe_join(fstripe_t *s, context_t *c)
+{
+    int i;
+
+    /* FIN 已经放进 out 时不会再有帧了 */
+    if (s->closing || s->fin || s->nmembers >= FSTRIPE_MAX) {
+        return -1;
+    }
+    for (i = 0; s->members[i].c != NULL; i++);
+    s->members[i].c = c;
+    s->members[i].started = 0;
+    s->members[i].eof = 0;
+    s->nmembers++;
+    return 0;
+}
+
+void fstripe_leave(fstripe_t *s, context_t *c)
+{
+    struct fstripe_member *m = member_find(s, c);
+    int i, started;
+
+    if (m == NULL) return;
+    started = m->started;
+    m->c = NULL;
+    m->started = m->eof = 0;
+    s->nmembers--;
+
+    if (c != s->c) {
+        if (s->closing) {
+            return;
+        }
+        if (s->mode == FSTRIPE_SERVER) {
+            /* 这条连接的 out 中可能还有帧，client 再也拼不出完整的数据 */
+            if (started) {
+                stripe_fail(s);
+            }
+        } else if (s->members[0].started && stripe_stalled(s)) {
+            /* 这是最后一条还没有读完的连接 */
+            stripe_fail(s);
+        }
+        return;
+    }
+
+    s->closing = 1;
+    for (i = 0; i < FSTRIPE_MAX; i++) {
+        context_t *mc = s->members[i].c;
+        if (mc != NULL) {
+            context_pool_release(mc->pool, mc, MASK_CLIENT|MASK_REMOTE);
+        }
+    }
+    if (s->close != NULL) {
+        s->close(s);
+    }
+    if (s->out != NULL) {
+        fbuf_chain_free(s->out);
+    }
+    free(s);
+}
+
+int fstripe_start(fstripe_t *s, context_t *c)
+{
+    int fd = member_fd(s, c);
+
+    member_find(s, c)->started = 1;
+    if (s->mode == FSTRIPE_CLIENT) {
+        if (create_event(s->loop, fd, EV_RDABLE, &member_readable_cb, c) < 0) {
+            stripe_fail(s);
+            return -1;
+        }
+        return 0;
+    }
+
+    /* 主连接的 client_fd 由 fhandler 读取上传的数据 */
+    if (c != s->c && create_event(s->loop, fd, EV_RDABLE, &member_closed_cb, c) < 0) {
+        stripe_fail(s);
+        return -1;
+    }
+    if (member_flush(s, c) < 0) {
+        return -1;
+    }
+    /* 在握手的时候 remote 关闭了，FIN 可能还在等空间 */
+    if (s->fin == 1) {
+        return fin_put(s);
+    }
+    if (stripe_done(s)) {
+        return -1;
+    }
+    if (c == s->c) {
+        if (create_event(s->loop, c->remote_fd, EV_RDABLE, &source_readable_cb, c) < 0) {
+            stripe_fail(s);
+            return -1;
+        }
+    } else if (s->paused) {
+        s->paused = 0;
+        arm_event(s->loop, s->c->remote_fd, EV_RDABLE, &source_readable_cb, s->c);
+    }
+    return 0;
+}
+
+static inline unsigned int stripe_hash(const uint8_t *id)
+{
+    uint32_t h;
+
+    memcpy(&h, id, sizeof(h));
+    return h % FSTRIPE_HASH_SIZE;
+}
+
+fstripe_t *fstripe_lookup(const uint8_t *id)
+{
+    fstripe_t *s;
+
+    for (s = table[stripe_hash(id)]; s != NULL; s = s->hnext) {
+        if (memcmp(s->id, id, FSTRIPE_ID_LEN) == 0) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+void fstripe_link(fstripe_t *s)
+{
+    unsigned int h = stripe_hash(s->id);
+
+    s->hnext = table[h];
+    table[h] = s;
+}
+
+void fstripe_unlink(fstripe_t *s)
+{
+    fstripe_t **p;
+
+    for (p = &table[stripe_hash(s->id)]; *p != NULL; p = &(*p)->hnext) {
+        if (*p == s) {
+            *p = s->hnext;
+            return;
+        }
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef _FAKIO_STRIPE_H_
+#define _FAKIO_STRIPE_H_
+
+#include "fakio.h"
+
+/*
+ * 一个请求使用多条 client 和 server 之间的连接: 主连接的握手带上随机的
+ * GROUP，之后的连接用同一个 GROUP 加入。上传只走主连接，和普通的请求
+ * 一样；remote 的数据切成帧分散到所有连接上，每条连接各自加密:
+ *
+ *     SEQ(4) | LEN(2) | data
+ *
+ * 每个帧优先放进 out 最空的连接，拥塞的连接自然分到更少的数据。client
+ * 按 SEQ 从各条连接的队头取帧，按顺序写给本地程序。remote 关闭时 server
+ * 发出 LEN 为 0 的 FIN，它的 SEQ 是数据帧的总数。
+ *
+ * 一条已经开始转发的连接出错时整个请求结束，还在握手的连接失败时只是
+ * 少用一条连接
+ */
+
+#define FSTRIPE_CLIENT 0
+#define FSTRIPE_SERVER 1
+
+#define FSTRIPE_MAX 8     /* 包括主连接 */
+#define FSTRIPE_ID_LEN 8
+#define FSTRIPE_HDR_LEN 6
+#define FSTRIPE_FRAME_MAX (BUFSIZE - FSTRIPE_HDR_LEN) /* 一个帧不超过一块 buffer */
+#define FSTRIPE_HASH_SIZE 64
+#define FSTRIPE_OPEN_BYTES (64*1024) /* client 收到这么多数据之后才打开其它连接 */
+
+/* client: 主连接上的数据够多了，可以打开其它连接 */
+typedef void fstripe_open_callback(fstripe_t *s);
+/* stripe 销毁之前调用 */
+typedef void fstripe_close_callback(fstripe_t *s);
+
+struct fstripe_member {
+    context_t *c;     /* 持有连接的 context，它的 res 是这条连接的帧 */
+    int started;      /* 握手已经完成，可以收发帧 */
+    int eof;          /* client: 这条连接已经读完 */
+};
+
+struct fstripe {
+    uint8_t id[FSTRIPE_ID_LEN];
+    int mode;         /* FSTRIPE_CLIENT 或者 FSTRIPE_SERVER */
+    context_t *c;     /* 主连接，持有 remote(server) 或者本地程序(client) */
+    struct event_loop *loop;
+
+    struct fstripe_member members[FSTRIPE_MAX]; /* 0 是主连接 */
+    int nmembers;
+    int next_member;  /* server: 空间相同时轮流使用 */
+
+    uint32_t seq;     /* server: 下一个帧的 SEQ; client: 下一个要写出的 SEQ */
+    int fin;          /* server: 1 remote 已经关闭, 2 FIN 已经放进 out; client: 收到了 FIN */
+    int paused;       /* server: 所有连接的 out 都满了，暂停读取 remote */
+    int opened;       /* client: 已经调用过 open */
+    int closing;      /* 正在销毁 */
+    fbuffer_t *out;   /* client: 按顺序排好、等待写给本地程序的数据 */
+    long long received;
+
+    struct fstripe *hnext; /* server: hash 表中的下一个 */
+
+    fstripe_open_callback *open;
+    fstripe_close_callback *close;
+    void *data;
+};
+
+/* c 是主连接的 context，它释放时销毁 stripe */
+fstripe_t *fstripe_create(context_t *c, int mode, const uint8_t *id,
+                          fstripe_open_callback *open, fstripe_close_callback *close,
+                          void *data);
+
+/* Return value: 0 成功, -1 已经满了或者正在关闭 */
+int fstripe_join(fstripe_t *s, context_t *c);
+
+/*
+ * 由 context 释放时调用。主连接离开时释放其它所有连接并销毁 stripe；
+ * 其它连接离开时，server 上已经开始转发的连接会结束整个请求
+ */
+void fstripe_leave(fstripe_t *s, context_t *c);
+
+/*
+ * c 的握手已经完成，开始转发，server 先发送 c->res 中的回复
+ *
+ * Return value: 0 正常, -1 出错并且 stripe 已经销毁
+ */
+int fstripe_start(fstripe_t *s, context_t *c);
+
+/* server: 按 GROUP 登记正在进行的 stripe，只在 server 的 event loop 中使用 */
+fstripe_t *fstripe_lookup(const uint8_t *id);
+void fstripe_link(fstripe_t *s);
+void fstripe_unlink(fstripe_t *s);
+
+#endif
@@ -0,0 +1,183 @@
+#include "fticket.h"
+#include <stdlib.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "base/aes.h"
+#include "base/sha2.h"
+
+struct ticket_key {
+    uint32_t period;  /* 时间段序号 */
+    int inited;
+    aes_context aes;
+    uint8_t mac[32];
+};
+
+struct fticket {
+    uint8_t base[32];
+    int lifetime;
+
+    /* 按 period 的奇偶存放当前和上一个时间段的 key */
+    struct ticket_key keys[2];
+};
+
+static void hmac_sha256(const uint8_t key[32], const uint8_t *data, size_t len,
+                        uint8_t out[32])
+{
+    sha2_context ctx;
+    uint8_t pad[64];
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        pad[i] = (i < 32 ? key[i] : 0) ^ 0x36;
+    }
+    sha2_starts(&ctx, 0);
+    sha2_update(&ctx, pad, 64);
+    sha2_update(&ctx, data, len);
+    sha2_finish(&ctx, out);
+
+    for (i = 0; i < 64; i++) {
+        pad[i] ^= 0x36 ^ 0x5c;
+    }
+    sha2_starts(&ctx, 0);
+    sha2_update(&ctx, pad, 64);
+    sha2_update(&ctx, out, 32);
+    sha2_finish(&ctx, out);
+}
+
+fticket_t *fticket_create(const char *secret, int lifetime)
+{
+    fticket_t *t = malloc(sizeof(*t));
+    if (t == NULL) return NULL;
+
+    if (secret != NULL && secret[0] != '\0') {
+        sha2((const uint8_t *)secret, strlen(secret), t->base, 0);
+    } else {
+        fcrypt_rand_t *r = fcrypt_rand_new();
+        if (r == NULL) {
+            free(t);
+            return NULL;
+        }
+        random_bytes(r, t->base, sizeof(t->base));
+        fcrypt_rand_destroy(r);
+    }
+    t->lifetime = lifetime;
+    t->keys[0].inited = t->keys[1].inited = 0;
+    return t;
+}
+
+static struct ticket_key *get_key(fticket_t *t, uint32_t period)
+{
+    struct ticket_key *k = &t->keys[period & 1];
+    uint8_t buf[32+4+1], key[32];
+
+    if (k->inited && k->period == period) {
+        return k;
+    }
+
+    /* 加密和 MAC 使用不同的 key */
+    memcpy(buf, t->base, 32);
+    *(uint32_t *)(buf + 32) = htonl(period);
+    buf[36] = 'e';
+    sha2(buf, sizeof(buf), key, 0);
+    aes_setkey_enc(&k->aes, key, 256);
+    buf[36] = 'm';
+    sha2(buf, sizeof(buf), k->mac, 0);
+
+    k->period = period;
+    k->inited = 1;
+    memset(key, 0, sizeof(key));
+    return k;
+}
+
+int fticket_issue(fticket_t *t, fcrypt_rand_t *r, const fuser_t *user,
+                  const uint8_t secret[FTICKET_SECRET_LEN], uint8_t *out)
+{
+    uint8_t plain[4 + FTICKET_SECRET_LEN + 1 + 255], iv[16], mac[32];
+    size_t off = 0;
+
+    if (user->name_len <= 0 || user->name_len > 255) {
+        return -1;
+    }
+
+    time_t now = time(NULL);
+    uint32_t period = now / t->lifetime;
+    struct ticket_key *k = get_key(t, period);
+
+    int plen = 4 + FTICKET_SECRET_LEN + 1 + user->name_len;
+    *(uint32_t *)plain = htonl((uint32_t)(now + t->lifetime));
+    memcpy(plain + 4, secret, FTICKET_SECRET_LEN);
+    plain[4 + FTICKET_SECRET_LEN] = user->name_len;
+    memcpy(plain + 4 + FTICKET_SECRET_LEN + 1, user->username, user->name_len);
+
+    *(uint32_t *)out = htonl(period);
+    random_bytes(r, out + 4, 16);
+    memcpy(iv, out + 4, 16);
+    aes_crypt_cfb128(&k->aes, AES_ENCRYPT, plen, &off, iv, plain, out + 20);
+    memset(plain, 0, sizeof(plain));
+
+    hmac_sha256(k->mac, out, 20 + plen, mac);
+    memcpy(out + 20 + plen, mac, 16);
+
+    return 20 + plen + 16;
+}
+
+int fticket_open(fticket_t *t, const uint8_t *ticket, int len,
+                 uint8_t secret[FTICKET_SECRET_LEN], uint8_t *name, int *name_len)
+{
+    uint8_t plain[4 + FTICKET_SECRET_LEN + 1 + 255], iv[16], mac[32];
+    size_t off = 0;
+    int i, diff = 0;
+
+    if (len < FTICKET_LEN(1) || len > FTICKET_MAX_LEN) {
+        return -1;
+    }
+
+    time_t now = time(NULL);
+    uint32_t cur = now / t->lifetime;
+    uint32_t period = ntohl(*(uint32_t *)ticket);
+    if (period != cur && period + 1 != cur) {
+        return -1;
+    }
+    struct ticket_key *k = get_key(t, period);
+
+    int plen = len - 20 - 16;
+    hmac_sha256(k->mac, ticket, 20 + plen, mac);
+    for (i = 0; i < 16; i++) {
+        diff |= mac[i] ^ ticket[20 + plen + i];
+    }
+    if (diff != 0) {
+        return -1;
+    }
+
+    memcpy(iv, ticket + 4, 16);
+    aes_crypt_cfb128(&k->aes, AES_DECRYPT, plen, &off, iv, ticket + 20, plain);
+
+    int ret = -1;
+    if ((uint32_t)now < ntohl(*(uint32_t *)plain)
+        && plain[4 + FTICKET_SECRET_LEN] == len - FTICKET_LEN(0)) {
+        memcpy(secret, plain + 4, FTICKET_SECRET_LEN);
+        *name_len = plain[4 + FTICKET_SECRET_LEN];
+        memcpy(name, plain + 4 + FTICKET_SECRET_LEN + 1, *name_len);
+        ret = 0;
+    }
+    memset(plain, 0, sizeof(plain));
+    return ret;
+}
+
+void fticket_derive(const uint8_t secret[FTICKET_SECRET_LEN],
+                    const uint8_t nonce[16], uint8_t bytes[48])
+{
+    uint8_t buf[FTICKET_SECRET_LEN + 16 + 1], out[32];
+
+    memcpy(buf, secret, FTICKET_SECRET_LEN);
+    memcpy(buf + FTICKET_SECRET_LEN, nonce, 16);
+
+    buf[FTICKET_SECRET_LEN + 16] = 1;
+    sha2(buf, sizeof(buf), bytes, 0);
+    buf[FTICKET_SECRET_LEN + 16] = 2;
+    sha2(buf, sizeof(buf), out, 0);
+    memcpy(bytes + 32, out, 16);
+
+    memset(buf, 0, sizeof(buf));
+    memset(out, 0, sizeof(out));
+}
@@ -0,0 +1,38 @@
+#ifndef _FAKIO_TICKET_H_
+#define _FAKIO_TICKET_H_
+
+#include "fakio.h"
+
+/*
+ * Session ticket: 完整握手时 server 把用户名和一个随机的 secret 用 ticket
+ * key 加密后交给 client，client 之后的连接出示 ticket，双方由 secret 和
+ * 连接的 nonce 直接算出本次连接的密钥，不需要等待 server 的回复。
+ *
+ * server 不保存 ticket，只保存 ticket key。ticket key 每 lifetime 秒更换
+ * 一次，由 ticket_secret(没有配置时随机生成)和时间段序号算出，所以当前
+ * 和上一个时间段的 key 签发的 ticket 都可以使用，配置了 ticket_secret 时
+ * 重启之后也可以继续使用。
+ *
+ * KEY_ID(4) | IV(16) | 加密的 EXPIRE(4) | SECRET(32) | NAME_LEN(1) | NAME | MAC(16)
+ */
+
+#define FTICKET_SECRET_LEN 32
+#define FTICKET_LEN(name_len) (4 + 16 + 4 + FTICKET_SECRET_LEN + 1 + (name_len) + 16)
+#define FTICKET_MAX_LEN FTICKET_LEN(255)
+
+/* secret 为 NULL 时随机生成 ticket key */
+fticket_t *fticket_create(const char *secret, int lifetime);
+
+/* Return value: ticket 的长度, -1 出错 */
+int fticket_issue(fticket_t *t, fcrypt_rand_t *r, const fuser_t *user,
+                  const uint8_t secret[FTICKET_SECRET_LEN], uint8_t *out);
+
+/* Return value: 0 有效, -1 无效或者已经过期 */
+int fticket_open(fticket_t *t, const uint8_t *ticket, int len,
+                 uint8_t secret[FTICKET_SECRET_LEN], uint8_t *name, int *name_len);
+
+/* 由 secret 和 nonce 生成本次连接的 EIV, DIV, KEY，见 fcrypt_ctx_init */
+void fticket_derive(const uint8_t secret[FTICKET_SECRET_LEN],
+                    const uint8_t nonce[16], uint8_t bytes[48]);
+
+#endif
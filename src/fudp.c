@@ -0,0 +1,657 @@
+#include "fudp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+static void tunnel_readable_cb(struct event_loop *loop, int fd, int mask, void *evdata);
+static void tunnel_writable_cb(struct event_loop *loop, int fd, int mask, void *evdata);
+static void udp_readable_cb(struct event_loop *loop, int fd, int mask, void *evdata);
+
+/*
+ * recvmmsg 的接收缓冲区，也是 sendmmsg 之前打包数据报的地方。只在回调中
+ * 临时使用，每个线程一份，第一个关联创建时分配
+ */
+#define SCRATCH_SIZE (FUDP_BATCH * FUDP_GRO_MAX)
+static __thread uint8_t *scratch;
+
+/* cmsg 的缓冲区要按 cmsghdr 对齐(size_t) */
+union udp_cmsg {
+    char buf[CMSG_SPACE(sizeof(int))];
+    size_t align;
+};
+
+/* 发往 udp_fd 的一批数据报，按顺序连续地打包在 scratch 中 */
+struct udp_batch {
+    int n, used;
+    int off[FUDP_SEND_MAX];
+    int len[FUDP_SEND_MAX];
+    union fnet_addr dest[FUDP_SEND_MAX];
+};
+
+/* peer 按 sockaddr_storage 保存 */
+#define PEER(u) ((union fnet_addr *)&(u)->peer)
+
+static inline socklen_t addr_size(const union fnet_addr *addr)
+{
+    return addr->sa.sa_family == AF_INET6 ? sizeof(addr->v6) : sizeof(addr->v4);
+}
+
+/* out 发空之后只留下 FBUF_CHAIN_MAX 块，一批数据报的峰值不会一直占着内存 */
+static void chain_trim(fbuffer_t *head)
+{
+    int n = 1;
+
+    for (; head->next != NULL; head = head->next) {
+        if (++n > FBUF_CHAIN_MAX) {
+            fbuf_chain_free(head->next);
+            head->next = NULL;
+            break;
+        }
+    }
+}
+
+/* ATYP | addr | port 的长度，Return value: -1 格式错误或者数据不够 */
+static int socks_addr_len(const uint8_t *p, int len)
+{
+    int n;
+
+    if (len < 2) return -1;
+    switch (p[0]) {
+    case SOCKS_ATYPE_IPV4:
+        n = 1 + 4 + 2;
+        break;
+    case SOCKS_ATYPE_IPV6:
+        n = 1 + 16 + 2;
+        break;
+    case SOCKS_ATYPE_DNAME:
+        if (p[1] == 0) return -1;
+        n = 1 + 1 + p[1] + 2;
+        break;
+    default:
+        return -1;
+    }
+    return n <= len ? n : -1;
+}
+
+/* 关联出错或者空闲太久，释放持有它的 context，同时销毁关联 */
+static inline void udp_fail(fudp_t *u)
+{
+    context_pool_release(u->c->pool, u->c, MASK_CLIENT|MASK_REMOTE);
+}
+
+static inline void udp_dropped(fudp_t *u, int n)
+{
+    if (u->stats != NULL) {
+        u->stats->dropped += n;
+    }
+}
+
+/*
+ * 在 out 的末尾写入一个帧 LEN | hdr | data 并加密。帧不超过一块 buffer，
+ * 最多跨两块，需要时在链尾分配新的 buffer
+ *
+ * Return value: 0 成功, -1 太长或者 out 已满
+ */
+static int udp_put_frame(fudp_t *u, const uint8_t *hdr, int hlen,
+                         const uint8_t *data, int len)
+{
+    struct iovec iov[2];
+    uint8_t lb[FUDP_HDR_LEN];
+    int n, rest, cnt = 0, body = hlen + len;
+    fbuffer_t *b;
+
+    if (body > FUDP_FRAME_MAX || u->out_len + FUDP_HDR_LEN + body > FUDP_OUT_MAX) {
+        return -1;
+    }
+    b = fbuf_chain_tail(u->out);
+    for (rest = FUDP_HDR_LEN + body; rest > 0; b = b->next) {
+        n = FBUF_WRITE_LEN(b);
+        if (n > 0) {
+            if (n > rest) n = rest;
+            iov[cnt].iov_base = FBUF_WRITE_AT(b);
+            iov[cnt].iov_len = n;
+            cnt++;
+            rest -= n;
+        }
+        if (rest > 0 && b->next == NULL) {
+            FBUF_CREATE(b->next);
+            if (b->next == NULL) return -1;
+        }
+    }
+
+    *(uint16_t *)lb = htons(body);
+    fbuf_iov_copy(iov, cnt, 0, lb, FUDP_HDR_LEN);
+    fbuf_iov_copy(iov, cnt, FUDP_HDR_LEN, hdr, hlen);
+    fbuf_iov_copy(iov, cnt, FUDP_HDR_LEN + hlen, data, len);
+    fbuf_chain_commit_write(u->out, FUDP_HDR_LEN + body);
+    fcrypt_encrypt_iov(u->crypto, iov, cnt, FUDP_HDR_LEN + body);
+    u->out_len += FUDP_HDR_LEN + body;
+    return 0;
+}
+
+/* Return value: 0 正常, -1 出错并且关联已经销毁 */
+static int udp_flush(fudp_t *u)
+{
+    int r = fnet_send_chain(u->fd, &u->out, 0);
+    if (r < 0) {
+        LOG_FOR_DEBUG("send() to udp tunnel %d failed: %s", u->fd, strerror(errno));
+        udp_fail(u);
+        return -1;
+    }
+    u->out_len = fbuf_chain_len(u->out);
+    if (r == 0) {
+        arm_event(u->loop, u->fd, EV_WRABLE, &tunnel_writable_cb, u);
+        return 0;
+    }
+    if (get_event_mask(u->loop, u->fd) & EV_WRABLE) {
+        delete_event(u->loop, u->fd, EV_WRABLE);
+    }
+    chain_trim(u->out);
+    if (u->paused) {
+        u->paused = 0;
+        create_event(u->loop, u->udp_fd, EV_RDABLE, &udp_readable_cb, u);
+    }
+    return 0;
+}
+
+/* udp_fd 是 AF_INET6 时 IPv4 的地址要转成 ::ffff:a.b.c.d，Return value: -1 发不了 */
+static int dest_fix(fudp_t *u, union fnet_addr *addr)
+{
+    struct sockaddr_in v4;
+
+    if (addr->sa.sa_family == u->family) {
+        return 0;
+    }
+    if (addr->sa.sa_family != AF_INET || u->family != AF_INET6) {
+        return -1;
+    }
+    v4 = addr->v4;
+    memset(addr, 0, sizeof(*addr));
+    addr->v6.sin6_family = AF_INET6;
+    addr->v6.sin6_port = v4.sin_port;
+    addr->v6.sin6_addr.s6_addr[10] = 0xff;
+    addr->v6.sin6_addr.s6_addr[11] = 0xff;
+    memcpy(addr->v6.sin6_addr.s6_addr + 12, &v4.sin_addr, 4);
+    return 0;
+}
+
+/* server: 帧头部的 ATYP | addr | port 转成目标地址，Return value: -1 丢掉 */
+static int udp_dest(fudp_t *u, const uint8_t *hdr, union fnet_addr *addr)
+{
+    char host[MAX_HOST_LEN+1], port[MAX_PORT_LEN];
+
+    memset(addr, 0, sizeof(*addr));
+    switch (hdr[0]) {
+    case SOCKS_ATYPE_IPV4:
+        addr->v4.sin_family = AF_INET;
+        memcpy(&addr->v4.sin_addr, hdr + 1, 4);
+        memcpy(&addr->v4.sin_port, hdr + 5, 2);
+        break;
+    case SOCKS_ATYPE_IPV6:
+        addr->v6.sin6_family = AF_INET6;
+        memcpy(&addr->v6.sin6_addr, hdr + 1, 16);
+        memcpy(&addr->v6.sin6_port, hdr + 17, 2);
+        break;
+    default:
+        if (u->resolve == NULL) {
+            return -1;
+        }
+        memcpy(host, hdr + 2, hdr[1]);
+        host[hdr[1]] = '\0';
+        snprintf(port, sizeof(port), "%d", ntohs(*(uint16_t *)(hdr + 2 + hdr[1])));
+        if (u->resolve(u, host, port, addr) < 0) {
+            return -1;
+        }
+        break;
+    }
+    return dest_fix(u, addr);
+}
+
+/*
+ * 一批数据报交给 sendmmsg，使用 GSO 时把连续的、发往同一个地址的同样大小
+ * 的数据报(最后一个可以短一些)合成一个消息。udp_fd 发不出去时丢掉剩下的，
+ * 和网络上丢包一样由上层协议处理
+ */
+static void udp_send_batch(fudp_t *u, struct udp_batch *bt)
+{
+    struct mmsghdr msgs[FUDP_SEND_MAX];
+    struct iovec iov[FUDP_SEND_MAX];
+    union udp_cmsg ctrl[FUDP_SEND_MAX];
+    int first[FUDP_SEND_MAX+1];
+    struct cmsghdr *cm;
+    int i = 0, j, k, m, r, seg, total;
+
+    u->last_active = fakio_now_ms();
+    while (i < bt->n) {
+        for (m = 0; i < bt->n; i = j, m++) {
+            seg = total = bt->len[i];
+            for (j = i + 1; u->gso && j < bt->n && j - i < FUDP_GSO_SEGS
+                 && bt->len[j-1] == seg && bt->len[j] <= seg
+                 && total + bt->len[j] <= FUDP_GRO_MAX - 8
+                 && memcmp(&bt->dest[i], &bt->dest[j], addr_size(&bt->dest[i])) == 0; j++) {
+                total += bt->len[j];
+            }
+            memset(&msgs[m], 0, sizeof(msgs[m]));
+            iov[m].iov_base = scratch + bt->off[i];
+            iov[m].iov_len = total;
+            msgs[m].msg_hdr.msg_name = &bt->dest[i];
+            msgs[m].msg_hdr.msg_namelen = addr_size(&bt->dest[i]);
+            msgs[m].msg_hdr.msg_iov = &iov[m];
+            msgs[m].msg_hdr.msg_iovlen = 1;
+            if (j - i > 1) {
+                msgs[m].msg_hdr.msg_control = ctrl[m].buf;
+                msgs[m].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+                cm = CMSG_FIRSTHDR(&msgs[m].msg_hdr);
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                *(uint16_t *)CMSG_DATA(cm) = seg;
+            }
+            first[m] = i;
+        }
+        first[m] = bt->n;
+
+        for (k = 0; k < m; ) {
+            r = sendmmsg(u->udp_fd, msgs + k, m - k, 0);
+            if (u->stats != NULL) {
+                u->stats->send_calls++;
+            }
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    udp_dropped(u, bt->n - first[k]);
+                    k = m;
+                    break;
+                }
+                /* 网卡不支持 GSO 或者数据报超过了 MTU，不再合并，从这里重新发送 */
+                if (msgs[k].msg_hdr.msg_controllen > 0) {
+                    LOG_FOR_DEBUG("udp %d disable GSO: %s", u->udp_fd, strerror(errno));
+                    u->gso = 0;
+                    break;
+                }
+                LOG_FOR_DEBUG("sendmmsg() to udp %d failed: %s", u->udp_fd, strerror(errno));
+                udp_dropped(u, first[k+1] - first[k]);
+                k++;
+                continue;
+            }
+            if (u->stats != NULL) {
+                u->stats->sent += first[k+r] - first[k];
+            }
+            k += r;
+        }
+        i = k < m ? first[k] : bt->n;
+    }
+    bt->n = bt->used = 0;
+}
+
+/* 把 in 中长度为 len 的帧放进 bt，帧头之后是 ATYP | addr | port | data */
+static void udp_frame(fudp_t *u, struct udp_batch *bt, int len)
+{
+    uint8_t hdr[1+1+255+2];
+    uint8_t *p = scratch + bt->used;
+    union fnet_addr *dest = &bt->dest[bt->n];
+    int n, hlen;
+
+    if (u->mode == FUDP_CLIENT) {
+        /* 本地程序还没有发过数据报，不知道回复发到哪里 */
+        if ((PEER(u)->sa.sa_family == AF_INET6 ? PEER(u)->v6.sin6_port : PEER(u)->v4.sin_port) == 0) {
+            udp_dropped(u, 1);
+            return;
+        }
+        /* 回复给本地程序的数据报: RSV(2) | FRAG | ATYP | addr | port | data */
+        *dest = *PEER(u);
+        p[0] = p[1] = p[2] = 0;
+        fbuf_chain_peek(u->in, FUDP_HDR_LEN, p + 3, len);
+        n = 3 + len;
+    } else {
+        fbuf_chain_peek(u->in, FUDP_HDR_LEN, hdr, len < (int)sizeof(hdr) ? len : (int)sizeof(hdr));
+        hlen = socks_addr_len(hdr, len);
+        if (hlen < 0 || udp_dest(u, hdr, dest) < 0) {
+            udp_dropped(u, 1);
+            return;
+        }
+        n = len - hlen;
+        fbuf_chain_peek(u->in, FUDP_HDR_LEN + hlen, p, n);
+    }
+    bt->off[bt->n] = bt->used;
+    bt->len[bt->n] = n;
+    bt->used += n;
+    bt->n++;
+}
+
+/* 处理 in 中所有完整的帧，Return value: 0 正常, -1 出错并且关联已经销毁 */
+static int udp_input(fudp_t *u)
+{
+    struct udp_batch bt;
+    uint8_t lb[FUDP_HDR_LEN];
+    int len, avail;
+
+    bt.n = bt.used = 0;
+    while ((avail = fbuf_chain_len(u->in)) >= FUDP_HDR_LEN) {
+        fbuf_chain_peek(u->in, 0, lb, FUDP_HDR_LEN);
+        len = ntohs(*(uint16_t *)lb);
+        if (len > FUDP_FRAME_MAX) {
+            fakio_log(LOG_WARNING, "udp tunnel %d frame too long: %d", u->fd, len);
+            udp_fail(u);
+            return -1;
+        }
+        if (avail < FUDP_HDR_LEN + len) {
+            break;
+        }
+        if (bt.n == FUDP_SEND_MAX) {
+            udp_send_batch(u, &bt);
+        }
+        udp_frame(u, &bt, len);
+        fbuf_chain_commit_read(&u->in, FUDP_HDR_LEN + len);
+    }
+    if (bt.n > 0) {
+        udp_send_batch(u, &bt);
+    }
+    return 0;
+}
+
+/* client: 只接受控制连接那个 IP 发来的数据报，第一个数据报确定端口 */
+static int peer_match(fudp_t *u, const union fnet_addr *src)
+{
+    in_port_t *port;
+
+    if (src->sa.sa_family != PEER(u)->sa.sa_family) {
+        return 0;
+    }
+    if (src->sa.sa_family == AF_INET6) {
+        if (memcmp(&src->v6.sin6_addr, &PEER(u)->v6.sin6_addr, 16) != 0) {
+            return 0;
+        }
+        port = &PEER(u)->v6.sin6_port;
+    } else {
+        if (src->v4.sin_addr.s_addr != PEER(u)->v4.sin_addr.s_addr) {
+            return 0;
+        }
+        port = &PEER(u)->v4.sin_port;
+    }
+    if (*port == 0) {
+        *port = src->v4.sin_port; /* sin_port 和 sin6_port 的位置相同 */
+    }
+    return *port == src->v4.sin_port;
+}
+
+/* 收到的一个数据报写成帧放进 out，写不下就丢掉 */
+static void udp_datagram(fudp_t *u, const union fnet_addr *src,
+                         const uint8_t *p, int len)
+{
+    uint8_t hdr[1+16+2];
+    int r;
+
+    if (u->stats != NULL) {
+        u->stats->received++;
+    }
+    if (u->mode == FUDP_CLIENT) {
+        /* RSV(2) | FRAG | ATYP | addr | port | data，不支持分片 */
+        if (!peer_match(u, src) || len < 3 || p[2] != 0
+            || socks_addr_len(p + 3, len - 3) < 0) {
+            udp_dropped(u, 1);
+            return;
+        }
+        r = udp_put_frame(u, NULL, 0, p + 3, len - 3);
+    } else {
+        r = udp_put_frame(u, hdr, fnet_addr_to_socks(src, hdr), p, len);
+    }
+    if (r < 0) {
+        udp_dropped(u, 1);
+    }
+}
+
+/* GRO 合并的消息按 cmsg 中的大小切开，最后一个可以短一些 */
+static void udp_message(fudp_t *u, struct msghdr *h, int len)
+{
+    const uint8_t *p = h->msg_iov->iov_base;
+    struct cmsghdr *cm;
+    int n, seg = len;
+
+    if (h->msg_flags & MSG_TRUNC) {
+        udp_dropped(u, 1);
+        return;
+    }
+    for (cm = CMSG_FIRSTHDR(h); cm != NULL; cm = CMSG_NXTHDR(h, cm)) {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            memcpy(&seg, CMSG_DATA(cm), sizeof(int));
+        }
+    }
+    if (seg <= 0) {
+        seg = len;
+    }
+    do {
+        n = len < seg ? len : seg;
+        udp_datagram(u, h->msg_name, p, n);
+        p += n;
+        len -= n;
+    } while (len > 0);
+}
+
+/*
+ * 一次 recvmmsg 收一批数据报写成帧，每批之后发给隧道。out 放不下一批时
+ * 暂停读取，数据报留在内核中，out 发完再继续。一次最多读 4 批，不让一个
+ * 关联占住 event loop
+ */
+static void udp_readable_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    fudp_t *u = evdata;
+    struct mmsghdr msgs[FUDP_BATCH];
+    struct iovec iov[FUDP_BATCH];
+    union fnet_addr src[FUDP_BATCH];
+    union udp_cmsg ctrl[FUDP_BATCH];
+    int i, n, vlen, round;
+
+    for (round = 0; round < 4; round++) {
+        vlen = (FUDP_OUT_MAX - u->out_len) / u->slot;
+        if (vlen <= 0) {
+            delete_event(loop, fd, EV_RDABLE);
+            u->paused = 1;
+            return;
+        }
+        if (vlen > FUDP_BATCH) vlen = FUDP_BATCH;
+
+        for (i = 0; i < vlen; i++) {
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            iov[i].iov_base = scratch + i * u->slot;
+            iov[i].iov_len = u->slot;
+            msgs[i].msg_hdr.msg_name = &src[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(src[i]);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = ctrl[i].buf;
+            msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i].buf);
+        }
+
+        n = recvmmsg(fd, msgs, vlen, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_FOR_DEBUG("recvmmsg() from udp %d failed: %s", fd, strerror(errno));
+            }
+            return;
+        }
+        if (u->stats != NULL) {
+            u->stats->recv_calls++;
+        }
+        u->last_active = fakio_now_ms();
+        for (i = 0; i < n; i++) {
+            udp_message(u, &msgs[i].msg_hdr, msgs[i].msg_len);
+        }
+        if (udp_flush(u) < 0 || n < vlen) {
+            return;
+        }
+    }
+}
+
+static void tunnel_readable_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    fudp_t *u = evdata;
+    struct iovec iov[FBUF_CHAIN_MAX];
+    int iovcnt;
+
+    /* 帧不超过一块 buffer，处理完之后剩下的不完整的帧不会占满 in */
+    int rc = fnet_recv_chain(fd, u->in, FBUF_CHAIN_SIZE, iov, &iovcnt);
+    if (rc < 0) {
+        if (errno == EAGAIN) {
+            return;
+        }
+        LOG_FOR_DEBUG("recv() from udp tunnel %d failed: %s", fd, strerror(errno));
+        udp_fail(u);
+        return;
+    }
+    if (rc == 0) {
+        LOG_FOR_DEBUG("udp tunnel %d connection closed", fd);
+        udp_fail(u);
+        return;
+    }
+
+    fcrypt_decrypt_iov(u->crypto, iov, iovcnt, rc);
+    u->received += rc;
+    udp_input(u);
+}
+
+static void tunnel_writable_cb(struct event_loop *loop, int fd, int mask, void *evdata)
+{
+    udp_flush(evdata);
+}
+
+static long udp_idle_cb(struct event_loop *loop, void *evdata)
+{
+    fudp_t *u = evdata;
+    long long idle = fakio_now_ms() - u->last_active;
+
+    if (idle < u->idle_timeout) {
+        return u->idle_timeout - idle;
+    }
+    LOG_FOR_DEBUG("udp tunnel %d idle for %lld ms", u->fd, idle);
+    /* 返回 EV_TIMER_END 后由 event loop 释放定时器 */
+    u->timer = NULL;
+    udp_fail(u);
+    return EV_TIMER_END;
+}
+
+fudp_t *fudp_create(context_t *c, int fd, int udp_fd, int mode, int idle_timeout,
+                    fudp_resolve_callback *resolve, fudp_close_callback *close,
+                    void *data)
+{
+    union fnet_addr addr;
+    socklen_t len = sizeof(addr);
+    int opt = 1;
+
+    if (scratch == NULL) {
+        scratch = malloc(SCRATCH_SIZE);
+        if (scratch == NULL) return NULL;
+    }
+    if (getsockname(udp_fd, &addr.sa, &len) < 0) {
+        return NULL;
+    }
+
+    fudp_t *u = malloc(sizeof(*u));
+    if (u == NULL) return NULL;
+
+    FBUF_CREATE(u->in);
+    FBUF_CREATE(u->out);
+    if (u->in == NULL || u->out == NULL) {
+        FBUF_FREE(u->in);
+        FBUF_FREE(u->out);
+        free(u);
+        return NULL;
+    }
+    u->fd = fd;
+    u->udp_fd = udp_fd;
+    u->mode = mode;
+    u->family = addr.sa.sa_family;
+    u->c = c;
+    u->loop = c->loop;
+    u->crypto = c->crypto;
+    u->out_len = 0;
+    u->started = 0;
+    u->paused = 0;
+    u->received = 0;
+
+    /* GSO 在第一次发送失败时关闭，GRO 在这里就知道内核是否支持 */
+    u->gso = 1;
+    u->gro = (setsockopt(udp_fd, SOL_UDP, UDP_GRO, &opt, sizeof(opt)) == 0);
+    u->slot = u->gro ? FUDP_GRO_MAX : 3 + FUDP_FRAME_MAX;
+
+    u->idle_timeout = idle_timeout;
+    u->last_active = fakio_now_ms();
+    u->timer = NULL;
+    memset(&u->peer, 0, sizeof(u->peer));
+    u->stats = NULL;
+    u->resolve = resolve;
+    u->close = close;
+    u->data = data;
+    return u;
+}
+
+void fudp_destroy(fudp_t *u)
+{
+    if (u->close != NULL) {
+        u->close(u);
+    }
+    if (u->timer != NULL) {
+        delete_time_event(u->loop, u->timer);
+    }
+    delete_event(u->loop, u->udp_fd, EV_RDABLE);
+    close(u->udp_fd);
+    fbuf_chain_free(u->in);
+    fbuf_chain_free(u->out);
+    free(u);
+}
+
+int fudp_write_raw(fudp_t *u, const uint8_t *data, int len)
+{
+    struct iovec iov[FBUF_CHAIN_MAX];
+    int i, cnt, space = 0;
+
+    cnt = fbuf_chain_write_iov(u->out, iov, len);
+    for (i = 0; i < cnt; i++) {
+        space += iov[i].iov_len;
+    }
+    if (space < len) {
+        return -1;
+    }
+    fbuf_iov_copy(iov, cnt, 0, data, len);
+    fbuf_chain_commit_write(u->out, len);
+    u->out_len += len;
+    return 0;
+}
+
+int fudp_start(fudp_t *u, const uint8_t *plain, int len)
+{
+    struct iovec iov[FBUF_CHAIN_MAX];
+    int i, cnt, space = 0;
+
+    u->started = 1;
+    u->last_active = fakio_now_ms();
+    if (create_event(u->loop, u->fd, EV_RDABLE, &tunnel_readable_cb, u) < 0
+        || create_event(u->loop, u->udp_fd, EV_RDABLE, &udp_readable_cb, u) < 0) {
+        udp_fail(u);
+        return -1;
+    }
+    if (u->idle_timeout > 0) {
+        u->timer = create_time_event(u->loop, u->idle_timeout, &udp_idle_cb, u);
+    }
+
+    if (len > 0) {
+        cnt = fbuf_chain_write_iov(u->in, iov, len);
+        for (i = 0; i < cnt; i++) {
+            space += iov[i].iov_len;
+        }
+        if (space < len) {
+            udp_fail(u);
+            return -1;
+        }
+        fbuf_iov_copy(iov, cnt, 0, plain, len);
+        fbuf_chain_commit_write(u->in, len);
+        u->received += len;
+        if (udp_input(u) < 0) {
+            return -1;
+        }
+    }
+    return udp_flush(u);
+}
@@ -0,0 +1,105 @@
+#ifndef _FAKIO_UDP_H_
+#define _FAKIO_UDP_H_
+
+#include "fakio.h"
+#include <sys/socket.h>
+
+/*
+ * UDP 转发的隧道: SOCKS5 UDP ASSOCIATE 的每个关联使用一条 client 和 server
+ * 之间的连接，握手之后两个方向都是加密的帧，每个帧是一个数据报:
+ *
+ *     LEN(2) | ATYP | addr | port | data
+ *
+ * client 发出的帧中是目标地址，就是本地程序发来的数据报去掉 RSV 和 FRAG；
+ * server 发出的帧中是回复数据报的来源地址。server 为每个关联打开一个 UDP
+ * socket，client 为每个关联打开一个和本地程序通信的 UDP socket。
+ *
+ * 两端都用 recvmmsg/sendmmsg 一次收发一批数据报，内核支持时使用 UDP GRO
+ * 接收(一次收到多个同样大小的数据报)，使用 UDP GSO 把发往同一个地址的
+ * 连续的同样大小的数据报合成一次发送。关联空闲 idle_timeout 毫秒后关闭
+ */
+
+#define FUDP_CLIENT 0
+#define FUDP_SERVER 1
+
+#define FUDP_HDR_LEN 2
+#define FUDP_FRAME_MAX (BUFSIZE - FUDP_HDR_LEN) /* 一个帧不超过一块 buffer */
+#define FUDP_BATCH 16              /* 每次 recvmmsg 最多的消息数 */
+#define FUDP_SEND_MAX 64           /* 每次 sendmmsg 最多的数据报数 */
+#define FUDP_GSO_SEGS 64           /* 一次 GSO 发送最多的数据报数，见 UDP_MAX_SEGMENTS */
+#define FUDP_GRO_MAX 65535         /* GRO 合并之后的最大长度 */
+#define FUDP_OUT_MAX (64*BUFSIZE)  /* out 中最多等待发送的字节数 */
+
+/* 老版本的 glibc 没有定义，GSO 需要 Linux 4.18+，GRO 需要 Linux 5.0+ */
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+/* fnet.h 包含本文件时还没有定义 */
+union fnet_addr;
+
+/*
+ * server: 帧的目标是域名时调用，Return value: 0 addr 已经填好, -1 丢掉这个
+ * 数据报(比如还在解析)
+ */
+typedef int fudp_resolve_callback(fudp_t *u, const char *host, const char *port,
+                                  union fnet_addr *addr);
+/* 关联销毁之前调用 */
+typedef void fudp_close_callback(fudp_t *u);
+
+struct fudp {
+    int fd;           /* 隧道 */
+    int udp_fd;
+    int mode;         /* FUDP_CLIENT 或者 FUDP_SERVER */
+    int family;       /* udp_fd 的地址族，server 的 AF_INET6 socket 同时收发 IPv4 */
+    context_t *c;     /* 持有 fd 和 crypto 的 context，它释放时销毁关联 */
+    struct event_loop *loop;
+    fcrypt_ctx_t *crypto;
+
+    fbuffer_t *in;    /* 收到并解密的帧 */
+    fbuffer_t *out;   /* 已加密、等待发送的帧，可以超过 FBUF_CHAIN_MAX 块 */
+    int out_len;
+    int started;      /* crypto 已经可以使用 */
+    int paused;       /* out 满了，暂停读取 udp_fd */
+    long long received;
+
+    int gso, gro;     /* 内核是否支持 */
+    int slot;         /* 每个接收消息的缓冲区大小 */
+
+    int idle_timeout; /* 毫秒，0 表示不回收 */
+    long long last_active;
+    time_event *timer;
+
+    /* client: 本地程序的 UDP 地址，端口为 0 时从第一个同一 IP 的数据报得到 */
+    struct sockaddr_storage peer;
+
+    struct fudp_stats *stats;
+    fudp_resolve_callback *resolve;
+    fudp_close_callback *close;
+    void *data;
+};
+
+fudp_t *fudp_create(context_t *c, int fd, int udp_fd, int mode, int idle_timeout,
+                    fudp_resolve_callback *resolve, fudp_close_callback *close,
+                    void *data);
+
+/* 由 context 释放时调用，关闭 udp_fd，不关闭隧道的 fd */
+void fudp_destroy(fudp_t *u);
+
+/* 握手的回复等不加密的数据，放在所有帧之前 */
+int fudp_write_raw(fudp_t *u, const uint8_t *data, int len);
+
+/*
+ * crypto 已经可以使用，开始收发数据报，plain 是和握手一起收到的已经解密的帧
+ *
+ * Return value: 0 正常, -1 出错并且关联已经销毁
+ */
+int fudp_start(fudp_t *u, const uint8_t *plain, int len);
+
+#endif
@@ -20,6 +20,7 @@ void fakio_log(int level, const char *fmt, ...)
     va_list ap;
     char logmsg[MAX_LOG_LENGTH];
     struct timeval tv;
+    struct tm tm;
     gettimeofday(&tv,NULL);
     
     const char *timefmt = NULL;
@@ -32,7 +33,7 @@ void fakio_log(int level, const char *fmt, ...)
         default: return;
     }
 
-    off = strftime(logmsg, sizeof(logmsg), timefmt, localtime(&tv.tv_sec));
+    off = strftime(logmsg, sizeof(logmsg), timefmt, localtime_r(&tv.tv_sec, &tm));
 
     va_start(ap, fmt);
     vsnprintf(logmsg+off, sizeof(logmsg)-off, fmt, ap);
@@ -40,3 +41,12 @@ void fakio_log(int level, const char *fmt, ...)
 
     fprintf(stderr, "%s\n", logmsg);
 }
+
+
+/* 单调时钟的毫秒数，用于超时和过期判断 */
+long long fakio_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
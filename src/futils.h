@@ -8,6 +8,7 @@
 #define LOG_ERROR 3
 
 void fakio_log(int level, const char *fmt, ...);
+long long fakio_now_ms(void);
 
 /* for debug */
 #ifdef NDEBUG
@@ -0,0 +1,120 @@
+#include "../src/fakio.h"
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+/*
+ * gcc -o test_ticket test/test_ticket.c src/fticket.o src/fcrypt.o src/futils.o \
+ *     src/base/aes.o src/base/sha2.o
+ *
+ * 过期和 key 更换要等真实的时间过去，lifetime 用 2 秒，大约运行 4 秒
+ */
+
+static int failed;
+
+#define CHECK(cond, what) do {                              \
+    printf("%-48s %s\n", what, (cond) ? "OK" : "FAIL");     \
+    if (!(cond)) failed++;                                  \
+} while (0)
+
+static void wait_until(time_t t)
+{
+    while (time(NULL) < t) {
+        usleep(10000);
+    }
+}
+
+static int open_ticket(fticket_t *t, const uint8_t *ticket, int len,
+                       const uint8_t *secret, const fuser_t *user)
+{
+    uint8_t s[FTICKET_SECRET_LEN], name[256];
+    int name_len = 0;
+
+    if (fticket_open(t, ticket, len, s, name, &name_len) < 0) {
+        return -1;
+    }
+    if (memcmp(s, secret, FTICKET_SECRET_LEN) != 0 || name_len != user->name_len
+        || memcmp(name, user->username, name_len) != 0) {
+        return -2;
+    }
+    return 0;
+}
+
+int main(int argc, char const *argv[])
+{
+    fcrypt_rand_t *r = fcrypt_rand_new();
+    fuser_t user;
+    uint8_t secret[FTICKET_SECRET_LEN], ticket[FTICKET_MAX_LEN + 1], bad[FTICKET_MAX_LEN + 1];
+    int len;
+
+    memset(&user, 0, sizeof(user));
+    memcpy(user.username, "serho", 5);
+    user.name_len = 5;
+    random_bytes(r, secret, sizeof(secret));
+
+    fticket_t *t = fticket_create("test secret", 3600);
+    len = fticket_issue(t, r, &user, secret, ticket);
+    CHECK(len == FTICKET_LEN(5), "issue length");
+    CHECK(open_ticket(t, ticket, len, secret, &user) == 0, "issue then open");
+
+    /* 同一个 ticket_secret 的另一个实例(重启之后)也能打开 */
+    fticket_t *t2 = fticket_create("test secret", 3600);
+    CHECK(open_ticket(t2, ticket, len, secret, &user) == 0, "open with the same ticket_secret");
+    fticket_t *t3 = fticket_create("other secret", 3600);
+    CHECK(open_ticket(t3, ticket, len, secret, &user) < 0, "reject other ticket_secret");
+
+    memcpy(bad, ticket, len);
+    bad[len - 1] ^= 0x01;
+    CHECK(open_ticket(t, bad, len, secret, &user) < 0, "reject tampered MAC");
+
+    memcpy(bad, ticket, len);
+    bad[20 + 4] ^= 0x80;
+    CHECK(open_ticket(t, bad, len, secret, &user) < 0, "reject tampered body");
+
+    memcpy(bad, ticket, len);
+    bad[4] ^= 0x01;
+    CHECK(open_ticket(t, bad, len, secret, &user) < 0, "reject tampered IV");
+
+    memcpy(bad, ticket, len);
+    *(uint32_t *)bad = htonl(ntohl(*(uint32_t *)bad) + 1);
+    CHECK(open_ticket(t, bad, len, secret, &user) < 0, "reject tampered KEY_ID");
+
+    /* 长度和 NAME_LEN 对不上 */
+    CHECK(open_ticket(t, ticket, len - 1, secret, &user) < 0, "reject shorter length");
+    memcpy(bad, ticket, len);
+    bad[len] = 0;
+    CHECK(open_ticket(t, bad, len + 1, secret, &user) < 0, "reject longer length");
+    CHECK(open_ticket(t, ticket, FTICKET_LEN(0), secret, &user) < 0, "reject empty name length");
+
+    user.name_len = 0;
+    CHECK(fticket_issue(t, r, &user, secret, ticket) < 0, "issue rejects empty name");
+    user.name_len = 5;
+
+    /*
+     * lifetime 为 2 秒: 在奇数秒签发，EXPIRE 是 t+2。t+1 已经换了 key，
+     * 上一个 key 的 ticket 还能用；t+2 过期；t+3 又换了一次 key
+     */
+    fticket_t *s = fticket_create(NULL, 2);
+    time_t now = time(NULL);
+    wait_until(now + (now % 2 == 0 ? 1 : 2));
+    now = time(NULL);
+    len = fticket_issue(s, r, &user, secret, ticket);
+    CHECK(open_ticket(s, ticket, len, secret, &user) == 0, "open right after issue");
+
+    wait_until(now + 1);
+    CHECK(open_ticket(s, ticket, len, secret, &user) == 0, "open after one rotation");
+
+    wait_until(now + 2);
+    CHECK(open_ticket(s, ticket, len, secret, &user) < 0, "reject after expiry");
+
+    wait_until(now + 3);
+    CHECK(open_ticket(s, ticket, len, secret, &user) < 0, "reject after two rotations");
+
+    if (failed) {
+        printf("%d failed\n", failed);
+        return 1;
+    }
+    printf("all passed\n");
+    return 0;
+}